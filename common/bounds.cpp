@@ -0,0 +1,181 @@
+#include <cmath>
+#include <algorithm>
+
+#include <common/bounds.hpp>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define BOUNDS_SSE
+#endif
+
+AABB::AABB() {}
+
+AABB::AABB(const glm::vec3& min, const glm::vec3& max)
+{
+    this->min = min;
+    this->max = max;
+}
+
+AABB AABB::fromPoints(const glm::vec3* points, unsigned int count, unsigned int stride)
+{
+    if (count == 0)
+        return AABB();
+
+    const char* bytes = reinterpret_cast<const char*>(points);
+    AABB box(points[0], points[0]);
+    for (unsigned int i = 1; i < count; i++)
+    {
+        const glm::vec3& point = *reinterpret_cast<const glm::vec3*>(bytes + i * stride);
+        box.min = glm::min(box.min, point);
+        box.max = glm::max(box.max, point);
+    }
+    return box;
+}
+
+glm::vec3 AABB::centre() const
+{
+    return 0.5f * (min + max);
+}
+
+glm::vec3 AABB::extent() const
+{
+    return 0.5f * (max - min);
+}
+
+AABB AABB::transform(const glm::mat4& matrix) const
+{
+    // Transform the centre, and project the extents onto the new axes
+    glm::vec3 c = glm::vec3(matrix * glm::vec4(centre(), 1.0f));
+    glm::vec3 e = extent();
+    glm::vec3 newExtent;
+    for (int i = 0; i < 3; i++)
+    {
+        newExtent[i] = std::abs(matrix[0][i]) * e.x + std::abs(matrix[1][i]) * e.y + std::abs(matrix[2][i]) * e.z;
+    }
+    return AABB(c - newExtent, c + newExtent);
+}
+
+BoundingSphere BoundingSphere::transform(const glm::mat4& matrix) const
+{
+    // The radius grows by the largest scale factor
+    float scale = std::max(glm::length(glm::vec3(matrix[0])),
+        std::max(glm::length(glm::vec3(matrix[1])), glm::length(glm::vec3(matrix[2]))));
+
+    BoundingSphere sphere;
+    sphere.centre = glm::vec3(matrix * glm::vec4(centre, 1.0f));
+    sphere.radius = radius * scale;
+    return sphere;
+}
+
+void BoxList::clear()
+{
+    centreX.clear(); centreY.clear(); centreZ.clear();
+    extentX.clear(); extentY.clear(); extentZ.clear();
+}
+
+void BoxList::add(const AABB& box)
+{
+    glm::vec3 c = box.centre();
+    glm::vec3 e = box.extent();
+    centreX.push_back(c.x); centreY.push_back(c.y); centreZ.push_back(c.z);
+    extentX.push_back(e.x); extentY.push_back(e.y); extentZ.push_back(e.z);
+}
+
+unsigned int BoxList::size() const
+{
+    return static_cast<unsigned int>(centreX.size());
+}
+
+Frustum::Frustum(const glm::mat4& m)
+{
+    // Gribb-Hartmann: each plane is the fourth row plus or minus another row
+    for (int i = 0; i < 3; i++)
+    {
+        planes[2 * i]     = glm::vec4(m[0][3] + m[0][i], m[1][3] + m[1][i], m[2][3] + m[2][i], m[3][3] + m[3][i]);
+        planes[2 * i + 1] = glm::vec4(m[0][3] - m[0][i], m[1][3] - m[1][i], m[2][3] - m[2][i], m[3][3] - m[3][i]);
+    }
+
+    // Normalise so plane distances are in world units
+    for (int i = 0; i < 6; i++)
+    {
+        planes[i] /= glm::length(glm::vec3(planes[i]));
+    }
+}
+
+bool Frustum::contains(const AABB& box) const
+{
+    glm::vec3 c = box.centre();
+    glm::vec3 e = box.extent();
+    for (int i = 0; i < 6; i++)
+    {
+        glm::vec3 n = glm::vec3(planes[i]);
+        float distance = glm::dot(n, c) + planes[i].w;
+        float radius = glm::dot(glm::abs(n), e);
+        if (distance + radius < 0.0f)
+            return false;
+    }
+    return true;
+}
+
+bool Frustum::contains(const BoundingSphere& sphere) const
+{
+    for (int i = 0; i < 6; i++)
+    {
+        if (glm::dot(glm::vec3(planes[i]), sphere.centre) + planes[i].w < -sphere.radius)
+            return false;
+    }
+    return true;
+}
+
+unsigned int Frustum::cull(const BoxList& boxes, std::vector<unsigned char>& visible) const
+{
+    unsigned int count = boxes.size();
+    visible.assign(count, 0);
+    unsigned int numVisible = 0;
+    unsigned int i = 0;
+
+#ifdef BOUNDS_SSE
+    // Four boxes at a time: a box is outside if centre distance + projected extent < 0 for any plane
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 cx = _mm_loadu_ps(&boxes.centreX[i]);
+        __m128 cy = _mm_loadu_ps(&boxes.centreY[i]);
+        __m128 cz = _mm_loadu_ps(&boxes.centreZ[i]);
+        __m128 ex = _mm_loadu_ps(&boxes.extentX[i]);
+        __m128 ey = _mm_loadu_ps(&boxes.extentY[i]);
+        __m128 ez = _mm_loadu_ps(&boxes.extentZ[i]);
+
+        __m128 inside = _mm_cmpeq_ps(_mm_setzero_ps(), _mm_setzero_ps());
+        for (int p = 0; p < 6; p++)
+        {
+            __m128 nx = _mm_set1_ps(planes[p].x);
+            __m128 ny = _mm_set1_ps(planes[p].y);
+            __m128 nz = _mm_set1_ps(planes[p].z);
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)),
+                _mm_add_ps(_mm_mul_ps(nz, cz), _mm_set1_ps(planes[p].w)));
+            __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(std::abs(planes[p].x)), ex),
+                _mm_mul_ps(_mm_set1_ps(std::abs(planes[p].y)), ey)),
+                _mm_mul_ps(_mm_set1_ps(std::abs(planes[p].z)), ez));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+        }
+
+        int mask = _mm_movemask_ps(inside);
+        for (int j = 0; j < 4; j++)
+        {
+            visible[i + j] = (mask >> j) & 1;
+            numVisible += visible[i + j];
+        }
+    }
+#endif
+
+    // Remaining boxes
+    for (; i < count; i++)
+    {
+        glm::vec3 c(boxes.centreX[i], boxes.centreY[i], boxes.centreZ[i]);
+        glm::vec3 e(boxes.extentX[i], boxes.extentY[i], boxes.extentZ[i]);
+        visible[i] = contains(AABB(c - e, c + e)) ? 1 : 0;
+        numVisible += visible[i];
+    }
+
+    return numVisible;
+}
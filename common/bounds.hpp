@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Axis-aligned bounding box
+struct AABB
+{
+    glm::vec3 min = glm::vec3(0.0f);
+    glm::vec3 max = glm::vec3(0.0f);
+
+    // Constructors
+    AABB();
+    AABB(const glm::vec3& min, const glm::vec3& max);
+
+    // Box around a set of points
+    static AABB fromPoints(const glm::vec3* points, unsigned int count, unsigned int stride);
+
+    glm::vec3 centre() const;
+    glm::vec3 extent() const;
+
+    // Box around this box after a transformation
+    AABB transform(const glm::mat4& matrix) const;
+};
+
+// Bounding sphere
+struct BoundingSphere
+{
+    glm::vec3 centre = glm::vec3(0.0f);
+    float radius = 0.0f;
+
+    // Sphere around this sphere after a transformation
+    BoundingSphere transform(const glm::mat4& matrix) const;
+};
+
+// World-space boxes stored as separate arrays so four can be tested at once
+class BoxList
+{
+public:
+    std::vector<float> centreX, centreY, centreZ;
+    std::vector<float> extentX, extentY, extentZ;
+
+    void clear();
+    void add(const AABB& box);
+    unsigned int size() const;
+};
+
+// View frustum planes (normals point inwards)
+class Frustum
+{
+public:
+    glm::vec4 planes[6];
+
+    // Extract the planes from a projection * view matrix
+    Frustum(const glm::mat4& viewProjection);
+
+    // Is any part of the shape inside the frustum
+    bool contains(const AABB& box) const;
+    bool contains(const BoundingSphere& sphere) const;
+
+    // Test all boxes (four at a time with SSE), returns the number visible
+    unsigned int cull(const BoxList& boxes, std::vector<unsigned char>& visible) const;
+};
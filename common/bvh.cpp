@@ -0,0 +1,607 @@
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <common/bvh.hpp>
+
+float BVH::rebuildThreshold = 2.0f;
+
+unsigned int BVH::add(const AABB& box)
+{
+    Item item;
+    item.box = box;
+    item.active = true;
+
+    unsigned int id;
+    if (!freeIDs.empty())
+    {
+        id = freeIDs.back();
+        freeIDs.pop_back();
+        items[id] = item;
+    }
+    else
+    {
+        id = static_cast<unsigned int>(items.size());
+        items.push_back(item);
+    }
+
+    structureChanged = true;
+    return id;
+}
+
+void BVH::update(unsigned int id, const AABB& box)
+{
+    items[id].box = box;
+    moved = true;
+}
+
+void BVH::remove(unsigned int id)
+{
+    if (id >= items.size() || !items[id].active)
+        return;
+
+    items[id].active = false;
+    freeIDs.push_back(id);
+    structureChanged = true;
+}
+
+void BVH::update()
+{
+    if (structureChanged)
+        build();
+    else if (moved)
+    {
+        refit();
+
+        // Moving objects stretch the boxes, so rebuild once the tree has become too loose
+        if (totalArea() > builtArea * rebuildThreshold)
+            build();
+    }
+    moved = false;
+}
+
+void BVH::build()
+{
+    nodes.clear();
+    itemOrder.clear();
+    for (unsigned int i = 0; i < items.size(); i++)
+    {
+        if (items[i].active)
+            itemOrder.push_back(i);
+    }
+    structureChanged = false;
+    moved = false;
+    builds++;
+
+    if (itemOrder.empty())
+    {
+        nodeCount = 0;
+        builtArea = 0.0f;
+        return;
+    }
+
+    std::vector<glm::vec3> centres(items.size());
+    Node root;
+    root.first = 0;
+    root.count = static_cast<unsigned int>(itemOrder.size());
+    root.bounds = items[itemOrder[0]].box;
+    for (unsigned int i = 0; i < itemOrder.size(); i++)
+    {
+        centres[itemOrder[i]] = items[itemOrder[i]].box.centre();
+        root.bounds = merge(root.bounds, items[itemOrder[i]].box);
+    }
+    nodes.push_back(root);
+    split(0, centres);
+
+    nodeCount = static_cast<unsigned int>(nodes.size());
+    builtArea = totalArea();
+}
+
+void BVH::split(unsigned int nodeIndex, std::vector<glm::vec3>& centres)
+{
+    const unsigned int numBins = 16;
+    unsigned int first = nodes[nodeIndex].first;
+    unsigned int count = nodes[nodeIndex].count;
+    if (count <= maxLeafSize)
+        return;
+
+    // Split along the longest axis of the item centres
+    glm::vec3 cMin = centres[itemOrder[first]];
+    glm::vec3 cMax = cMin;
+    for (unsigned int i = first; i < first + count; i++)
+    {
+        cMin = glm::min(cMin, centres[itemOrder[i]]);
+        cMax = glm::max(cMax, centres[itemOrder[i]]);
+    }
+    glm::vec3 size = cMax - cMin;
+    int axis = 0;
+    if (size.y > size[axis]) axis = 1;
+    if (size.z > size[axis]) axis = 2;
+
+    unsigned int middle = first + count / 2;
+    if (size[axis] > 0.0f)
+    {
+        // Bin the items by centre
+        unsigned int binCounts[numBins] = {};
+        AABB binBounds[numBins];
+        float scale = numBins / size[axis];
+        for (unsigned int i = first; i < first + count; i++)
+        {
+            unsigned int bin = std::min(numBins - 1,
+                static_cast<unsigned int>((centres[itemOrder[i]][axis] - cMin[axis]) * scale));
+            const AABB& box = items[itemOrder[i]].box;
+            binBounds[bin] = binCounts[bin] == 0 ? box : merge(binBounds[bin], box);
+            binCounts[bin]++;
+        }
+
+        // Sweep from the right, then from the left, to find the cheapest split
+        float rightCost[numBins];
+        AABB right;
+        unsigned int rightCount = 0;
+        for (unsigned int i = numBins - 1; i > 0; i--)
+        {
+            if (binCounts[i] > 0)
+                right = rightCount == 0 ? binBounds[i] : merge(right, binBounds[i]);
+            rightCount += binCounts[i];
+            rightCost[i] = rightCount * surfaceArea(right);
+        }
+
+        float bestCost = INFINITY;
+        unsigned int bestBin = 0;
+        AABB left;
+        unsigned int leftCount = 0;
+        for (unsigned int i = 0; i < numBins - 1; i++)
+        {
+            if (binCounts[i] > 0)
+                left = leftCount == 0 ? binBounds[i] : merge(left, binBounds[i]);
+            leftCount += binCounts[i];
+            if (leftCount == 0 || leftCount == count)
+                continue;
+            float cost = leftCount * surfaceArea(left) + rightCost[i + 1];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestBin = i;
+            }
+        }
+
+        // Keep small nodes as leaves when splitting does not pay off
+        float leafCost = count * surfaceArea(nodes[nodeIndex].bounds);
+        if (bestCost >= leafCost && count <= 4 * maxLeafSize)
+            return;
+
+        if (bestCost < INFINITY)
+        {
+            std::vector<unsigned int>::iterator it = std::partition(
+                itemOrder.begin() + first, itemOrder.begin() + first + count,
+                [&](unsigned int id) {
+                    return std::min(numBins - 1,
+                        static_cast<unsigned int>((centres[id][axis] - cMin[axis]) * scale)) <= bestBin;
+                });
+            middle = static_cast<unsigned int>(it - itemOrder.begin());
+        }
+    }
+
+    // Create the children (median split when all the centres are in one place)
+    unsigned int leftIndex = static_cast<unsigned int>(nodes.size());
+    Node children[2];
+    children[0].first = first;
+    children[0].count = middle - first;
+    children[1].first = middle;
+    children[1].count = first + count - middle;
+    for (int c = 0; c < 2; c++)
+    {
+        children[c].bounds = items[itemOrder[children[c].first]].box;
+        for (unsigned int i = children[c].first; i < children[c].first + children[c].count; i++)
+            children[c].bounds = merge(children[c].bounds, items[itemOrder[i]].box);
+        nodes.push_back(children[c]);
+    }
+    nodes[nodeIndex].first = leftIndex;
+    nodes[nodeIndex].count = 0;
+
+    split(leftIndex, centres);
+    split(leftIndex + 1, centres);
+}
+
+void BVH::refit()
+{
+    // Children are always stored after their parent
+    for (unsigned int i = static_cast<unsigned int>(nodes.size()); i-- > 0;)
+    {
+        Node& node = nodes[i];
+        if (node.count > 0)
+        {
+            node.bounds = items[itemOrder[node.first]].box;
+            for (unsigned int j = node.first + 1; j < node.first + node.count; j++)
+                node.bounds = merge(node.bounds, items[itemOrder[j]].box);
+        }
+        else
+        {
+            node.bounds = merge(nodes[node.first].bounds, nodes[node.first + 1].bounds);
+        }
+    }
+    refits++;
+}
+
+void BVH::query(const Frustum& frustum, std::vector<unsigned int>& results) const
+{
+    if (nodes.empty())
+        return;
+
+    // Each entry carries the planes its parent was not fully inside
+    std::vector<std::pair<unsigned int, unsigned int> > stack;
+    stack.push_back(std::make_pair(0u, 0x3Fu));
+    while (!stack.empty())
+    {
+        unsigned int nodeIndex = stack.back().first;
+        unsigned int mask = stack.back().second;
+        stack.pop_back();
+        const Node& node = nodes[nodeIndex];
+
+        glm::vec3 c = node.bounds.centre();
+        glm::vec3 e = node.bounds.extent();
+        bool outside = false;
+        for (int p = 0; p < 6 && !outside; p++)
+        {
+            if (!(mask & (1 << p)))
+                continue;
+            glm::vec3 n = glm::vec3(frustum.planes[p]);
+            float distance = glm::dot(n, c) + frustum.planes[p].w;
+            float radius = glm::dot(glm::abs(n), e);
+            if (distance + radius < 0.0f)
+                outside = true;
+            else if (distance - radius >= 0.0f)
+                mask &= ~(1u << p);
+        }
+        if (outside)
+            continue;
+
+        // Everything below a node inside all the planes is visible
+        if (mask == 0)
+            addAll(nodeIndex, results);
+        else if (node.count > 0)
+        {
+            for (unsigned int i = node.first; i < node.first + node.count; i++)
+            {
+                if (items[itemOrder[i]].active && frustum.contains(items[itemOrder[i]].box))
+                    results.push_back(itemOrder[i]);
+            }
+        }
+        else
+        {
+            stack.push_back(std::make_pair(node.first, mask));
+            stack.push_back(std::make_pair(node.first + 1, mask));
+        }
+    }
+}
+
+void BVH::query(const AABB& box, std::vector<unsigned int>& results) const
+{
+    if (nodes.empty())
+        return;
+
+    std::vector<unsigned int> stack(1, 0);
+    while (!stack.empty())
+    {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+        if (!overlaps(node.bounds, box))
+            continue;
+
+        if (node.count > 0)
+        {
+            for (unsigned int i = node.first; i < node.first + node.count; i++)
+            {
+                if (items[itemOrder[i]].active && overlaps(items[itemOrder[i]].box, box))
+                    results.push_back(itemOrder[i]);
+            }
+        }
+        else
+        {
+            stack.push_back(node.first);
+            stack.push_back(node.first + 1);
+        }
+    }
+}
+
+void BVH::query(const BoundingSphere& sphere, std::vector<unsigned int>& results) const
+{
+    if (nodes.empty())
+        return;
+
+    std::vector<unsigned int> stack(1, 0);
+    while (!stack.empty())
+    {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+        if (!overlaps(node.bounds, sphere))
+            continue;
+
+        if (node.count > 0)
+        {
+            for (unsigned int i = node.first; i < node.first + node.count; i++)
+            {
+                if (items[itemOrder[i]].active && overlaps(items[itemOrder[i]].box, sphere))
+                    results.push_back(itemOrder[i]);
+            }
+        }
+        else
+        {
+            stack.push_back(node.first);
+            stack.push_back(node.first + 1);
+        }
+    }
+}
+
+bool BVH::raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance,
+    unsigned int& hit, float& distance) const
+{
+    if (nodes.empty())
+        return false;
+
+    glm::vec3 inverseDirection = 1.0f / direction;
+    float closest = maxDistance;
+    bool found = false;
+
+    // Visit the nearer child first so the closest hit can prune the other
+    std::vector<std::pair<unsigned int, float> > stack;
+    float entry;
+    if (!intersect(nodes[0].bounds, origin, inverseDirection, closest, entry))
+        return false;
+    stack.push_back(std::make_pair(0u, entry));
+    while (!stack.empty())
+    {
+        unsigned int nodeIndex = stack.back().first;
+        float nodeEntry = stack.back().second;
+        stack.pop_back();
+        if (nodeEntry > closest)
+            continue;
+
+        const Node& node = nodes[nodeIndex];
+        if (node.count > 0)
+        {
+            for (unsigned int i = node.first; i < node.first + node.count; i++)
+            {
+                float t;
+                if (items[itemOrder[i]].active &&
+                    intersect(items[itemOrder[i]].box, origin, inverseDirection, closest, t))
+                {
+                    closest = t;
+                    hit = itemOrder[i];
+                    found = true;
+                }
+            }
+        }
+        else
+        {
+            float tLeft, tRight;
+            bool hitLeft = intersect(nodes[node.first].bounds, origin, inverseDirection, closest, tLeft);
+            bool hitRight = intersect(nodes[node.first + 1].bounds, origin, inverseDirection, closest, tRight);
+            if (hitLeft && hitRight)
+            {
+                // Push the further child first so the nearer one is popped next
+                if (tLeft < tRight)
+                {
+                    stack.push_back(std::make_pair(node.first + 1, tRight));
+                    stack.push_back(std::make_pair(node.first, tLeft));
+                }
+                else
+                {
+                    stack.push_back(std::make_pair(node.first, tLeft));
+                    stack.push_back(std::make_pair(node.first + 1, tRight));
+                }
+            }
+            else if (hitLeft)
+                stack.push_back(std::make_pair(node.first, tLeft));
+            else if (hitRight)
+                stack.push_back(std::make_pair(node.first + 1, tRight));
+        }
+    }
+
+    if (found)
+        distance = closest;
+    return found;
+}
+
+const AABB& BVH::bounds(unsigned int id) const
+{
+    return items[id].box;
+}
+
+void BVH::addAll(unsigned int nodeIndex, std::vector<unsigned int>& results) const
+{
+    const Node& node = nodes[nodeIndex];
+    if (node.count > 0)
+    {
+        for (unsigned int i = node.first; i < node.first + node.count; i++)
+        {
+            if (items[itemOrder[i]].active)
+                results.push_back(itemOrder[i]);
+        }
+        return;
+    }
+    addAll(node.first, results);
+    addAll(node.first + 1, results);
+}
+
+float BVH::totalArea() const
+{
+    float area = 0.0f;
+    for (unsigned int i = 0; i < nodes.size(); i++)
+        area += surfaceArea(nodes[i].bounds);
+    return area;
+}
+
+float BVH::surfaceArea(const AABB& box)
+{
+    glm::vec3 d = box.max - box.min;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+AABB BVH::merge(const AABB& a, const AABB& b)
+{
+    return AABB(glm::min(a.min, b.min), glm::max(a.max, b.max));
+}
+
+bool BVH::overlaps(const AABB& a, const AABB& b)
+{
+    return a.min.x <= b.max.x && a.max.x >= b.min.x &&
+        a.min.y <= b.max.y && a.max.y >= b.min.y &&
+        a.min.z <= b.max.z && a.max.z >= b.min.z;
+}
+
+bool BVH::overlaps(const AABB& box, const BoundingSphere& sphere)
+{
+    // Distance from the centre to the closest point in the box
+    glm::vec3 closest = glm::clamp(sphere.centre, box.min, box.max);
+    glm::vec3 d = closest - sphere.centre;
+    return glm::dot(d, d) <= sphere.radius * sphere.radius;
+}
+
+bool BVH::intersect(const AABB& box, const glm::vec3& origin, const glm::vec3& inverseDirection,
+    float maxDistance, float& distance)
+{
+    // Slab test
+    glm::vec3 t0 = (box.min - origin) * inverseDirection;
+    glm::vec3 t1 = (box.max - origin) * inverseDirection;
+    glm::vec3 tNear = glm::min(t0, t1);
+    glm::vec3 tFar = glm::max(t0, t1);
+    float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+    float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDistance));
+    distance = enter;
+    return enter <= exit;
+}
+
+void BVH::benchmark(unsigned int count)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+    const unsigned int numQueries = 1000;
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+    std::uniform_real_distribution<float> size(0.5f, 5.0f);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+    // Random boxes in a 1000 unit cube
+    BVH tree;
+    std::vector<AABB> boxes(count);
+    BoxList boxList;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        glm::vec3 c(position(random), position(random), position(random));
+        glm::vec3 e(size(random), size(random), size(random));
+        boxes[i] = AABB(c - e, c + e);
+        boxList.add(boxes[i]);
+        tree.add(boxes[i]);
+    }
+
+    Clock::time_point start = Clock::now();
+    tree.build();
+    double buildTime = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    // Frustum queries from the middle of the scene, against the SIMD linear cull
+    std::vector<Frustum> frustums;
+    for (unsigned int i = 0; i < numQueries; i++)
+    {
+        glm::vec3 eye(position(random) * 0.5f, position(random) * 0.5f, position(random) * 0.5f);
+        glm::vec3 direction(unit(random), unit(random), unit(random));
+        glm::mat4 view = glm::lookAt(eye, eye + direction, glm::vec3(0.0f, 1.0f, 0.0f));
+        frustums.push_back(Frustum(glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.2f, 200.0f) * view));
+    }
+    std::vector<unsigned int> results;
+    std::vector<unsigned char> visible;
+    unsigned long long treeHits = 0, linearHits = 0;
+    start = Clock::now();
+    for (unsigned int i = 0; i < numQueries; i++)
+    {
+        results.clear();
+        tree.query(frustums[i], results);
+        treeHits += results.size();
+    }
+    double frustumTree = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / numQueries;
+    start = Clock::now();
+    for (unsigned int i = 0; i < numQueries; i++)
+        linearHits += frustums[i].cull(boxList, visible);
+    double frustumLinear = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / numQueries;
+    printf("Frustum: BVH %.1f us, linear %.1f us (%s)\n", frustumTree, frustumLinear,
+        treeHits == linearHits ? "results match" : "RESULTS DIFFER");
+
+    // Box queries
+    std::vector<AABB> queryBoxes;
+    for (unsigned int i = 0; i < numQueries; i++)
+    {
+        glm::vec3 c(position(random), position(random), position(random));
+        queryBoxes.push_back(AABB(c - glm::vec3(20.0f), c + glm::vec3(20.0f)));
+    }
+    treeHits = linearHits = 0;
+    start = Clock::now();
+    for (unsigned int i = 0; i < numQueries; i++)
+    {
+        results.clear();
+        tree.query(queryBoxes[i], results);
+        treeHits += results.size();
+    }
+    double boxTree = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / numQueries;
+    start = Clock::now();
+    for (unsigned int i = 0; i < numQueries; i++)
+    {
+        for (unsigned int j = 0; j < count; j++)
+            linearHits += overlaps(boxes[j], queryBoxes[i]);
+    }
+    double boxLinear = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / numQueries;
+    printf("AABB:    BVH %.1f us, linear %.1f us (%s)\n", boxTree, boxLinear,
+        treeHits == linearHits ? "results match" : "RESULTS DIFFER");
+
+    // Rays through the whole scene
+    unsigned int treeRayHits = 0, linearRayHits = 0;
+    std::vector<glm::vec3> origins, directions;
+    for (unsigned int i = 0; i < numQueries; i++)
+    {
+        origins.push_back(glm::vec3(position(random), position(random), position(random)));
+        directions.push_back(glm::normalize(glm::vec3(unit(random), unit(random), unit(random))));
+    }
+    start = Clock::now();
+    for (unsigned int i = 0; i < numQueries; i++)
+    {
+        unsigned int hit;
+        float distance;
+        treeRayHits += tree.raycast(origins[i], directions[i], 2000.0f, hit, distance);
+    }
+    double rayTree = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / numQueries;
+    start = Clock::now();
+    for (unsigned int i = 0; i < numQueries; i++)
+    {
+        glm::vec3 inverseDirection = 1.0f / directions[i];
+        float closest = 2000.0f;
+        bool found = false;
+        for (unsigned int j = 0; j < count; j++)
+        {
+            float t;
+            if (intersect(boxes[j], origins[i], inverseDirection, closest, t))
+            {
+                closest = t;
+                found = true;
+            }
+        }
+        linearRayHits += found;
+    }
+    double rayLinear = std::chrono::duration<double, std::micro>(Clock::now() - start).count() / numQueries;
+    printf("Ray:     BVH %.1f us, linear %.1f us (%s)\n", rayTree, rayLinear,
+        treeRayHits == linearRayHits ? "results match" : "RESULTS DIFFER");
+
+    // Move everything a little and refit
+    for (unsigned int i = 0; i < count; i++)
+    {
+        glm::vec3 offset(unit(random), unit(random), unit(random));
+        tree.update(i, AABB(boxes[i].min + offset, boxes[i].max + offset));
+    }
+    start = Clock::now();
+    tree.update();
+    double refitTime = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    printf("%u objects, %u nodes: build %.1f ms, refit %.1f ms (%s)\n", count, tree.nodeCount,
+        buildTime, refitTime, tree.builds > 1 ? "rebuilt" : "refitted");
+}
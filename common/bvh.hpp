@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include <common/bounds.hpp>
+
+// Bounding volume hierarchy over world-space boxes. The tree is built top
+// down with a binned surface area heuristic; when objects only move it is
+// refitted bottom up, and rebuilt once refitting has made the boxes too loose.
+class BVH
+{
+public:
+    // Items per leaf before a split is considered
+    static const unsigned int maxLeafSize = 4;
+
+    // Rebuild when the total node surface area has grown by this factor since the last build
+    static float rebuildThreshold;
+
+    // Stats
+    unsigned int nodeCount = 0;
+    unsigned int builds = 0;
+    unsigned int refits = 0;
+
+    // Add an item, returns its id
+    unsigned int add(const AABB& box);
+
+    // Move an item
+    void update(unsigned int id, const AABB& box);
+
+    // Take an item out of the tree
+    void remove(unsigned int id);
+
+    // Rebuild or refit the tree after items have been added, moved or removed
+    void update();
+
+    // Full SAH build
+    void build();
+
+    // Recompute the node boxes without changing the tree
+    void refit();
+
+    // Items overlapping the frustum, a box or a sphere
+    void query(const Frustum& frustum, std::vector<unsigned int>& results) const;
+    void query(const AABB& box, std::vector<unsigned int>& results) const;
+    void query(const BoundingSphere& sphere, std::vector<unsigned int>& results) const;
+
+    // Closest item hit by a ray, returns false if there is none
+    bool raycast(const glm::vec3& origin, const glm::vec3& direction, float maxDistance,
+        unsigned int& hit, float& distance) const;
+
+    // Item box
+    const AABB& bounds(unsigned int id) const;
+
+    // Time builds, refits and queries against linear scans over random boxes
+    static void benchmark(unsigned int count);
+
+private:
+    // Leaves have count > 0 and point into itemOrder, inner nodes point at their first child
+    // (the second child always follows it)
+    struct Node
+    {
+        AABB bounds;
+        unsigned int first;
+        unsigned int count;
+    };
+
+    struct Item
+    {
+        AABB box;
+        bool active;
+    };
+
+    std::vector<Item> items;
+    std::vector<unsigned int> freeIDs;
+    std::vector<Node> nodes;
+    std::vector<unsigned int> itemOrder;
+
+    bool structureChanged = false;
+    bool moved = false;
+    float builtArea = 0.0f;
+
+    // Split a node, recursing into its children
+    void split(unsigned int nodeIndex, std::vector<glm::vec3>& centres);
+
+    // Sum of the node surface areas
+    float totalArea() const;
+
+    // Gather every item under a node
+    void addAll(unsigned int nodeIndex, std::vector<unsigned int>& results) const;
+
+    static float surfaceArea(const AABB& box);
+    static AABB merge(const AABB& a, const AABB& b);
+    static bool overlaps(const AABB& a, const AABB& b);
+    static bool overlaps(const AABB& box, const BoundingSphere& sphere);
+    static bool intersect(const AABB& box, const glm::vec3& origin, const glm::vec3& inverseDirection,
+        float maxDistance, float& distance);
+};
@@ -0,0 +1,334 @@
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+
+#include <common/clusters.hpp>
+#include <common/renderer.hpp>
+#include <common/glstate.hpp>
+
+ClusteredLights::ClusteredLights()
+{
+    // Light properties, per-cluster ranges and light indices are read through texture buffers
+    glGenBuffers(1, &lightBuffer);
+    upload(lightBuffer, 4 * sizeof(glm::vec4), NULL);
+    glGenTextures(1, &lightTexture);
+    GLState::bindTexture(lightUnit, GL_TEXTURE_BUFFER, lightTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, lightBuffer);
+
+    glGenBuffers(1, &clusterBuffer);
+    upload(clusterBuffer, clusterCount * 2 * sizeof(unsigned int), NULL);
+    glGenTextures(1, &clusterTexture);
+    GLState::bindTexture(clusterUnit, GL_TEXTURE_BUFFER, clusterTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, clusterBuffer);
+
+    glGenBuffers(1, &indexBuffer);
+    upload(indexBuffer, sizeof(unsigned int), NULL);
+    glGenTextures(1, &indexTexture);
+    GLState::bindTexture(lightIndexUnit, GL_TEXTURE_BUFFER, indexTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, indexBuffer);
+
+    glGenBuffers(1, &objectBuffer);
+    upload(objectBuffer, sizeof(unsigned int), NULL);
+    glGenTextures(1, &objectTexture);
+    GLState::bindTexture(objectLightUnit, GL_TEXTURE_BUFFER, objectTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, objectBuffer);
+}
+
+void ClusteredLights::begin(const Camera& camera)
+{
+    view = camera.view;
+    near = camera.near;
+    far = camera.far;
+
+    // Slices are spaced exponentially so they stay roughly cube shaped with depth
+    sliceScale = slices / std::log(far / near);
+    sliceBias = -sliceScale * std::log(near);
+
+    // A view-space point is right of NDC x = a when P00 * x + a * z >= 0 (and likewise for y)
+    for (unsigned int i = 0; i <= tilesX; i++)
+        columnPlanes[i] = glm::normalize(glm::vec3(camera.projection[0][0], 0.0f, -1.0f + 2.0f * i / tilesX));
+    for (unsigned int i = 0; i <= tilesY; i++)
+        rowPlanes[i] = glm::normalize(glm::vec3(0.0f, camera.projection[1][1], -1.0f + 2.0f * i / tilesY));
+
+    directional.clear();
+    spheres.clear();
+    cones.clear();
+    sphereBins.clear();
+    coneBins.clear();
+    sphereInfluences.clear();
+    coneInfluences.clear();
+    culledCount = 0;
+}
+
+void ClusteredLights::add(const Light& lightSet)
+{
+    // Bound and bin each light in parallel, then add them to the lists in order
+    const std::vector<LightSource>& lights = lightSet.lightSources;
+    binned.resize(lights.size());
+    JobSystem::parallelFor(jobs, static_cast<unsigned int>(lights.size()), Light::chunkSize,
+        [&](unsigned int begin, unsigned int end)
+    {
+        for (unsigned int i = begin; i < end; i++)
+        {
+            const LightSource& light = lights[i];
+            Binned& result = binned[i];
+
+            // Bound point lights by their range, and spot lights by the cone inside it
+            result.radius = 0.0f;
+            result.cone = light.type == 2 && light.cosPhi > 0.0f;
+            result.culled = false;
+            if (light.type == 3)
+                continue;
+
+            // Far enough to reach every point in view when the attenuation never falls below the cutoff
+            glm::vec3 position = glm::vec3(view * glm::vec4(light.position, 1.0f));
+            float radius = std::min(light.range, glm::length(position) + 2.0f * far);
+            glm::vec4 sphere(light.position, radius);
+            if (result.cone)
+            {
+                glm::vec3 axis = glm::normalize(light.direction);
+                if (light.cosPhi > std::sqrt(0.5f))
+                    sphere = glm::vec4(light.position + axis * radius / (2.0f * light.cosPhi * light.cosPhi),
+                        radius / (2.0f * light.cosPhi * light.cosPhi));
+                else
+                    sphere = glm::vec4(light.position + axis * radius * light.cosPhi,
+                        radius * std::sqrt(1.0f - light.cosPhi * light.cosPhi));
+            }
+
+            // The view matrix is rigid, so only the centre moves
+            glm::vec4 viewSphere(glm::vec3(view * glm::vec4(glm::vec3(sphere), 1.0f)), sphere.w);
+            result.radius = radius;
+            if (radius <= 0.0f || !bin(viewSphere, result.bin))
+            {
+                result.culled = true;
+                continue;
+            }
+
+            result.influence.sphere = sphere;
+            result.influence.position = light.position;
+            result.influence.brightest = std::max(light.colour.r, std::max(light.colour.g, light.colour.b));
+            result.influence.attenuation = glm::vec3(light.constant, light.linear, light.quadratic);
+        }
+    });
+
+    for (unsigned int i = 0; i < static_cast<unsigned int>(lights.size()); i++)
+    {
+        const LightSource& light = lights[i];
+        const Binned& result = binned[i];
+        if (result.culled)
+        {
+            culledCount++;
+            continue;
+        }
+        glm::vec3 position = glm::vec3(view * glm::vec4(light.position, 1.0f));
+        glm::vec3 direction = glm::vec3(view * glm::vec4(light.direction, 0.0f));
+
+        std::vector<glm::vec4>& list = light.type == 3 ? directional : result.cone ? cones : spheres;
+        list.push_back(glm::vec4(position, static_cast<float>(light.type)));
+        list.push_back(glm::vec4(light.colour, light.cosPhi));
+        list.push_back(glm::vec4(direction, static_cast<float>(light.shadow)));
+        list.push_back(glm::vec4(light.constant, light.linear, light.quadratic, result.radius));
+        if (light.type != 3)
+        {
+            (result.cone ? coneBins : sphereBins).push_back(result.bin);
+            (result.cone ? coneInfluences : sphereInfluences).push_back(result.influence);
+        }
+    }
+}
+
+void ClusteredLights::build()
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    directionalCount = static_cast<unsigned int>(directional.size() / 4);
+    sphereCount = static_cast<unsigned int>(sphereBins.size());
+    coneCount = static_cast<unsigned int>(coneBins.size());
+    bins.assign(sphereBins.begin(), sphereBins.end());
+    bins.insert(bins.end(), coneBins.begin(), coneBins.end());
+    influences.assign(sphereInfluences.begin(), sphereInfluences.end());
+    influences.insert(influences.end(), coneInfluences.begin(), coneInfluences.end());
+    objectIndexCount = 0;
+    droppedCount = 0;
+    if (!clustering)
+        bins.clear();
+
+    // Count the lights in each cluster, then turn the counts into offsets
+    clusters.assign(clusterCount * 2, 0);
+    for (unsigned int i = 0; i < static_cast<unsigned int>(bins.size()); i++)
+    {
+        const Bin& bin = bins[i];
+        for (unsigned int z = bin.z0; z <= bin.z1; z++)
+            for (unsigned int y = bin.y0; y <= bin.y1; y++)
+                for (unsigned int x = bin.x0; x <= bin.x1; x++)
+                    clusters[2 * ((z * tilesY + y) * tilesX + x) + 1]++;
+    }
+    unsigned int offset = 0;
+    maxPerCluster = 0;
+    for (unsigned int i = 0; i < clusterCount; i++)
+    {
+        clusters[2 * i] = offset;
+        offset += clusters[2 * i + 1];
+        maxPerCluster = std::max(maxPerCluster, clusters[2 * i + 1]);
+        clusters[2 * i + 1] = 0;
+    }
+    indexCount = offset;
+
+    // Fill in the indices (into the light buffer, after the directional lights)
+    indices.resize(std::max(indexCount, 1u));
+    for (unsigned int i = 0; i < static_cast<unsigned int>(bins.size()); i++)
+    {
+        const Bin& bin = bins[i];
+        for (unsigned int z = bin.z0; z <= bin.z1; z++)
+            for (unsigned int y = bin.y0; y <= bin.y1; y++)
+                for (unsigned int x = bin.x0; x <= bin.x1; x++)
+                {
+                    unsigned int* cluster = &clusters[2 * ((z * tilesY + y) * tilesX + x)];
+                    indices[cluster[0] + cluster[1]++] = directionalCount + i;
+                }
+    }
+
+    buildTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+    // Upload the directional lights followed by the clustered ones
+    lightCount = directionalCount + sphereCount + coneCount;
+    directional.insert(directional.end(), spheres.begin(), spheres.end());
+    directional.insert(directional.end(), cones.begin(), cones.end());
+    if (directional.empty())
+        directional.resize(4, glm::vec4(0.0f));
+    upload(lightBuffer, directional.size() * sizeof(glm::vec4), &directional[0]);
+    upload(clusterBuffer, clusters.size() * sizeof(unsigned int), &clusters[0]);
+    upload(indexBuffer, indices.size() * sizeof(unsigned int), &indices[0]);
+}
+
+void ClusteredLights::toShader(unsigned int shaderID)
+{
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    GLState::useProgram(shaderID);
+    glUniform1i(glGetUniformLocation(shaderID, "lightBuffer"), lightUnit);
+    glUniform1i(glGetUniformLocation(shaderID, "clusterBuffer"), clusterUnit);
+    glUniform1i(glGetUniformLocation(shaderID, "lightIndexBuffer"), lightIndexUnit);
+    glUniform1i(glGetUniformLocation(shaderID, "objectLightBuffer"), objectLightUnit);
+    glUniform1i(glGetUniformLocation(shaderID, "objectLights"), maxObjectLights > 0);
+    glUniform1i(glGetUniformLocation(shaderID, "numDirectionalLights"), directionalCount);
+    glUniform3i(glGetUniformLocation(shaderID, "clusterGrid"), tilesX, tilesY, slices);
+    glUniform2f(glGetUniformLocation(shaderID, "clusterTileScale"),
+        static_cast<float>(tilesX) / viewport[2], static_cast<float>(tilesY) / viewport[3]);
+    glUniform1f(glGetUniformLocation(shaderID, "sliceScale"), sliceScale);
+    glUniform1f(glGetUniformLocation(shaderID, "sliceBias"), sliceBias);
+    GLState::bindTexture(lightUnit, GL_TEXTURE_BUFFER, lightTexture);
+    GLState::bindTexture(clusterUnit, GL_TEXTURE_BUFFER, clusterTexture);
+    GLState::bindTexture(lightIndexUnit, GL_TEXTURE_BUFFER, indexTexture);
+    GLState::bindTexture(objectLightUnit, GL_TEXTURE_BUFFER, objectTexture);
+}
+
+void ClusteredLights::beginObjectLights()
+{
+    objectIndices.clear();
+    droppedCount = 0;
+}
+
+glm::uvec2 ClusteredLights::objectLights(const AABB& box)
+{
+    // Rate every light whose bounding sphere touches the box by its brightness at the nearest point of the box
+    candidates.clear();
+    for (unsigned int i = 0; i < static_cast<unsigned int>(influences.size()); i++)
+    {
+        const Influence& light = influences[i];
+        glm::vec3 centre = glm::vec3(light.sphere);
+        glm::vec3 offset = centre - glm::clamp(centre, box.min, box.max);
+        if (glm::dot(offset, offset) > light.sphere.w * light.sphere.w)
+            continue;
+
+        glm::vec3 nearest = light.position - glm::clamp(light.position, box.min, box.max);
+        float d = glm::length(nearest);
+        float intensity = light.brightest /
+            (light.attenuation.x + light.attenuation.y * d + light.attenuation.z * d * d);
+        candidates.push_back(std::make_pair(intensity, directionalCount + i));
+    }
+
+    // Keep the brightest
+    unsigned int count = std::min(static_cast<unsigned int>(candidates.size()), maxObjectLights);
+    std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(),
+        std::greater<std::pair<float, unsigned int> >());
+    droppedCount += static_cast<unsigned int>(candidates.size()) - count;
+
+    glm::uvec2 list(static_cast<unsigned int>(objectIndices.size()), count);
+    for (unsigned int i = 0; i < count; i++)
+        objectIndices.push_back(candidates[i].second);
+    return list;
+}
+
+void ClusteredLights::uploadObjectLights()
+{
+    objectIndexCount = static_cast<unsigned int>(objectIndices.size());
+    if (objectIndices.empty())
+        objectIndices.push_back(0);
+    upload(objectBuffer, objectIndices.size() * sizeof(unsigned int), &objectIndices[0]);
+}
+
+bool ClusteredLights::bin(const glm::vec4& sphere, Bin& result) const
+{
+    glm::vec3 centre = glm::vec3(sphere);
+    float radius = sphere.w;
+
+    // Depth slices
+    float nearest = -centre.z - radius;
+    float farthest = -centre.z + radius;
+    if (farthest < near || nearest > far)
+        return false;
+    result.z0 = slice(std::max(nearest, near));
+    result.z1 = slice(std::min(farthest, far));
+
+    // Columns whose left plane the sphere is not wholly left of, and whose right plane it is not wholly right of
+    result.x0 = tilesX;
+    result.x1 = 0;
+    for (unsigned int i = 0; i < tilesX; i++)
+    {
+        if (glm::dot(columnPlanes[i], centre) >= -radius && glm::dot(columnPlanes[i + 1], centre) <= radius)
+        {
+            result.x0 = std::min(result.x0, i);
+            result.x1 = i;
+        }
+    }
+
+    // Rows in the same way
+    result.y0 = tilesY;
+    result.y1 = 0;
+    for (unsigned int i = 0; i < tilesY; i++)
+    {
+        if (glm::dot(rowPlanes[i], centre) >= -radius && glm::dot(rowPlanes[i + 1], centre) <= radius)
+        {
+            result.y0 = std::min(result.y0, i);
+            result.y1 = i;
+        }
+    }
+    return result.x0 <= result.x1 && result.y0 <= result.y1;
+}
+
+unsigned int ClusteredLights::slice(float depth) const
+{
+    int s = static_cast<int>(std::log(depth) * sliceScale + sliceBias);
+    return static_cast<unsigned int>(std::min(std::max(s, 0), static_cast<int>(slices) - 1));
+}
+
+void ClusteredLights::upload(unsigned int buffer, size_t bytes, const void* data)
+{
+    GLState::bindBuffer(GL_TEXTURE_BUFFER, buffer);
+    glBufferData(GL_TEXTURE_BUFFER, bytes, data, GL_STREAM_DRAW);
+}
+
+void ClusteredLights::deleteBuffers()
+{
+    glDeleteBuffers(1, &lightBuffer);
+    glDeleteBuffers(1, &clusterBuffer);
+    glDeleteBuffers(1, &indexBuffer);
+    glDeleteBuffers(1, &objectBuffer);
+    glDeleteTextures(1, &lightTexture);
+    glDeleteTextures(1, &clusterTexture);
+    glDeleteTextures(1, &indexTexture);
+    glDeleteTextures(1, &objectTexture);
+    GLState::invalidate();
+}
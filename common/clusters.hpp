@@ -0,0 +1,146 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <common/camera.hpp>
+#include <common/light.hpp>
+#include <common/bounds.hpp>
+#include <common/jobsystem.hpp>
+
+// Clustered forward lighting. The view frustum is split into a grid of screen
+// tiles and exponential depth slices, each light's bounding sphere is binned
+// into the clusters it touches on the CPU, and every fragment only loops over
+// the lights in its own cluster. Directional lights reach every cluster, so
+// they are kept in a separate list at the front of the light buffer. The
+// rest follow as the lights bounded by spheres and then the spot lights
+// bounded by cones, which is the order the deferred path draws volumes in.
+// Instead of the clusters, each object can be given its own short list of
+// the lights whose ranges overlap its world-space box, keeping only the
+// brightest few at the box.
+class ClusteredLights
+{
+public:
+    // Grid size
+    static const unsigned int tilesX = 16;
+    static const unsigned int tilesY = 12;
+    static const unsigned int slices = 24;
+    static const unsigned int clusterCount = tilesX * tilesY * slices;
+
+    // Bin the lights into clusters (the deferred path only needs the light buffer)
+    bool clustering = true;
+
+    // Lights kept for each object when using per-object lists instead of the clusters (0 to use the clusters)
+    unsigned int maxObjectLights = 0;
+
+    // Job system to bound and bin the lights added with (the calling thread does it when NULL)
+    JobSystem* jobs = NULL;
+
+    // Stats for the last frame
+    unsigned int lightCount = 0;
+    unsigned int directionalCount = 0;
+    unsigned int sphereCount = 0;
+    unsigned int coneCount = 0;
+    unsigned int culledCount = 0;
+    unsigned int indexCount = 0;
+    unsigned int maxPerCluster = 0;
+    float buildTime = 0.0f;
+    unsigned int objectIndexCount = 0;
+    unsigned int droppedCount = 0;
+
+    // Constructor (needs a current GL context)
+    ClusteredLights();
+
+    // Start this frame's light list
+    void begin(const Camera& camera);
+
+    // Add a set of lights
+    void add(const Light& lights);
+
+    // Bin the lights into clusters and upload the lists
+    void build();
+
+    // Bind the light lists and send the grid to the shader
+    void toShader(unsigned int shaderID);
+
+    // Start the per-object lists for a draw (each draw uploads its own, so the last draw's are dropped)
+    void beginObjectLights();
+
+    // List the most significant lights reaching a world-space box, returns the list's offset and length
+    glm::uvec2 objectLights(const AABB& box);
+
+    // Upload the per-object lists made since beginObjectLights
+    void uploadObjectLights();
+
+    // Cleanup
+    void deleteBuffers();
+
+private:
+    // View-space bounding sphere and cluster range of a light
+    struct Bin
+    {
+        glm::vec4 sphere;
+        unsigned int x0, x1, y0, y1, z0, z1;
+    };
+
+    // World-space bounding sphere and falloff of a light, to rate it against objects
+    struct Influence
+    {
+        glm::vec4 sphere;
+        glm::vec3 position;
+        float brightest;
+        glm::vec3 attenuation;
+    };
+
+    // Bin, falloff and range of each light being added, or whether it was culled
+    struct Binned
+    {
+        Bin bin;
+        Influence influence;
+        float radius;
+        bool cone, culled;
+    };
+    std::vector<Binned> binned;
+
+    // Camera for this frame
+    glm::mat4 view;
+    float near, far;
+    float sliceScale, sliceBias;
+
+    // Normals of the planes between tile columns and rows, facing right and up
+    glm::vec3 columnPlanes[tilesX + 1];
+    glm::vec3 rowPlanes[tilesY + 1];
+
+    // This frame's lights (view space, four texels each) and their bins
+    std::vector<glm::vec4> directional;
+    std::vector<glm::vec4> spheres, cones;
+    std::vector<Bin> sphereBins, coneBins;
+    std::vector<Bin> bins;
+    std::vector<Influence> sphereInfluences, coneInfluences;
+    std::vector<Influence> influences;
+
+    // Per-object light indices and the lights competing for one object
+    std::vector<unsigned int> objectIndices;
+    std::vector<std::pair<float, unsigned int> > candidates;
+
+    // Per-cluster offset and count, and the light indices they point to
+    std::vector<unsigned int> clusters;
+    std::vector<unsigned int> indices;
+
+    // Buffers
+    unsigned int lightBuffer, lightTexture;
+    unsigned int clusterBuffer, clusterTexture;
+    unsigned int indexBuffer, indexTexture;
+    unsigned int objectBuffer, objectTexture;
+
+    // Find the clusters a view-space sphere touches, or return false if it is outside the frustum
+    bool bin(const glm::vec4& sphere, Bin& result) const;
+
+    // Depth slice containing a view-space depth
+    unsigned int slice(float depth) const;
+
+    // Upload data to a texture buffer, orphaning the old storage
+    void upload(unsigned int buffer, size_t bytes, const void* data);
+};
@@ -0,0 +1,261 @@
+#include <cstdio>
+#include <cmath>
+
+#include <common/deferred.hpp>
+#include <common/renderer.hpp>
+#include <common/glstate.hpp>
+
+DeferredRenderer::DeferredRenderer(unsigned int lightShaderID, unsigned int compositeShaderID)
+{
+    this->lightShaderID = lightShaderID;
+    this->compositeShaderID = compositeShaderID;
+
+    // Latitude-longitude sphere pushed out so its faces enclose the unit sphere
+    const unsigned int rings = 8, segments = 12;
+    const float pi = 3.14159265f;
+    float a = pi / segments, b = pi / (2.0f * rings);
+    float scale = 1.0f / std::cos(std::sqrt(a * a + b * b));
+    std::vector<glm::vec3> vertices;
+    for (unsigned int i = 0; i < rings; i++)
+    {
+        for (unsigned int j = 0; j < segments; j++)
+        {
+            glm::vec3 corners[4];
+            for (unsigned int k = 0; k < 4; k++)
+            {
+                float theta = pi * (i + k / 2) / rings;
+                float phi = 2.0f * pi * (j + k % 2) / segments;
+                corners[k] = scale * glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            }
+            if (i > 0)
+                addTriangle(vertices, glm::vec3(0.0f), corners[0], corners[1], corners[2]);
+            if (i < rings - 1)
+                addTriangle(vertices, glm::vec3(0.0f), corners[1], corners[3], corners[2]);
+        }
+    }
+    sphereCount = static_cast<unsigned int>(vertices.size());
+    createVolume(vertices, sphereVAO, sphereBuffer);
+
+    // Cone with its apex at the origin and a unit radius base at z = 1, widened to enclose the circle
+    const unsigned int sides = 16;
+    float radius = 1.0f / std::cos(pi / sides);
+    vertices.clear();
+    for (unsigned int i = 0; i < sides; i++)
+    {
+        float phi0 = 2.0f * pi * i / sides, phi1 = 2.0f * pi * (i + 1) / sides;
+        glm::vec3 b0(radius * std::cos(phi0), radius * std::sin(phi0), 1.0f);
+        glm::vec3 b1(radius * std::cos(phi1), radius * std::sin(phi1), 1.0f);
+        addTriangle(vertices, glm::vec3(0.0f, 0.0f, 0.5f), glm::vec3(0.0f), b0, b1);
+        addTriangle(vertices, glm::vec3(0.0f, 0.0f, 0.5f), glm::vec3(0.0f, 0.0f, 1.0f), b0, b1);
+    }
+    coneCount = static_cast<unsigned int>(vertices.size());
+    createVolume(vertices, coneVAO, coneBuffer);
+
+    // The full-screen triangle is generated from the vertex IDs
+    glGenVertexArrays(1, &screenVAO);
+}
+
+void DeferredRenderer::beginGeometry()
+{
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    if (viewport[2] != width || viewport[3] != height)
+        createGBuffer(viewport[2], viewport[3]);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void DeferredRenderer::endGeometry()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, GLState::sceneFramebuffer);
+}
+
+void DeferredRenderer::drawLights(ClusteredLights& lights, const glm::mat4& projection)
+{
+    // Test the volumes against a copy of the scene depth, so it can still be sampled
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, FBO);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, accumulationFBO);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, accumulationFBO);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    // The G-buffer is read on the material texture units, with depth after the light lists
+    GLState::bindTexture(diffuseUnit, GL_TEXTURE_2D, albedoTexture);
+    GLState::bindTexture(normalUnit, GL_TEXTURE_2D, normalTexture);
+    GLState::bindTexture(specularUnit, GL_TEXTURE_2D, specularTexture);
+    GLState::bindTexture(depthUnit, GL_TEXTURE_2D, depthTexture);
+    GLState::bindVertexArray(screenVAO);
+
+    // Add up the lights without touching the depth
+    lights.toShader(lightShaderID);
+    glm::mat4 inverseProjection = glm::inverse(projection);
+    glUniformMatrix4fv(glGetUniformLocation(lightShaderID, "P"), 1, GL_FALSE, &projection[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(lightShaderID, "inverseP"), 1, GL_FALSE, &inverseProjection[0][0]);
+    glUniform1i(glGetUniformLocation(lightShaderID, "albedoBuffer"), diffuseUnit);
+    glUniform1i(glGetUniformLocation(lightShaderID, "normalBuffer"), normalUnit);
+    glUniform1i(glGetUniformLocation(lightShaderID, "specularBuffer"), specularUnit);
+    glUniform1i(glGetUniformLocation(lightShaderID, "depthBuffer"), depthUnit);
+    if (shadows != NULL)
+        shadows->toShader(lightShaderID);
+    GLState::enable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    glDepthMask(GL_FALSE);
+    volumeCount = 0;
+
+    // Directional lights cover the whole screen
+    if (lights.directionalCount > 0)
+    {
+        GLState::disable(GL_DEPTH_TEST);
+        glUniform1i(glGetUniformLocation(lightShaderID, "volume"), 0);
+        glUniform1i(glGetUniformLocation(lightShaderID, "firstLight"), 0);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 3, lights.directionalCount);
+        GLState::enable(GL_DEPTH_TEST);
+        volumeCount += lights.directionalCount;
+    }
+
+    // Shade behind the back faces of each volume that are in front of the surface, so the
+    // camera can be inside a volume, and clamp rather than clip them at the far plane
+    GLState::enable(GL_DEPTH_CLAMP);
+    glCullFace(GL_FRONT);
+    glDepthFunc(GL_GEQUAL);
+    if (lights.sphereCount > 0)
+    {
+        GLState::bindVertexArray(sphereVAO);
+        glUniform1i(glGetUniformLocation(lightShaderID, "volume"), 1);
+        glUniform1i(glGetUniformLocation(lightShaderID, "firstLight"), lights.directionalCount);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, sphereCount, lights.sphereCount);
+        volumeCount += lights.sphereCount;
+    }
+    if (lights.coneCount > 0)
+    {
+        GLState::bindVertexArray(coneVAO);
+        glUniform1i(glGetUniformLocation(lightShaderID, "volume"), 2);
+        glUniform1i(glGetUniformLocation(lightShaderID, "firstLight"), lights.directionalCount + lights.sphereCount);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, coneCount, lights.coneCount);
+        volumeCount += lights.coneCount;
+    }
+
+    glCullFace(GL_BACK);
+    glDepthMask(GL_TRUE);
+    GLState::disable(GL_DEPTH_CLAMP);
+    GLState::disable(GL_BLEND);
+
+    // Copy the lighting and depth into the window, so the passes drawn after this test against the scene
+    glBindFramebuffer(GL_FRAMEBUFFER, GLState::sceneFramebuffer);
+    GLState::bindTexture(diffuseUnit, GL_TEXTURE_2D, accumulationTexture);
+    GLState::bindVertexArray(screenVAO);
+    GLState::useProgram(compositeShaderID);
+    glUniform1i(glGetUniformLocation(compositeShaderID, "volume"), 0);
+    glUniform1i(glGetUniformLocation(compositeShaderID, "lightBuffer"), lightUnit);
+    glUniform1i(glGetUniformLocation(compositeShaderID, "accumulationBuffer"), diffuseUnit);
+    glUniform1i(glGetUniformLocation(compositeShaderID, "depthBuffer"), depthUnit);
+    glDepthFunc(GL_ALWAYS);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glDepthFunc(GL_LESS);
+}
+
+void DeferredRenderer::createGBuffer(int width, int height)
+{
+    deleteGBuffer();
+    this->width = width;
+    this->height = height;
+
+    // Albedo and ambient, normal and diffuse, specular and shininess
+    unsigned int* textures[] = { &albedoTexture, &normalTexture, &specularTexture };
+    GLenum formats[] = { GL_RGBA8, GL_RGBA16F, GL_RGBA16F };
+    glGenFramebuffers(1, &FBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        glGenTextures(1, textures[i]);
+        GLState::bindTexture(diffuseUnit, GL_TEXTURE_2D, *textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, formats[i], width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, *textures[i], 0);
+    }
+
+    glGenTextures(1, &depthTexture);
+    GLState::bindTexture(diffuseUnit, GL_TEXTURE_2D, depthTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+
+    GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+    glDrawBuffers(3, drawBuffers);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "G-buffer is incomplete\n");
+
+    // Half float lighting, and a depth buffer in the same format as the G-buffer's for blitting
+    glGenFramebuffers(1, &accumulationFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, accumulationFBO);
+    glGenTextures(1, &accumulationTexture);
+    GLState::bindTexture(diffuseUnit, GL_TEXTURE_2D, accumulationTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, accumulationTexture, 0);
+    glGenRenderbuffers(1, &accumulationDepth);
+    glBindRenderbuffer(GL_RENDERBUFFER, accumulationDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, accumulationDepth);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "Light accumulation buffer is incomplete\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void DeferredRenderer::deleteGBuffer()
+{
+    if (FBO == 0)
+        return;
+    glDeleteTextures(1, &albedoTexture);
+    glDeleteTextures(1, &normalTexture);
+    glDeleteTextures(1, &specularTexture);
+    glDeleteTextures(1, &depthTexture);
+    glDeleteFramebuffers(1, &FBO);
+    glDeleteTextures(1, &accumulationTexture);
+    glDeleteRenderbuffers(1, &accumulationDepth);
+    glDeleteFramebuffers(1, &accumulationFBO);
+    FBO = 0;
+    GLState::invalidate();
+}
+
+void DeferredRenderer::createVolume(const std::vector<glm::vec3>& vertices, unsigned int& VAO, unsigned int& buffer)
+{
+    glGenVertexArrays(1, &VAO);
+    GLState::bindVertexArray(VAO);
+    glGenBuffers(1, &buffer);
+    GLState::bindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), &vertices[0], GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+}
+
+void DeferredRenderer::addTriangle(std::vector<glm::vec3>& vertices, const glm::vec3& inside,
+    const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+{
+    vertices.push_back(a);
+    if (glm::dot(glm::cross(b - a, c - a), a - inside) >= 0.0f)
+    {
+        vertices.push_back(b);
+        vertices.push_back(c);
+    }
+    else
+    {
+        vertices.push_back(c);
+        vertices.push_back(b);
+    }
+}
+
+void DeferredRenderer::deleteBuffers()
+{
+    deleteGBuffer();
+    glDeleteBuffers(1, &sphereBuffer);
+    glDeleteBuffers(1, &coneBuffer);
+    glDeleteVertexArrays(1, &sphereVAO);
+    glDeleteVertexArrays(1, &coneVAO);
+    glDeleteVertexArrays(1, &screenVAO);
+    GLState::invalidate();
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <common/clusters.hpp>
+#include <common/shadows.hpp>
+
+// Deferred shading. The scene is drawn once into a G-buffer (albedo and
+// ambient, view-space normal and diffuse, specular and shininess, depth),
+// then each light adds its contribution over the pixels inside its volume:
+// instanced spheres for point lights, cones for spot lights and a
+// full-screen triangle for directional lights. The lights are summed in a
+// half float buffer, so many faint lights are not lost to rounding, and
+// copied into the window with the depth at the end. The lights come from the
+// clustered light buffer, which already holds them in view space by volume.
+class DeferredRenderer
+{
+public:
+    // Light volumes drawn last frame
+    unsigned int volumeCount = 0;
+
+    // Shadow maps the lights are tested against when set
+    ShadowMaps* shadows = NULL;
+
+    // Constructor (needs a current GL context)
+    DeferredRenderer(unsigned int lightShaderID, unsigned int compositeShaderID);
+
+    // Bind and clear the G-buffer, resizing it to the viewport
+    void beginGeometry();
+
+    // Go back to the scene's framebuffer
+    void endGeometry();
+
+    // Add up the lights and copy them into the window with the G-buffer depth
+    void drawLights(ClusteredLights& lights, const glm::mat4& projection);
+
+    // Cleanup
+    void deleteBuffers();
+
+private:
+    unsigned int lightShaderID, compositeShaderID;
+
+    // G-buffer
+    int width = 0, height = 0;
+    unsigned int FBO = 0;
+    unsigned int albedoTexture = 0, normalTexture = 0, specularTexture = 0, depthTexture = 0;
+
+    // Light accumulation buffer, with a copy of the depth to test the volumes against
+    unsigned int accumulationFBO = 0;
+    unsigned int accumulationTexture = 0, accumulationDepth = 0;
+
+    // Unit light volumes and an empty VAO for the full-screen triangle
+    unsigned int sphereVAO, sphereBuffer, sphereCount;
+    unsigned int coneVAO, coneBuffer, coneCount;
+    unsigned int screenVAO;
+
+    void createGBuffer(int width, int height);
+    void deleteGBuffer();
+
+    // Upload a triangle list to a new VAO at attribute 0
+    static void createVolume(const std::vector<glm::vec3>& vertices, unsigned int& VAO, unsigned int& buffer);
+
+    // Add a triangle wound to face away from a point inside the volume
+    static void addTriangle(std::vector<glm::vec3>& vertices, const glm::vec3& inside,
+        const glm::vec3& a, const glm::vec3& b, const glm::vec3& c);
+};
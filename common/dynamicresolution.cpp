@@ -0,0 +1,188 @@
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+
+#include <common/dynamicresolution.hpp>
+#include <common/renderer.hpp>
+#include <common/glstate.hpp>
+
+DynamicResolution::DynamicResolution(unsigned int upscaleShaderID)
+{
+    this->upscaleShaderID = upscaleShaderID;
+
+    // The full-screen triangle is generated from the vertex IDs
+    glGenVertexArrays(1, &screenVAO);
+
+    glGenQueries(2 * timerCount, &timers[0][0]);
+    for (unsigned int i = 0; i < timerCount; i++)
+        timerPending[i] = false;
+}
+
+void DynamicResolution::begin()
+{
+    // Follow the window's size (the viewport is the window's until the scene framebuffer is bound)
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    if (viewport[2] != width || viewport[3] != height)
+        createBuffers(viewport[2], viewport[3]);
+
+    // Adjust every few frames, on the average of the frame times that have come back
+    readTimers();
+    if (++frames % interval == 0 && timeCount > 0)
+        adjust();
+
+    // Skip timing this frame if the next timer pair is still in flight
+    timing = !timerPending[timer];
+    if (timing)
+        glQueryCounter(timers[timer][0], GL_TIMESTAMP);
+    frameStart = std::chrono::high_resolution_clock::now();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    GLState::sceneFramebuffer = FBO;
+    glViewport(0, 0, scaledWidth, scaledHeight);
+}
+
+void DynamicResolution::end()
+{
+    // Resolve the samples of the part drawn
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, FBO);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolveFBO);
+    glBlitFramebuffer(0, 0, scaledWidth, scaledHeight, 0, 0, scaledWidth, scaledHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+    // Scale it up over the whole window
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    GLState::sceneFramebuffer = 0;
+    glViewport(0, 0, width, height);
+    GLState::disable(GL_DEPTH_TEST);
+    GLState::disable(GL_BLEND);
+    GLState::bindTexture(diffuseUnit, GL_TEXTURE_2D, resolveTexture);
+    GLState::bindVertexArray(screenVAO);
+    GLState::useProgram(upscaleShaderID);
+    glUniform1i(glGetUniformLocation(upscaleShaderID, "scene"), diffuseUnit);
+    glUniform2f(glGetUniformLocation(upscaleShaderID, "drawnSize"), static_cast<float>(scaledWidth), static_cast<float>(scaledHeight));
+    glUniform1f(glGetUniformLocation(upscaleShaderID, "sharpness"), sharpness);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    GLState::enable(GL_DEPTH_TEST);
+
+    if (timing)
+    {
+        cpuTimes[timer] = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - frameStart).count();
+        glQueryCounter(timers[timer][1], GL_TIMESTAMP);
+        timerPending[timer] = true;
+        timer = (timer + 1) % timerCount;
+    }
+}
+
+void DynamicResolution::readTimers()
+{
+    for (unsigned int i = 0; i < timerCount; i++)
+    {
+        if (!timerPending[i])
+            continue;
+        unsigned int available = 0;
+        glGetQueryObjectuiv(timers[i][1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            continue;
+        GLuint64 start = 0, finish = 0;
+        glGetQueryObjectui64v(timers[i][0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(timers[i][1], GL_QUERY_RESULT, &finish);
+        timeSum += (finish - start) / 1.0e6f;
+        cpuTimeSum += cpuTimes[i];
+        timeCount++;
+        timerPending[i] = false;
+    }
+}
+
+void DynamicResolution::adjust()
+{
+    gpuTime = timeSum / timeCount;
+    cpuTime = cpuTimeSum / timeCount;
+    timeSum = cpuTimeSum = 0.0f;
+    timeCount = 0;
+
+    // Headroom left in the budget, positive when the scale can go up
+    float error = (budget - gpuTime) / budget;
+    float derivative = error - previousError;
+    previousError = error;
+
+    // Over budget only because the GPU waited for the CPU, so hold the scale rather than lower it
+    cpuBound = gpuTime <= cpuTime * (1.0f + cpuBoundMargin);
+    if (cpuBound && error < 0.0f)
+        return;
+
+    // Stop integrating while the scale is held at a limit, so it can come straight back off it
+    bool held = (scale >= maxScale && error > 0.0f) || (scale <= minScale && error < 0.0f);
+    if (!held)
+        integral = std::max(-5.0f, std::min(integral + error, 5.0f));
+
+    scale = std::max(minScale, std::min(scale + kp * error + ki * integral + kd * derivative, maxScale));
+
+    // Round the size to whole blocks of 8 pixels, so small changes do not resize the G-buffer and Hi-Z every time
+    scaledWidth = std::max(8, static_cast<int>(std::floor(width * scale / 8.0f + 0.5f)) * 8);
+    scaledHeight = std::max(8, static_cast<int>(std::floor(height * scale / 8.0f + 0.5f)) * 8);
+    scaledWidth = std::min(scaledWidth, width);
+    scaledHeight = std::min(scaledHeight, height);
+}
+
+void DynamicResolution::createBuffers(int width, int height)
+{
+    deleteFramebuffers();
+    this->width = width;
+    this->height = height;
+    scaledWidth = std::min(width, std::max(8, static_cast<int>(width * scale)));
+    scaledHeight = std::min(height, std::max(8, static_cast<int>(height * scale)));
+
+    // Same sample count and depth precision as the window, so the scene looks the same at full scale
+    GLint samples = 0;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glGetIntegerv(GL_SAMPLES, &samples);
+
+    glGenFramebuffers(1, &FBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    glGenRenderbuffers(1, &colourBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, colourBuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colourBuffer);
+    glGenRenderbuffers(1, &depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "Dynamic resolution framebuffer is incomplete\n");
+
+    // Filtered texture to scale up from
+    glGenFramebuffers(1, &resolveFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, resolveFBO);
+    glGenTextures(1, &resolveTexture);
+    GLState::bindTexture(diffuseUnit, GL_TEXTURE_2D, resolveTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, resolveTexture, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        fprintf(stderr, "Dynamic resolution resolve buffer is incomplete\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void DynamicResolution::deleteFramebuffers()
+{
+    if (FBO == 0)
+        return;
+    glDeleteFramebuffers(1, &FBO);
+    glDeleteFramebuffers(1, &resolveFBO);
+    glDeleteRenderbuffers(1, &colourBuffer);
+    glDeleteRenderbuffers(1, &depthBuffer);
+    glDeleteTextures(1, &resolveTexture);
+    FBO = resolveFBO = colourBuffer = depthBuffer = resolveTexture = 0;
+    GLState::invalidate();
+}
+
+void DynamicResolution::deleteBuffers()
+{
+    deleteFramebuffers();
+    glDeleteQueries(2 * timerCount, &timers[0][0]);
+    glDeleteVertexArrays(1, &screenVAO);
+    GLState::invalidate();
+}
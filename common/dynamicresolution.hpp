@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+// Dynamic resolution. The scene is drawn into the lower left corner of an
+// offscreen framebuffer the size of the window, which is scaled up into the
+// window at the end of the frame. Every few frames a PID controller moves
+// the scale towards a GPU frame time budget, measured between timestamps at
+// the start and end of each frame and read back a few frames later so
+// nothing waits on them. The GPU sits idle while the CPU works mid-frame, so
+// the span between the timestamps is compared with the CPU's own time from
+// begin() to end(): when the GPU finished about when the CPU stopped
+// submitting, the frame was CPU bound and the scale is not lowered, since a
+// smaller resolution would not help. The upscale is bilinear, optionally
+// sharpened with an unsharp mask.
+class DynamicResolution
+{
+public:
+    // GPU frame time to aim for (milliseconds)
+    float budget = 16.7f;
+
+    // Fraction of the window's width and height drawn, and its limits
+    float scale = 1.0f;
+    float minScale = 0.5f;
+    float maxScale = 1.0f;
+
+    // Frames between adjustments
+    unsigned int interval = 8;
+
+    // Controller gains, applied to the headroom as a fraction of the budget
+    float kp = 0.2f, ki = 0.02f, kd = 0.1f;
+
+    // Strength of the sharpening applied while scaling up (0 for plain bilinear)
+    float sharpness = 0.0f;
+
+    // A GPU frame time within this fraction above the CPU's counts as waiting on the CPU
+    float cpuBoundMargin = 0.1f;
+
+    // GPU and CPU frame times averaged over the frames before the last adjustment (milliseconds),
+    // and whether the GPU was waiting on the CPU over them
+    float gpuTime = 0.0f;
+    float cpuTime = 0.0f;
+    bool cpuBound = false;
+
+    // Constructor (needs a current GL context)
+    DynamicResolution(unsigned int upscaleShaderID);
+
+    // Adjust the scale, then bind the offscreen framebuffer with a viewport of the scaled size
+    void begin();
+
+    // Scale the frame up into the window
+    void end();
+
+    // Cleanup
+    void deleteBuffers();
+
+private:
+    unsigned int upscaleShaderID;
+
+    // Window size, and the part of it drawn at the current scale
+    int width = 0, height = 0;
+    int scaledWidth = 0, scaledHeight = 0;
+
+    // Multisampled framebuffer the scene is drawn into (with the window's sample count),
+    // and the texture it is resolved into to be scaled up
+    unsigned int FBO = 0, colourBuffer = 0, depthBuffer = 0;
+    unsigned int resolveFBO = 0, resolveTexture = 0;
+    unsigned int screenVAO;
+
+    // Timestamps at the start and end of recent frames, and the CPU time between begin() and end() for each
+    static const unsigned int timerCount = 4;
+    unsigned int timers[timerCount][2];
+    bool timerPending[timerCount];
+    float cpuTimes[timerCount];
+    std::chrono::high_resolution_clock::time_point frameStart;
+    unsigned int timer = 0;
+    bool timing = false;
+
+    // Frame times measured since the last adjustment, and the controller's state
+    float timeSum = 0.0f, cpuTimeSum = 0.0f;
+    unsigned int timeCount = 0;
+    unsigned int frames = 0;
+    float integral = 0.0f, previousError = 0.0f;
+
+    void createBuffers(int width, int height);
+    void deleteFramebuffers();
+
+    // Pick up the frame times the GPU has finished
+    void readTimers();
+
+    // Move the scale towards the budget
+    void adjust();
+};
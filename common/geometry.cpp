@@ -0,0 +1,345 @@
+#include <cstddef>
+#include <cstdio>
+#include <algorithm>
+
+#include <common/geometry.hpp>
+#include <common/glstate.hpp>
+
+float GeometryBuffer::compactThreshold = 0.5f;
+unsigned int GeometryBuffer::VAO = 0;
+std::vector<GeometryBuffer::Block> GeometryBuffer::blocks;
+std::vector<Mesh> GeometryBuffer::meshes;
+std::vector<unsigned int> GeometryBuffer::freeMeshIDs;
+unsigned int GeometryBuffer::boundBlock = 0xFFFFFFFF;
+unsigned int GeometryBuffer::compactions = 0;
+
+unsigned int GeometryBuffer::add(const std::vector<Vertex>& vertices,
+    const std::vector<unsigned int>& indices)
+{
+    unsigned int numVertices = static_cast<unsigned int>(vertices.size());
+    unsigned int numIndices = static_cast<unsigned int>(indices.size());
+
+    // An empty mesh takes no space and draws nothing
+    Mesh mesh;
+    if (numVertices == 0)
+        return store(mesh);
+
+    // Find the first block with room for both the vertices and indices
+    mesh.vertexCount = numVertices;
+    mesh.indexCount = numIndices;
+    mesh.bounds = AABB::fromPoints(&vertices.data()->position, numVertices, sizeof(Vertex));
+    bool found = false;
+    for (unsigned int i = 0; i < blocks.size() && !found; i++)
+    {
+        unsigned int vertexOffset, indexOffset;
+        if (!allocate(blocks[i].freeVertices, numVertices, vertexOffset))
+            continue;
+        if (!allocate(blocks[i].freeIndices, numIndices, indexOffset))
+        {
+            release(blocks[i].freeVertices, vertexOffset, numVertices);
+            continue;
+        }
+        mesh.block = i;
+        mesh.baseVertex = vertexOffset;
+        mesh.firstIndex = indexOffset;
+        found = true;
+    }
+
+    // Otherwise start a new block
+    if (!found)
+    {
+        unsigned int vertexOffset, indexOffset;
+        mesh.block = addBlock(std::max(blockVertices, numVertices), std::max(blockIndices, numIndices));
+        allocate(blocks[mesh.block].freeVertices, numVertices, vertexOffset);
+        allocate(blocks[mesh.block].freeIndices, numIndices, indexOffset);
+        mesh.baseVertex = vertexOffset;
+        mesh.firstIndex = indexOffset;
+    }
+
+    // Upload the mesh into its ranges (indices stay relative to the base vertex)
+    const Block& block = blocks[mesh.block];
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, block.vertexBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, mesh.baseVertex * sizeof(Vertex), numVertices * sizeof(Vertex), vertices.data());
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, block.indexBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, mesh.firstIndex * sizeof(unsigned int), numIndices * sizeof(unsigned int), indices.data());
+
+    return store(mesh);
+}
+
+unsigned int GeometryBuffer::store(const Mesh& mesh)
+{
+    // Reuse a free mesh id if there is one
+    unsigned int id;
+    if (!freeMeshIDs.empty())
+    {
+        id = freeMeshIDs.back();
+        freeMeshIDs.pop_back();
+        meshes[id] = mesh;
+    }
+    else
+    {
+        id = static_cast<unsigned int>(meshes.size());
+        meshes.push_back(mesh);
+    }
+    meshes[id].live = true;
+
+    return id;
+}
+
+void GeometryBuffer::remove(unsigned int id)
+{
+    if (id >= meshes.size() || !meshes[id].live)
+        return;
+
+    // An empty mesh only gives its id back
+    Mesh& mesh = meshes[id];
+    if (mesh.vertexCount == 0)
+    {
+        mesh = Mesh();
+        freeMeshIDs.push_back(id);
+        return;
+    }
+
+    Block& block = blocks[mesh.block];
+    release(block.freeVertices, mesh.baseVertex, mesh.vertexCount);
+    release(block.freeIndices, mesh.firstIndex, mesh.indexCount);
+
+    unsigned int blockIndex = mesh.block;
+    mesh = Mesh();
+    freeMeshIDs.push_back(id);
+
+    // Close the gaps if the block has become too fragmented
+    if (fragmentation(block) > compactThreshold)
+        compact(blockIndex);
+}
+
+const Mesh& GeometryBuffer::mesh(unsigned int id)
+{
+    return meshes[id];
+}
+
+void GeometryBuffer::bind(unsigned int block)
+{
+    if (VAO == 0)
+        glGenVertexArrays(1, &VAO);
+    GLState::bindVertexArray(VAO);
+    if (block == boundBlock || block >= blocks.size())
+        return;
+
+    // Point the attributes at this block's vertex buffer
+    GLState::bindBuffer(GL_ARRAY_BUFFER, blocks[block].vertexBuffer);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, position));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, uv));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, normal));
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, tangent));
+    glEnableVertexAttribArray(4);
+    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, bitangent));
+    GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, blocks[block].indexBuffer);
+    boundBlock = block;
+}
+
+void GeometryBuffer::compact(unsigned int blockIndex)
+{
+    Block& block = blocks[blockIndex];
+
+    // Live meshes in this block, in vertex order
+    std::vector<unsigned int> live;
+    for (unsigned int i = 0; i < meshes.size(); i++)
+    {
+        if (meshes[i].block == blockIndex && meshes[i].vertexCount > 0)
+            live.push_back(i);
+    }
+    std::sort(live.begin(), live.end(), [](unsigned int a, unsigned int b) {
+        return meshes[a].baseVertex < meshes[b].baseVertex;
+    });
+
+    // Copy the meshes next to each other into new buffers
+    unsigned int vertexBuffer, indexBuffer;
+    glGenBuffers(1, &vertexBuffer);
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, vertexBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, block.vertexCapacity * sizeof(Vertex), NULL, GL_STATIC_DRAW);
+    GLState::bindBuffer(GL_COPY_READ_BUFFER, block.vertexBuffer);
+    unsigned int vertexOffset = 0;
+    for (unsigned int i = 0; i < live.size(); i++)
+    {
+        Mesh& mesh = meshes[live[i]];
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, mesh.baseVertex * sizeof(Vertex),
+            vertexOffset * sizeof(Vertex), mesh.vertexCount * sizeof(Vertex));
+        mesh.baseVertex = vertexOffset;
+        vertexOffset += mesh.vertexCount;
+    }
+
+    glGenBuffers(1, &indexBuffer);
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, indexBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, block.indexCapacity * sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+    GLState::bindBuffer(GL_COPY_READ_BUFFER, block.indexBuffer);
+    unsigned int indexOffset = 0;
+    for (unsigned int i = 0; i < live.size(); i++)
+    {
+        Mesh& mesh = meshes[live[i]];
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, mesh.firstIndex * sizeof(unsigned int),
+            indexOffset * sizeof(unsigned int), mesh.indexCount * sizeof(unsigned int));
+        mesh.firstIndex = indexOffset;
+        indexOffset += mesh.indexCount;
+    }
+
+    glDeleteBuffers(1, &block.vertexBuffer);
+    glDeleteBuffers(1, &block.indexBuffer);
+    GLState::invalidate();
+    block.vertexBuffer = vertexBuffer;
+    block.indexBuffer = indexBuffer;
+
+    // All free space is now one range at the end of the block
+    block.freeVertices.clear();
+    block.freeIndices.clear();
+    release(block.freeVertices, vertexOffset, block.vertexCapacity - vertexOffset);
+    release(block.freeIndices, indexOffset, block.indexCapacity - indexOffset);
+
+    if (boundBlock == blockIndex)
+        boundBlock = 0xFFFFFFFF;
+
+    compactions++;
+}
+
+GeometryStats GeometryBuffer::stats()
+{
+    GeometryStats stats;
+    stats.blocks = static_cast<unsigned int>(blocks.size());
+    stats.meshes = static_cast<unsigned int>(meshes.size() - freeMeshIDs.size());
+    stats.compactions = compactions;
+    for (unsigned int i = 0; i < blocks.size(); i++)
+    {
+        unsigned int largest;
+        size_t freeVertices = freeSpace(blocks[i].freeVertices, largest);
+        size_t freeIndices = freeSpace(blocks[i].freeIndices, largest);
+        size_t freeBytes = freeVertices * sizeof(Vertex) + freeIndices * sizeof(unsigned int);
+        size_t totalBytes = blocks[i].vertexCapacity * sizeof(Vertex) + blocks[i].indexCapacity * sizeof(unsigned int);
+
+        stats.freeBytes += freeBytes;
+        stats.usedBytes += totalBytes - freeBytes;
+        stats.freeRanges += static_cast<unsigned int>(blocks[i].freeVertices.size() + blocks[i].freeIndices.size());
+        stats.fragmentation += fragmentation(blocks[i]) / blocks.size();
+    }
+    return stats;
+}
+
+void GeometryBuffer::printStats()
+{
+    GeometryStats s = stats();
+    printf("Geometry: %u meshes in %u blocks, %.2f MB used, %.2f MB free in %u ranges, fragmentation %.2f, %u compactions\n",
+        s.meshes, s.blocks, s.usedBytes / 1048576.0, s.freeBytes / 1048576.0, s.freeRanges, s.fragmentation, s.compactions);
+}
+
+void GeometryBuffer::deleteBuffers()
+{
+    for (unsigned int i = 0; i < blocks.size(); i++)
+    {
+        glDeleteBuffers(1, &blocks[i].vertexBuffer);
+        glDeleteBuffers(1, &blocks[i].indexBuffer);
+    }
+    glDeleteVertexArrays(1, &VAO);
+    VAO = 0;
+    blocks.clear();
+    meshes.clear();
+    freeMeshIDs.clear();
+    boundBlock = 0xFFFFFFFF;
+    GLState::invalidate();
+}
+
+unsigned int GeometryBuffer::addBlock(unsigned int vertexCapacity, unsigned int indexCapacity)
+{
+    Block block;
+    block.vertexCapacity = vertexCapacity;
+    block.indexCapacity = indexCapacity;
+
+    glGenBuffers(1, &block.vertexBuffer);
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, block.vertexBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, vertexCapacity * sizeof(Vertex), NULL, GL_STATIC_DRAW);
+
+    glGenBuffers(1, &block.indexBuffer);
+    GLState::bindBuffer(GL_COPY_WRITE_BUFFER, block.indexBuffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, indexCapacity * sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+
+    release(block.freeVertices, 0, vertexCapacity);
+    release(block.freeIndices, 0, indexCapacity);
+
+    blocks.push_back(block);
+    return static_cast<unsigned int>(blocks.size() - 1);
+}
+
+bool GeometryBuffer::allocate(std::map<unsigned int, unsigned int>& freeList,
+    unsigned int size, unsigned int& offset)
+{
+    // First fit in address order
+    for (std::map<unsigned int, unsigned int>::iterator it = freeList.begin(); it != freeList.end(); ++it)
+    {
+        if (it->second < size)
+            continue;
+
+        offset = it->first;
+        unsigned int remaining = it->second - size;
+        freeList.erase(it);
+        if (remaining > 0)
+            freeList[offset + size] = remaining;
+        return true;
+    }
+    return false;
+}
+
+void GeometryBuffer::release(std::map<unsigned int, unsigned int>& freeList,
+    unsigned int offset, unsigned int size)
+{
+    if (size == 0)
+        return;
+
+    std::map<unsigned int, unsigned int>::iterator it = freeList.insert(std::make_pair(offset, size)).first;
+
+    // Merge with the following range
+    std::map<unsigned int, unsigned int>::iterator next = it;
+    ++next;
+    if (next != freeList.end() && it->first + it->second == next->first)
+    {
+        it->second += next->second;
+        freeList.erase(next);
+    }
+
+    // Merge with the preceding range
+    if (it != freeList.begin())
+    {
+        std::map<unsigned int, unsigned int>::iterator previous = it;
+        --previous;
+        if (previous->first + previous->second == it->first)
+        {
+            previous->second += it->second;
+            freeList.erase(it);
+        }
+    }
+}
+
+unsigned int GeometryBuffer::freeSpace(const std::map<unsigned int, unsigned int>& freeList,
+    unsigned int& largest)
+{
+    unsigned int total = 0;
+    largest = 0;
+    for (std::map<unsigned int, unsigned int>::const_iterator it = freeList.begin(); it != freeList.end(); ++it)
+    {
+        total += it->second;
+        largest = std::max(largest, it->second);
+    }
+    return total;
+}
+
+float GeometryBuffer::fragmentation(const Block& block)
+{
+    unsigned int largestVertices, largestIndices;
+    unsigned int freeVertices = freeSpace(block.freeVertices, largestVertices);
+    unsigned int freeIndices = freeSpace(block.freeIndices, largestIndices);
+
+    float vertexFragmentation = freeVertices > 0 ? 1.0f - float(largestVertices) / freeVertices : 0.0f;
+    float indexFragmentation = freeIndices > 0 ? 1.0f - float(largestIndices) / freeIndices : 0.0f;
+    return 0.5f * (vertexFragmentation + indexFragmentation);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+#include <map>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <common/bounds.hpp>
+
+// Interleaved vertex used by all meshes
+struct Vertex
+{
+    glm::vec3 position;
+    glm::vec2 uv;
+    glm::vec3 normal;
+    glm::vec3 tangent;
+    glm::vec3 bitangent;
+};
+
+// Location of a mesh inside the shared geometry buffers
+struct Mesh
+{
+    unsigned int block = 0;
+    unsigned int firstIndex = 0;
+    unsigned int indexCount = 0;
+    int baseVertex = 0;
+    unsigned int vertexCount = 0;
+
+    // Bounding box of the vertices
+    AABB bounds;
+
+    // The id is in use (an empty mesh is live without any ranges)
+    bool live = false;
+};
+
+// Fragmentation statistics for the shared geometry buffers
+struct GeometryStats
+{
+    unsigned int blocks = 0;
+    unsigned int meshes = 0;
+    size_t usedBytes = 0;
+    size_t freeBytes = 0;
+    unsigned int freeRanges = 0;
+
+    // Blocks compacted since the start
+    unsigned int compactions = 0;
+
+    // 1 - largest free range / total free space, averaged over the blocks
+    float fragmentation = 0.0f;
+};
+
+// Suballocator for mesh data. Meshes are given ranges of a few large vertex
+// and index buffers (blocks) from first-fit free lists, and all blocks share
+// one VAO for the Vertex format. Meshes are referred to by id so a block can
+// be compacted without the owners noticing.
+class GeometryBuffer
+{
+public:
+    // Block sizes (a larger block is created for meshes that do not fit)
+    static const unsigned int blockVertices = 1 << 18;
+    static const unsigned int blockIndices = 1 << 20;
+
+    // Compact a block when a mesh is removed and its fragmentation is above this
+    static float compactThreshold;
+
+    // Shared VAO for the Vertex format
+    static unsigned int VAO;
+
+    // Allocate space for a mesh and upload it, returns the mesh id
+    static unsigned int add(const std::vector<Vertex>& vertices,
+        const std::vector<unsigned int>& indices);
+
+    // Free a mesh's ranges
+    static void remove(unsigned int id);
+
+    // Current location of a mesh
+    static const Mesh& mesh(unsigned int id);
+
+    // Bind the shared VAO with a block's buffers
+    static void bind(unsigned int block);
+
+    // Move a block's meshes together to close the gaps between them
+    static void compact(unsigned int block);
+
+    // Fragmentation statistics
+    static GeometryStats stats();
+    static void printStats();
+
+    // Cleanup
+    static void deleteBuffers();
+
+private:
+    // A pair of large vertex and index buffers with their free ranges
+    struct Block
+    {
+        unsigned int vertexBuffer;
+        unsigned int indexBuffer;
+        unsigned int vertexCapacity;
+        unsigned int indexCapacity;
+        std::map<unsigned int, unsigned int> freeVertices;  // offset -> size
+        std::map<unsigned int, unsigned int> freeIndices;
+    };
+
+    static std::vector<Block> blocks;
+    static std::vector<Mesh> meshes;
+    static std::vector<unsigned int> freeMeshIDs;
+    static unsigned int boundBlock;
+    static unsigned int compactions;
+
+    // Give a mesh an id, reusing a free one if there is one
+    static unsigned int store(const Mesh& mesh);
+
+    // Create a new block
+    static unsigned int addBlock(unsigned int vertexCapacity, unsigned int indexCapacity);
+
+    // Free list operations
+    static bool allocate(std::map<unsigned int, unsigned int>& freeList,
+        unsigned int size, unsigned int& offset);
+    static void release(std::map<unsigned int, unsigned int>& freeList,
+        unsigned int offset, unsigned int size);
+    static unsigned int freeSpace(const std::map<unsigned int, unsigned int>& freeList,
+        unsigned int& largest);
+    static float fragmentation(const Block& block);
+};
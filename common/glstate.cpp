@@ -0,0 +1,178 @@
+#include <cstring>
+
+#include <common/glstate.hpp>
+
+// Value used for state that has not been set through the cache yet
+static const unsigned int unknown = 0xFFFFFFFF;
+
+unsigned int GLState::sceneFramebuffer = 0;
+unsigned int GLState::issuedCalls = 0;
+unsigned int GLState::filteredCalls = 0;
+unsigned int GLState::issuedLastFrame = 0;
+unsigned int GLState::filteredLastFrame = 0;
+
+unsigned int GLState::program = unknown;
+unsigned int GLState::vertexArray = unknown;
+unsigned int GLState::activeUnit = unknown;
+std::map<GLenum, unsigned int> GLState::buffers;
+std::map<GLenum, unsigned int> GLState::textures[GLState::maxTextureUnits];
+unsigned int GLState::samplers[GLState::maxTextureUnits] = {};
+std::map<GLenum, bool> GLState::capabilities;
+
+bool GLState::changed(unsigned int& cached, unsigned int value)
+{
+    if (cached == value)
+    {
+        filteredCalls++;
+        return false;
+    }
+
+    cached = value;
+    issuedCalls++;
+    return true;
+}
+
+void GLState::useProgram(unsigned int id)
+{
+    if (changed(program, id))
+        glUseProgram(id);
+}
+
+void GLState::bindVertexArray(unsigned int VAO)
+{
+    if (changed(vertexArray, VAO))
+    {
+        glBindVertexArray(VAO);
+
+        //The element array binding belongs to the VAO
+        buffers.erase(GL_ELEMENT_ARRAY_BUFFER);
+    }
+}
+
+void GLState::bindBuffer(GLenum target, unsigned int buffer)
+{
+    std::map<GLenum, unsigned int>::iterator it = buffers.find(target);
+    if (it == buffers.end())
+    {
+        buffers[target] = buffer;
+        issuedCalls++;
+        glBindBuffer(target, buffer);
+    }
+    else if (changed(it->second, buffer))
+    {
+        glBindBuffer(target, buffer);
+    }
+}
+
+void GLState::bindBufferBase(GLenum target, unsigned int index, unsigned int buffer)
+{
+    // Indexed bindings are not cached, but they also replace the generic binding
+    glBindBufferBase(target, index, buffer);
+    buffers[target] = buffer;
+    issuedCalls++;
+}
+
+void GLState::activeTexture(unsigned int unit)
+{
+    if (changed(activeUnit, unit))
+        glActiveTexture(GL_TEXTURE0 + unit);
+}
+
+void GLState::bindTexture(unsigned int unit, GLenum target, unsigned int texture)
+{
+    //Units outside the tracked range are passed straight through
+    if (unit >= maxTextureUnits)
+    {
+        activeTexture(unit);
+        issuedCalls++;
+        glBindTexture(target, texture);
+        return;
+    }
+
+    std::map<GLenum, unsigned int>::iterator it = textures[unit].find(target);
+    if (it != textures[unit].end() && it->second == texture)
+    {
+        filteredCalls++;
+        return;
+    }
+
+    activeTexture(unit);
+    textures[unit][target] = texture;
+    issuedCalls++;
+    glBindTexture(target, texture);
+}
+
+void GLState::bindSampler(unsigned int unit, unsigned int sampler)
+{
+    if (unit >= maxTextureUnits)
+    {
+        issuedCalls++;
+        glBindSampler(unit, sampler);
+        return;
+    }
+
+    if (changed(samplers[unit], sampler))
+        glBindSampler(unit, sampler);
+}
+
+void GLState::enable(GLenum capability)
+{
+    std::map<GLenum, bool>::iterator it = capabilities.find(capability);
+    if (it != capabilities.end() && it->second)
+    {
+        filteredCalls++;
+        return;
+    }
+
+    capabilities[capability] = true;
+    issuedCalls++;
+    glEnable(capability);
+}
+
+void GLState::disable(GLenum capability)
+{
+    std::map<GLenum, bool>::iterator it = capabilities.find(capability);
+    if (it != capabilities.end() && !it->second)
+    {
+        filteredCalls++;
+        return;
+    }
+
+    capabilities[capability] = false;
+    issuedCalls++;
+    glDisable(capability);
+}
+
+bool GLState::extensionSupported(const char* name)
+{
+    GLint count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (GLint i = 0; i < count; i++)
+    {
+        if (strcmp(reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i)), name) == 0)
+            return true;
+    }
+    return false;
+}
+
+void GLState::invalidate()
+{
+    program = unknown;
+    vertexArray = unknown;
+    activeUnit = unknown;
+    buffers.clear();
+    for (unsigned int i = 0; i < maxTextureUnits; i++)
+    {
+        textures[i].clear();
+        samplers[i] = unknown;
+    }
+    capabilities.clear();
+}
+
+void GLState::endFrame()
+{
+    issuedLastFrame = issuedCalls;
+    filteredLastFrame = filteredCalls;
+    issuedCalls = 0;
+    filteredCalls = 0;
+}
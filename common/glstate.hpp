@@ -0,0 +1,61 @@
+#pragma once
+
+#include <map>
+
+#include <GL/glew.h>
+
+// Thin cache over OpenGL binding state. Calls that would not change the
+// currently bound object or enable bit are skipped and counted.
+class GLState
+{
+public:
+    // Maximum number of texture units tracked
+    static const unsigned int maxTextureUnits = 32;
+
+    // Programs and vertex arrays
+    static void useProgram(unsigned int program);
+    static void bindVertexArray(unsigned int VAO);
+
+    // Buffers
+    static void bindBuffer(GLenum target, unsigned int buffer);
+    static void bindBufferBase(GLenum target, unsigned int index, unsigned int buffer);
+
+    // Textures and samplers
+    static void activeTexture(unsigned int unit);
+    static void bindTexture(unsigned int unit, GLenum target, unsigned int texture);
+    static void bindSampler(unsigned int unit, unsigned int sampler);
+
+    // Enable bits
+    static void enable(GLenum capability);
+    static void disable(GLenum capability);
+
+    // Is an extension in the context's list (GLEW 1.13 cannot read it from core profiles)
+    static bool extensionSupported(const char* name);
+
+    // Forget everything cached (call after deleting GL objects)
+    static void invalidate();
+
+    // Store this frame's counters and reset them
+    static void endFrame();
+
+    // Framebuffer the scene is drawn into: the window's, or an offscreen one when drawing at a lower resolution
+    static unsigned int sceneFramebuffer;
+
+    // Debug counters
+    static unsigned int issuedCalls;
+    static unsigned int filteredCalls;
+    static unsigned int issuedLastFrame;
+    static unsigned int filteredLastFrame;
+
+private:
+    static unsigned int program;
+    static unsigned int vertexArray;
+    static unsigned int activeUnit;
+    static std::map<GLenum, unsigned int> buffers;
+    static std::map<GLenum, unsigned int> textures[maxTextureUnits];
+    static unsigned int samplers[maxTextureUnits];
+    static std::map<GLenum, bool> capabilities;
+
+    // Returns true if the call needs to be issued
+    static bool changed(unsigned int& cached, unsigned int value);
+};
@@ -0,0 +1,228 @@
+#include <cstdio>
+#include <algorithm>
+
+#include <common/gpuculling.hpp>
+#include <common/glstate.hpp>
+
+GPUCulling::GPUCulling(unsigned int cullShaderID, unsigned int hiZShaderID)
+{
+    this->cullShaderID = cullShaderID;
+    this->hiZShaderID = hiZShaderID;
+
+    // Without a GPU-side draw count each batch draws its whole range
+    indirectCount = GLState::extensionSupported("GL_ARB_indirect_parameters");
+
+    glGenBuffers(1, &candidateBuffer);
+    glGenBuffers(1, &inputBuffer);
+    glGenBuffers(1, &commandBuffer);
+    glGenBuffers(1, &countBuffer);
+}
+
+void GPUCulling::cull(const std::vector<DrawCommand>& commands, const std::vector<CullInput>& inputs,
+    unsigned int numBatches, const glm::mat4& viewProjection, const std::vector<glm::mat4>& transforms)
+{
+    unsigned int drawCount = static_cast<unsigned int>(commands.size());
+    if (drawCount == 0)
+        return;
+
+    // Candidates and their boxes, an empty output range and zeroed batch counts
+    upload(GL_SHADER_STORAGE_BUFFER, candidateBuffer, drawCount * sizeof(DrawCommand), &commands[0]);
+    upload(GL_SHADER_STORAGE_BUFFER, inputBuffer, drawCount * sizeof(CullInput), &inputs[0]);
+    upload(GL_SHADER_STORAGE_BUFFER, commandBuffer, drawCount * sizeof(DrawCommand), NULL);
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+    std::vector<unsigned int> zeros(numBatches, 0);
+    upload(GL_SHADER_STORAGE_BUFFER, countBuffer, numBatches * sizeof(unsigned int), &zeros[0]);
+
+    GLState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, candidateBuffer);
+    GLState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, inputBuffer);
+    GLState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, commandBuffer);
+    GLState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, countBuffer);
+
+    // Verification compares against the frustum test alone
+    Frustum frustum(viewProjection);
+    bool useHiZ = hiZ && hiZValid && !verify;
+
+    GLState::useProgram(cullShaderID);
+    glUniform1ui(glGetUniformLocation(cullShaderID, "drawCount"), drawCount);
+    glUniform4fv(glGetUniformLocation(cullShaderID, "planes"), 6, &frustum.planes[0][0]);
+    glUniform1i(glGetUniformLocation(cullShaderID, "transformBuffer"), transformUnit);
+    glUniform1i(glGetUniformLocation(cullShaderID, "useHiZ"), useHiZ);
+    glUniform1i(glGetUniformLocation(cullShaderID, "hiZ"), hiZUnit);
+    glUniform1i(glGetUniformLocation(cullShaderID, "hiZLevels"), levels);
+    glUniformMatrix4fv(glGetUniformLocation(cullShaderID, "hiZViewProjection"), 1, GL_FALSE, &hiZViewProjection[0][0]);
+    if (hiZValid)
+        GLState::bindTexture(hiZUnit, GL_TEXTURE_2D, hiZTexture);
+
+    glDispatchCompute((drawCount + 63) / 64, 1, 1);
+
+    // The draws read the commands and counts as indirect parameters
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+
+    if (verify)
+        verifyResults(commands, inputs, numBatches, frustum, transforms);
+}
+
+void GPUCulling::draw(unsigned int batch, unsigned int first, unsigned int count)
+{
+    GLState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+    if (indirectCount)
+    {
+        GLState::bindBuffer(GL_PARAMETER_BUFFER_ARB, countBuffer);
+        glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(first * sizeof(DrawCommand)),
+            batch * sizeof(unsigned int), count, 0);
+    }
+    else
+    {
+        // Culled commands at the end of the range have no instances
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(first * sizeof(DrawCommand)), count, 0);
+    }
+}
+
+void GPUCulling::buildHiZ(const glm::mat4& view, const glm::mat4& projection)
+{
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    if (viewport[2] != width || viewport[3] != height)
+        createHiZ(viewport[2], viewport[3]);
+
+    // Copy (and resolve) the scene's depth buffer
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, GLState::sceneFramebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, depthFBO);
+    glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, GLState::sceneFramebuffer);
+
+    // Copy it into level 0 and reduce each level into the next
+    GLState::useProgram(hiZShaderID);
+    GLState::bindTexture(hiZUnit, GL_TEXTURE_2D, depthTexture);
+    glUniform1i(glGetUniformLocation(hiZShaderID, "depthTexture"), hiZUnit);
+    int w = width, h = height;
+    for (int level = 0; level < levels; level++)
+    {
+        glUniform1i(glGetUniformLocation(hiZShaderID, "level"), level);
+        glBindImageTexture(0, hiZTexture, std::max(0, level - 1), GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        glBindImageTexture(1, hiZTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glDispatchCompute((w + 7) / 8, (h + 7) / 8, 1);
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        w = std::max(1, w / 2);
+        h = std::max(1, h / 2);
+    }
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+    hiZViewProjection = projection * view;
+    hiZValid = true;
+}
+
+void GPUCulling::createHiZ(int width, int height)
+{
+    this->width = width;
+    this->height = height;
+    levels = 1;
+    while ((std::max(width, height) >> levels) > 0)
+        levels++;
+
+    if (depthTexture != 0)
+    {
+        glDeleteTextures(1, &depthTexture);
+        glDeleteTextures(1, &hiZTexture);
+        glDeleteFramebuffers(1, &depthFBO);
+        GLState::invalidate();
+    }
+
+    // Blitting depth needs the same format as the scene's depth buffer (the window's attachments have their own names)
+    GLint depthBits = 0, stencilBits = 0, stencilType = GL_NONE;
+    bool window = GLState::sceneFramebuffer == 0;
+    GLenum depth = window ? GL_DEPTH : GL_DEPTH_ATTACHMENT, stencil = window ? GL_STENCIL : GL_STENCIL_ATTACHMENT;
+    glBindFramebuffer(GL_FRAMEBUFFER, GLState::sceneFramebuffer);
+    glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, depth, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+    glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, stencil, GL_FRAMEBUFFER_ATTACHMENT_OBJECT_TYPE, &stencilType);
+    if (stencilType != GL_NONE)
+        glGetFramebufferAttachmentParameteriv(GL_FRAMEBUFFER, stencil, GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+    GLenum format;
+    if (stencilBits > 0)
+        format = depthBits == 32 ? GL_DEPTH32F_STENCIL8 : GL_DEPTH24_STENCIL8;
+    else
+        format = depthBits == 32 ? GL_DEPTH_COMPONENT32F : depthBits == 16 ? GL_DEPTH_COMPONENT16 : GL_DEPTH_COMPONENT24;
+
+    glGenTextures(1, &depthTexture);
+    GLState::bindTexture(hiZUnit, GL_TEXTURE_2D, depthTexture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenFramebuffers(1, &depthFBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, depthFBO);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, stencilBits > 0 ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT,
+        GL_TEXTURE_2D, depthTexture, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    glGenTextures(1, &hiZTexture);
+    GLState::bindTexture(hiZUnit, GL_TEXTURE_2D, hiZTexture);
+    glTexStorage2D(GL_TEXTURE_2D, levels, GL_R32F, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    hiZValid = false;
+}
+
+void GPUCulling::verifyResults(const std::vector<DrawCommand>& commands, const std::vector<CullInput>& inputs,
+    unsigned int numBatches, const Frustum& frustum, const std::vector<glm::mat4>& transforms)
+{
+    unsigned int drawCount = static_cast<unsigned int>(commands.size());
+    std::vector<unsigned int> counts(numBatches);
+    std::vector<DrawCommand> culled(drawCount);
+    GLState::bindBuffer(GL_SHADER_STORAGE_BUFFER, countBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, numBatches * sizeof(unsigned int), &counts[0]);
+    GLState::bindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, drawCount * sizeof(DrawCommand), &culled[0]);
+
+    // Draws (by base instance) the GPU kept and the CPU test keeps
+    std::vector<unsigned int> gpu, cpu;
+    for (unsigned int i = 0; i < drawCount; i++)
+    {
+        const CullInput& input = inputs[i];
+        glm::vec3 c = glm::vec3(input.centre), e = glm::vec3(input.extent);
+        if (frustum.contains(AABB(c - e, c + e).transform(transforms[input.transformIndex])))
+            cpu.push_back(commands[i].baseInstance);
+        if (i == input.batchFirst)
+        {
+            for (unsigned int j = 0; j < counts[input.batch]; j++)
+                gpu.push_back(culled[i + j].baseInstance);
+        }
+    }
+    std::sort(gpu.begin(), gpu.end());
+    std::sort(cpu.begin(), cpu.end());
+
+    verifiedFrames++;
+    if (gpu != cpu)
+    {
+        mismatchedFrames++;
+        printf("GPU culling kept %u draws, CPU culling kept %u\n",
+            static_cast<unsigned int>(gpu.size()), static_cast<unsigned int>(cpu.size()));
+    }
+}
+
+void GPUCulling::upload(GLenum target, unsigned int buffer, size_t bytes, const void* data)
+{
+    GLState::bindBuffer(target, buffer);
+    glBufferData(target, bytes, data, GL_STREAM_DRAW);
+}
+
+void GPUCulling::deleteBuffers()
+{
+    if (verify)
+        printf("GPU culling verified on %u frames, %u mismatched\n", verifiedFrames, mismatchedFrames);
+
+    glDeleteBuffers(1, &candidateBuffer);
+    glDeleteBuffers(1, &inputBuffer);
+    glDeleteBuffers(1, &commandBuffer);
+    glDeleteBuffers(1, &countBuffer);
+    if (depthTexture != 0)
+    {
+        glDeleteTextures(1, &depthTexture);
+        glDeleteTextures(1, &hiZTexture);
+        glDeleteFramebuffers(1, &depthFBO);
+    }
+    GLState::invalidate();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <common/renderer.hpp>
+#include <common/bounds.hpp>
+
+// Per-draw input to the culling compute shader (std430 layout)
+struct CullInput
+{
+    glm::vec4 centre;
+    glm::vec4 extent;
+    unsigned int transformIndex;
+    unsigned int batch;
+    unsigned int batchFirst;
+    unsigned int padding;
+};
+
+// GL 4.3 culling on the GPU. A compute shader tests every candidate draw
+// against the frustum and the previous frame's depth pyramid, and appends
+// the survivors to their batch's range of the indirect buffer. Without
+// ARB_indirect_parameters the rest of each range is left as zero-instance
+// commands; with it the batch counts are read from the buffer directly.
+class GPUCulling
+{
+public:
+    // Test against the previous frame's depth pyramid as well as the frustum
+    bool hiZ = true;
+
+    // Read the results back and compare them with the CPU frustum test (slow, for testing)
+    bool verify = false;
+    unsigned int verifiedFrames = 0;
+    unsigned int mismatchedFrames = 0;
+
+    // Constructor (needs a GL 4.3 context)
+    GPUCulling(unsigned int cullShaderID, unsigned int hiZShaderID);
+
+    // Cull the candidate commands into the indirect buffer (the transforms must
+    // already be in the renderer's transform buffer, and are only read here to verify)
+    void cull(const std::vector<DrawCommand>& commands, const std::vector<CullInput>& inputs,
+        unsigned int numBatches, const glm::mat4& viewProjection, const std::vector<glm::mat4>& transforms);
+
+    // Draw a batch's surviving commands
+    void draw(unsigned int batch, unsigned int first, unsigned int count);
+
+    // Build the depth pyramid from the finished frame
+    void buildHiZ(const glm::mat4& view, const glm::mat4& projection);
+
+    // Cleanup
+    void deleteBuffers();
+
+private:
+    unsigned int cullShaderID, hiZShaderID;
+    bool indirectCount;
+
+    // Buffers
+    unsigned int candidateBuffer, inputBuffer, commandBuffer, countBuffer;
+
+    // Depth copy and pyramid
+    int width = 0, height = 0;
+    int levels = 0;
+    unsigned int depthTexture = 0, depthFBO = 0, hiZTexture = 0;
+    glm::mat4 hiZViewProjection;
+    bool hiZValid = false;
+
+    // Compare the GPU's surviving draws with the CPU frustum test
+    void verifyResults(const std::vector<DrawCommand>& commands, const std::vector<CullInput>& inputs,
+        unsigned int numBatches, const Frustum& frustum, const std::vector<glm::mat4>& transforms);
+
+    void createHiZ(int width, int height);
+    void upload(GLenum target, unsigned int buffer, size_t bytes, const void* data);
+};
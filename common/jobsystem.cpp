@@ -0,0 +1,297 @@
+#include <cstdio>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <common/jobsystem.hpp>
+#include <common/maths.hpp>
+#include <common/bounds.hpp>
+
+// Job system and queue the current thread works for, if it is a worker
+static thread_local const JobSystem* workerSystem = NULL;
+static thread_local unsigned int workerQueue = 0;
+
+JobSystem::Counter::Counter()
+    : pending(0)
+{
+}
+
+bool JobSystem::Counter::done() const
+{
+    return pending.load(std::memory_order_acquire) == 0;
+}
+
+JobSystem::JobSystem(unsigned int threads)
+    : jobCount(0), stolenCount(0), queuedCount(0)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int i = 0; i < threads; i++)
+        queues.push_back(new Queue());
+    for (unsigned int i = 1; i < threads; i++)
+        workers.push_back(std::thread(&JobSystem::workerLoop, this, i));
+}
+
+JobSystem::~JobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        quit = true;
+    }
+    wake.notify_all();
+    for (unsigned int i = 0; i < static_cast<unsigned int>(workers.size()); i++)
+        workers[i].join();
+    for (unsigned int i = 0; i < static_cast<unsigned int>(queues.size()); i++)
+        delete queues[i];
+}
+
+unsigned int JobSystem::threadCount() const
+{
+    return static_cast<unsigned int>(queues.size());
+}
+
+void JobSystem::run(const Job& job, Counter* counter, Counter* after)
+{
+    if (counter != NULL)
+        counter->pending.fetch_add(1, std::memory_order_relaxed);
+    jobCount++;
+
+    // Hold the job back until the group it comes after has finished (its last job starts it)
+    if (after != NULL)
+    {
+        std::lock_guard<std::mutex> lock(after->mutex);
+        if (!after->done())
+        {
+            after->waiting.push_back(std::make_pair(job, counter));
+            return;
+        }
+    }
+
+    Task task = { job, counter };
+    push(task);
+}
+
+void JobSystem::wait(Counter& counter)
+{
+    unsigned int queue = queueIndex();
+    while (!counter.done())
+    {
+        if (!runOne(queue))
+            std::this_thread::yield();
+    }
+
+    // The thread that finished the last job may still hold the lock, so wait for it before the counter goes away
+    std::lock_guard<std::mutex> lock(counter.mutex);
+}
+
+void JobSystem::parallelFor(unsigned int count, unsigned int chunkSize, const RangeJob& job)
+{
+    if (count == 0)
+        return;
+    chunkSize = std::max(1u, chunkSize);
+    if (count <= chunkSize || workers.empty())
+    {
+        job(0, count);
+        return;
+    }
+
+    // Queue every chunk but the first, which the calling thread runs itself before helping with the rest
+    Counter counter;
+    for (unsigned int begin = chunkSize; begin < count; begin += chunkSize)
+    {
+        unsigned int end = std::min(begin + chunkSize, count);
+        run([&job, begin, end]() { job(begin, end); }, &counter);
+    }
+    job(0, chunkSize);
+    wait(counter);
+}
+
+void JobSystem::parallelFor(JobSystem* jobs, unsigned int count, unsigned int chunkSize, const RangeJob& job)
+{
+    if (jobs != NULL)
+        jobs->parallelFor(count, chunkSize, job);
+    else if (count > 0)
+        job(0, count);
+}
+
+void JobSystem::resetStats()
+{
+    jobCount = 0;
+    stolenCount = 0;
+}
+
+unsigned int JobSystem::queueIndex() const
+{
+    return workerSystem == this ? workerQueue : 0;
+}
+
+void JobSystem::push(const Task& task)
+{
+    Queue& queue = *queues[queueIndex()];
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(task);
+    }
+    queuedCount++;
+
+    // Taking the lock means a worker cannot miss the wake up between checking the count and sleeping
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    wake.notify_one();
+}
+
+bool JobSystem::pop(unsigned int index, Task& task)
+{
+    Queue& queue = *queues[index];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.tasks.empty())
+        return false;
+    task = queue.tasks.back();
+    queue.tasks.pop_back();
+    queuedCount--;
+    return true;
+}
+
+bool JobSystem::steal(unsigned int thief, Task& task)
+{
+    unsigned int count = threadCount();
+    for (unsigned int i = 1; i < count; i++)
+    {
+        Queue& queue = *queues[(thief + i) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            continue;
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+        queuedCount--;
+        stolenCount++;
+        return true;
+    }
+    return false;
+}
+
+bool JobSystem::runOne(unsigned int queue)
+{
+    Task task;
+    if (!pop(queue, task) && !steal(queue, task))
+        return false;
+    task.job();
+    finish(task.counter);
+    return true;
+}
+
+void JobSystem::finish(Counter* counter)
+{
+    if (counter == NULL)
+        return;
+
+    // Decrement under the lock, so a job being held back on the counter is either seen here or not held back
+    std::vector<std::pair<Job, Counter*> > ready;
+    {
+        std::lock_guard<std::mutex> lock(counter->mutex);
+        if (counter->pending.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        ready.swap(counter->waiting);
+    }
+    for (unsigned int i = 0; i < static_cast<unsigned int>(ready.size()); i++)
+    {
+        Task task = { ready[i].first, ready[i].second };
+        push(task);
+    }
+}
+
+void JobSystem::workerLoop(unsigned int index)
+{
+    workerSystem = this;
+    workerQueue = index;
+    while (true)
+    {
+        if (runOne(index))
+            continue;
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wake.wait(lock, [this]() { return queuedCount > 0 || quit; });
+        if (quit)
+            return;
+    }
+}
+
+void JobSystem::benchmark(unsigned int count)
+{
+    typedef std::chrono::high_resolution_clock Clock;
+    const unsigned int frames = 20;
+    const unsigned int chunkSize = 1024;
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+    std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> size(0.5f, 5.0f);
+
+    // Random objects in a 1000 unit cube, seen from the middle
+    std::vector<glm::vec3> positions(count), axes(count), scales(count);
+    std::vector<float> angles(count);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        positions[i] = glm::vec3(position(random), position(random), position(random));
+        axes[i] = glm::normalize(glm::vec3(unit(random), unit(random), unit(random)) + glm::vec3(0.0f, 2.0f, 0.0f));
+        angles[i] = 3.14159f * unit(random);
+        scales[i] = glm::vec3(size(random));
+    }
+    AABB box(glm::vec3(-1.0f), glm::vec3(1.0f));
+    Frustum frustum(glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.2f, 1000.0f) *
+        glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+
+    // Each frame builds the model matrices and world boxes, then culls the boxes in a group that waits for them
+    std::vector<glm::mat4> models(count);
+    std::vector<AABB> boxes(count);
+    std::vector<unsigned char> visible(count);
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    printf("%u objects, %u cores\n", count, cores);
+    printf("threads  frame ms  speedup  jobs stolen\n");
+    double singleTime = 0.0;
+    unsigned int singleVisible = 0;
+    for (unsigned int threads = 1; ; threads = std::min(2 * threads, cores))
+    {
+        JobSystem jobs(threads);
+        unsigned int visibleCount = 0;
+        Clock::time_point start = Clock::now();
+        for (unsigned int frame = 0; frame < frames; frame++)
+        {
+            Counter transformed, culled;
+            for (unsigned int begin = 0; begin < count; begin += chunkSize)
+            {
+                unsigned int end = std::min(begin + chunkSize, count);
+                jobs.run([&, begin, end]()
+                {
+                    for (unsigned int i = begin; i < end; i++)
+                    {
+                        models[i] = Maths::translate(positions[i]) * Maths::rotate(angles[i], axes[i]) * Maths::scale(scales[i]);
+                        boxes[i] = box.transform(models[i]);
+                    }
+                }, &transformed);
+            }
+            jobs.run([&]()
+            {
+                jobs.parallelFor(count, chunkSize, [&](unsigned int begin, unsigned int end)
+                {
+                    for (unsigned int i = begin; i < end; i++)
+                        visible[i] = frustum.contains(boxes[i]);
+                });
+            }, &culled, &transformed);
+            jobs.wait(culled);
+        }
+        double frameTime = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / frames;
+        for (unsigned int i = 0; i < count; i++)
+            visibleCount += visible[i];
+        if (threads == 1)
+        {
+            singleTime = frameTime;
+            singleVisible = visibleCount;
+        }
+        printf("%7u  %8.2f  %6.2fx  %4u %6u%s\n", threads, frameTime, singleTime / frameTime,
+            jobs.jobCount.load(), jobs.stolenCount.load(), visibleCount == singleVisible ? "" : "  RESULTS DIFFER");
+        if (threads == cores)
+            break;
+    }
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// Work-stealing job system. Each worker thread has its own deque of jobs:
+// it takes its newest jobs from the back, and when it runs out it steals the
+// oldest from the front of another worker's deque. Threads that are not
+// workers (the main thread) share one more deque, and help run jobs while
+// they wait for a group to finish. A counter tracks each group of jobs, and
+// jobs can be held back until another group's counter reaches zero.
+class JobSystem
+{
+public:
+    typedef std::function<void()> Job;
+
+    // Job over a range of items [begin, end)
+    typedef std::function<void(unsigned int begin, unsigned int end)> RangeJob;
+
+    // Number of unfinished jobs in a group, and the jobs waiting for them
+    class Counter
+    {
+    public:
+        Counter();
+
+        // Have all the group's jobs finished
+        bool done() const;
+
+    private:
+        friend class JobSystem;
+        std::atomic<unsigned int> pending;
+        std::mutex mutex;
+        std::vector<std::pair<Job, Counter*> > waiting;
+    };
+
+    // Stats since the last resetStats
+    std::atomic<unsigned int> jobCount;
+    std::atomic<unsigned int> stolenCount;
+
+    // Constructor starts one thread fewer than asked for (the calling thread is the other),
+    // or one per core when threads is 0. Destructor stops them.
+    JobSystem(unsigned int threads = 0);
+    ~JobSystem();
+
+    // Threads running jobs, counting the calling thread
+    unsigned int threadCount() const;
+
+    // Queue a job, counted in a group if given, and held back until the after group has finished if given
+    void run(const Job& job, Counter* counter = NULL, Counter* after = NULL);
+
+    // Run jobs until the group has finished
+    void wait(Counter& counter);
+
+    // Split a range into chunks run as jobs, and wait for them (ranges of one chunk run straight away)
+    void parallelFor(unsigned int count, unsigned int chunkSize, const RangeJob& job);
+
+    // Same, running the whole range on the calling thread when there is no job system
+    static void parallelFor(JobSystem* jobs, unsigned int count, unsigned int chunkSize, const RangeJob& job);
+
+    void resetStats();
+
+    // Time a frame's worth of per object work on a scene of count objects with 1 to N threads
+    static void benchmark(unsigned int count);
+
+private:
+    struct Task
+    {
+        Job job;
+        Counter* counter;
+    };
+
+    struct Queue
+    {
+        std::deque<Task> tasks;
+        std::mutex mutex;
+    };
+
+    // Queue 0 is shared by the threads that are not workers
+    std::vector<Queue*> queues;
+    std::vector<std::thread> workers;
+
+    // Idle workers sleep until a job is queued
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::atomic<unsigned int> queuedCount;
+    bool quit = false;
+
+    // Queue of the calling thread
+    unsigned int queueIndex() const;
+
+    void push(const Task& task);
+
+    // Take a job from a queue's back, or steal one from the front of another queue
+    bool pop(unsigned int queue, Task& task);
+    bool steal(unsigned int thief, Task& task);
+
+    // Run one job if there is any, returns false when there was none
+    bool runOne(unsigned int queue);
+
+    // Count a job as finished, starting the jobs waiting for its group when it was the last
+    void finish(Counter* counter);
+
+    void workerLoop(unsigned int index);
+};
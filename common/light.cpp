@@ -1,5 +1,10 @@
+#include <cmath>
+#include <algorithm>
+
 #include <common/light.hpp>
 #include <common/maths.hpp>
+#include <common/glstate.hpp>
+#include <common/renderer.hpp>
 
 bool active = false;
 int upOrDown = 5;
@@ -16,6 +21,7 @@ void Light::addPointLight(const glm::vec3 position, const glm::vec3 colour,
     light.linear = linear;
     light.quadratic = quadratic;
     light.type = 1;
+    light.range = range(light, cutoff);
     lightSources.push_back(light);
 }
 
@@ -33,6 +39,7 @@ void Light::addSpotLight(const glm::vec3 position, const glm::vec3 direction,
     light.quadratic = quadratic;
     light.cosPhi = cosPhi;
     light.type = 2;
+    light.range = range(light, cutoff);
     lightSources.push_back(light);
 }
 
@@ -42,85 +49,205 @@ void Light::addDirectionalLight(const glm::vec3 direction, const glm::vec3 colou
     light.direction = direction;
     light.colour = colour;
     light.type = 3;
+    light.range = INFINITY;
     lightSources.push_back(light);
 }
 
-void Light::toShader(unsigned int shaderID, glm::mat4 view)
+void Light::calculateRanges()
 {
-    unsigned int numLights = static_cast<unsigned int>(lightSources.size());
-    glUniform1i(glGetUniformLocation(shaderID, "numLights"), numLights);
-
-    for (unsigned int i = 0; i < numLights; i++)
+    JobSystem::parallelFor(jobs, static_cast<unsigned int>(lightSources.size()), chunkSize,
+        [this](unsigned int begin, unsigned int end)
     {
-        std::string idx = std::to_string(i);
-        glm::vec3 VSLightPosition = glm::vec3(view * glm::vec4(lightSources[i].position, 1.0f));
-        glm::vec3 VSLightDirection = glm::vec3(view * glm::vec4(lightSources[i].direction, 0.0f));
-        glUniform3fv(glGetUniformLocation(shaderID, ("lightSources[" + idx + "].position").c_str()), 1, &VSLightPosition[0]);
-        glUniform3fv(glGetUniformLocation(shaderID, ("lightSources[" + idx + "].direction").c_str()), 1, &VSLightDirection[0]);
-        glUniform3fv(glGetUniformLocation(shaderID, ("lightSources[" + idx + "].colour").c_str()), 1, &lightSources[i].colour[0]);
-        glUniform1f(glGetUniformLocation(shaderID, ("lightSources[" + idx + "].constant").c_str()), lightSources[i].constant);
-        glUniform1f(glGetUniformLocation(shaderID, ("lightSources[" + idx + "].linear").c_str()), lightSources[i].linear);
-        glUniform1f(glGetUniformLocation(shaderID, ("lightSources[" + idx + "].quadratic").c_str()), lightSources[i].quadratic);
-        glUniform1f(glGetUniformLocation(shaderID, ("lightSources[" + idx + "].cosPhi").c_str()), lightSources[i].cosPhi);
-        glUniform1i(glGetUniformLocation(shaderID, ("lightSources[" + idx + "].type").c_str()), lightSources[i].type);
-    }
+        for (unsigned int i = begin; i < end; i++)
+        {
+            if (lightSources[i].type != 3)
+                lightSources[i].range = range(lightSources[i], cutoff);
+        }
+    });
 }
 
-void Light::draw(unsigned int shaderID, glm::mat4 view, glm::mat4 projection, Model lightModel)
+float Light::range(const LightSource& light, float cutoff)
 {
-    glUseProgram(shaderID);
-    for (unsigned int i = 0; i < static_cast<unsigned int>(lightSources.size()); i++)
+    // Solve colour / (constant + linear * d + quadratic * d^2) = cutoff for d
+    float brightest = std::max(light.colour.r, std::max(light.colour.g, light.colour.b));
+    float c = light.constant - brightest / cutoff;
+    if (c >= 0.0f)
+        return 0.0f;
+    if (light.quadratic > 0.0f)
+        return (-light.linear + std::sqrt(light.linear * light.linear - 4.0f * light.quadratic * c)) /
+            (2.0f * light.quadratic);
+    if (light.linear > 0.0f)
+        return -c / light.linear;
+    return INFINITY;
+}
+
+void Light::draw(unsigned int shaderID, const glm::mat4& view, const glm::mat4& projection, const Model& lightModel,
+    OcclusionQueries* queries)
+{
+    Frustum frustum(projection * view);
+    visibleCount = culledCount = impostorCount = 0;
+
+    //Pixels covered by a unit radius at unit distance
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    float pixelScale = 0.5f * viewport[3] * projection[1][1];
+
+    //Cull the gizmos against the view frustum and pick their level of detail in parallel
+    const float scale = 0.1f;
+    gizmoLevels.resize(lightSources.size());
+    JobSystem::parallelFor(jobs, static_cast<unsigned int>(lightSources.size()), chunkSize,
+        [&](unsigned int begin, unsigned int end)
     {
+        for (unsigned int i = begin; i < end; i++)
+        {
             //Ignore directional lights
+            gizmoLevels[i] = gizmoNone;
             if (lightSources[i].type == 3)
                 continue;
 
             //Calculate model matrix
-            glm::mat4 translate = Maths::translate(lightSources[i].position); //CHANGED
-            glm::mat4 scale = Maths::scale(glm::vec3(0.1f)); //CHANGED
-            glm::mat4 model = translate * scale;
+            glm::mat4 model = Maths::translate(lightSources[i].position) * Maths::scale(glm::vec3(scale));
+
+            //Skip gizmos outside the view frustum
+            if (!frustum.contains(lightModel.sphere.transform(model)))
+            {
+                gizmoLevels[i] = gizmoCulled;
+                continue;
+            }
 
-            //Send the MVP and MV matrices to the vertex shader
-            glm::mat4 MVP = projection * view * model;
-            glUniformMatrix4fv(glGetUniformLocation(shaderID, "MVP"), 1, GL_FALSE, &MVP[0][0]);
+            //Draw gizmos only a few pixels across as impostors
+            float distance = std::max(-(view * glm::vec4(lightSources[i].position, 1.0f)).z, 0.001f);
+            gizmoLevels[i] = lightModel.sphere.radius * scale * pixelScale / distance < impostorPixels ?
+                gizmoImpostor : gizmoSphere;
+        }
+    });
 
-            //Send model, view, projection matrices and light colour to light shader
-            glUniform3fv(glGetUniformLocation(shaderID, "lightColour"), 1, &lightSources[i].colour[0]);
+    //Then gather them in order, with the spheres first and the impostors after them
+    std::vector<glm::vec4> impostors;
+    gizmos.clear();
+    for (unsigned int i = 0; i < static_cast<unsigned int>(lightSources.size()); i++)
+    {
+        if (gizmoLevels[i] == gizmoNone)
+            continue;
+        if (gizmoLevels[i] == gizmoCulled)
+        {
+            culledCount++;
+            continue;
+        }
+        visibleCount++;
 
-            //Draw light source
-            lightModel.draw(shaderID);
+        //Test the gizmo's box against the scene depth, and leave it out while its last test found it hidden
+        if (queries != NULL)
+        {
+            glm::mat4 model = Maths::translate(lightSources[i].position) * Maths::scale(glm::vec3(scale));
+            queries->test(i, lightModel.aabb.transform(model));
+            if (!queries->visible(i))
+                continue;
+        }
+
+        std::vector<glm::vec4>& list = gizmoLevels[i] == gizmoImpostor ? impostors : gizmos;
+        list.push_back(glm::vec4(lightSources[i].position, scale));
+        list.push_back(glm::vec4(lightSources[i].colour, 0.0f));
+    }
+    if (queries != NULL)
+        queries->issue(view, projection, glm::vec3(glm::inverse(view)[3]));
+
+    unsigned int sphereCount = static_cast<unsigned int>(gizmos.size()) / 2;
+    impostorCount = static_cast<unsigned int>(impostors.size()) / 2;
+    gizmos.insert(gizmos.end(), impostors.begin(), impostors.end());
+    if (gizmos.empty())
+        return;
+
+    //Make the gizmo buffer the first time gizmos are drawn
+    if (gizmoBuffer == 0)
+    {
+        glGenBuffers(1, &gizmoBuffer);
+        glGenTextures(1, &gizmoTexture);
+        GLState::bindBuffer(GL_TEXTURE_BUFFER, gizmoBuffer);
+        GLState::bindTexture(gizmoUnit, GL_TEXTURE_BUFFER, gizmoTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, gizmoBuffer);
+        glGenVertexArrays(1, &gizmoVAO);
+    }
+    GLState::bindBuffer(GL_TEXTURE_BUFFER, gizmoBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, gizmos.size() * sizeof(glm::vec4), &gizmos[0], GL_STREAM_DRAW);
+
+    //Send the view, projection and gizmo buffer to the shader
+    GLState::useProgram(shaderID);
+    GLState::bindTexture(gizmoUnit, GL_TEXTURE_BUFFER, gizmoTexture);
+    glUniformMatrix4fv(glGetUniformLocation(shaderID, "V"), 1, GL_FALSE, &view[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(shaderID, "P"), 1, GL_FALSE, &projection[0][0]);
+    glUniform1i(glGetUniformLocation(shaderID, "gizmoBuffer"), gizmoUnit);
+    glUniform1f(glGetUniformLocation(shaderID, "modelRadius"), lightModel.sphere.radius);
+
+    //Draw all the spheres in one call
+    if (sphereCount > 0)
+    {
+        const Mesh& mesh = GeometryBuffer::mesh(lightModel.meshID);
+        GeometryBuffer::bind(mesh.block);
+        glUniform1i(glGetUniformLocation(shaderID, "firstGizmo"), 0);
+        glUniform1i(glGetUniformLocation(shaderID, "impostor"), 0);
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT,
+            (void*)(mesh.firstIndex * sizeof(unsigned int)), sphereCount, mesh.baseVertex);
+    }
+
+    //Then all the impostors in another, as squares made in the vertex shader
+    if (impostorCount > 0)
+    {
+        GLState::bindVertexArray(gizmoVAO);
+        glUniform1i(glGetUniformLocation(shaderID, "firstGizmo"), sphereCount);
+        glUniform1i(glGetUniformLocation(shaderID, "impostor"), 1);
+        glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, impostorCount);
     }
 }
 
+void Light::deleteBuffers()
+{
+    glDeleteBuffers(1, &gizmoBuffer);
+    glDeleteTextures(1, &gizmoTexture);
+    glDeleteVertexArrays(1, &gizmoVAO);
+    gizmoBuffer = gizmoTexture = gizmoVAO = 0;
+    GLState::invalidate();
+}
+
 //Checks if lights need to change (based on where player is)
 void Light::activated() {
     active = true;
-    for (unsigned int i = 0; i < static_cast<unsigned int>(lightSources.size()); i++)
+    JobSystem::parallelFor(jobs, static_cast<unsigned int>(lightSources.size()), chunkSize,
+        [this](unsigned int begin, unsigned int end)
     {
-        if (lightSources[i].type == 2) {
-            lightSources[i].colour = glm::vec3(1.0f, 0.0f, 0.0f);
-        }
-        else if (lightSources[i].position.y < 3) {
-            lightSources[i].position = glm::vec3(lightSources[i].position.x, lightSources[i].position.y + 0.025f, lightSources[i].position.z);
-            lightSources[i].linear = 5.8f;
+        for (unsigned int i = begin; i < end; i++)
+        {
+            if (lightSources[i].type == 2) {
+                lightSources[i].colour = glm::vec3(1.0f, 0.0f, 0.0f);
+            }
+            else if (lightSources[i].position.y < 3) {
+                lightSources[i].position = glm::vec3(lightSources[i].position.x, lightSources[i].position.y + 0.025f, lightSources[i].position.z);
+                lightSources[i].linear = 5.8f;
+            }
         }
-    }
+    });
+    calculateRanges();
 }
 
 void Light::deactivated() {
     active = false;
-    for (unsigned int i = 0; i < static_cast<unsigned int>(lightSources.size()); i++)
+    JobSystem::parallelFor(jobs, static_cast<unsigned int>(lightSources.size()), chunkSize,
+        [this](unsigned int begin, unsigned int end)
     {
-        if (lightSources[i].type == 2) {
-            lightSources[i].colour = glm::vec3(1.0f, 1.0f, 1.0f);
-        }
-        if (lightSources[i].type == 1) {
-            if (lightSources[i].position.y > -10) {
-                lightSources[i].position = glm::vec3(lightSources[i].position.x, lightSources[i].position.y - 0.05f, lightSources[i].position.z);
-                lightSources[i].linear = 20.8f;
+        for (unsigned int i = begin; i < end; i++)
+        {
+            if (lightSources[i].type == 2) {
+                lightSources[i].colour = glm::vec3(1.0f, 1.0f, 1.0f);
+            }
+            if (lightSources[i].type == 1) {
+                if (lightSources[i].position.y > -10) {
+                    lightSources[i].position = glm::vec3(lightSources[i].position.x, lightSources[i].position.y - 0.05f, lightSources[i].position.z);
+                    lightSources[i].linear = 20.8f;
+                }
             }
         }
-    }
+    });
+    calculateRanges();
 }
 
 //NO GLM LEFT
@@ -2,6 +2,9 @@
 
 #include <external/glm-0.9.7.1/glm/gtc/matrix_transform.hpp>
 #include <common/model.hpp>
+#include <common/bounds.hpp>
+#include <common/occlusionquery.hpp>
+#include <common/jobsystem.hpp>
 
 struct LightSource
 {
@@ -13,6 +16,8 @@ struct LightSource
     float quadratic;
     float cosPhi;
     unsigned int type;
+    float range;    // distance at which the light falls below the cutoff
+    int shadow = -1;    // layer in the shadow maps (slot in the atlas for point lights), -1 for none
 };
 
 class Light
@@ -21,6 +26,21 @@ public:
     std::vector<LightSource> lightSources;
     unsigned int lightShaderID;
 
+    // Intensity below which a light is treated as out of range
+    float cutoff = 1.0f / 256.0f;
+
+    // Job system to split the per-light loops over, in chunks of lights (the calling thread runs them when NULL)
+    JobSystem* jobs = NULL;
+    static const unsigned int chunkSize = 256;
+
+    // Light source gizmos drawn and culled last frame
+    unsigned int visibleCount = 0;
+    unsigned int culledCount = 0;
+
+    // Gizmos drawn as flat impostors last frame, and the radius in pixels below which they are used
+    unsigned int impostorCount = 0;
+    float impostorPixels = 8.0f;
+
     // Add lightSources
     void addPointLight(const glm::vec3 position, const glm::vec3 colour,
         const float constant, const float linear,
@@ -31,15 +51,38 @@ public:
         const float cosPhi);
     void addDirectionalLight(const glm::vec3 direction, const glm::vec3 colour);
 
-    // Send to shader
-    void toShader(unsigned int shaderID, glm::mat4 view);
+    // Recalculate the ranges after changing the cutoff or the attenuation
+    void calculateRanges();
 
-    // Draw light source
-    void draw(unsigned int shaderID, glm::mat4 view, glm::mat4 projection, Model lightModel);
+    // Distance at which a light's attenuation falls below the cutoff
+    static float range(const LightSource& light, float cutoff);
+
+    // Draw light source gizmos inside the view frustum with one instanced draw per level of detail,
+    // leaving out the ones the occlusion queries last found hidden if given
+    void draw(unsigned int shaderID, const glm::mat4& view, const glm::mat4& projection, const Model& lightModel,
+        OcclusionQueries* queries = NULL);
+
+    // Cleanup
+    void deleteBuffers();
 
     void activated();
 
     void deactivated();
 
     //void pointLightCirculate(glm::vec3);
+
+private:
+    // Position, scale and colour of each gizmo drawn, and an empty VAO for the impostors (made on the first draw)
+    std::vector<glm::vec4> gizmos;
+    unsigned int gizmoBuffer = 0, gizmoTexture = 0, gizmoVAO = 0;
+
+    // Whether each light's gizmo is culled or drawn as a sphere or an impostor, picked in parallel before they are gathered
+    enum GizmoLevel
+    {
+        gizmoNone,
+        gizmoCulled,
+        gizmoSphere,
+        gizmoImpostor
+    };
+    std::vector<unsigned char> gizmoLevels;
 };
\ No newline at end of file
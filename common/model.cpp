@@ -1,13 +1,16 @@
 #include <vector>
+#include <map>
 #include <stdio.h>
 #include <string>
 #include <cstring>
 #include <iostream>
+#include <algorithm>
 
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 
 #include "model.hpp"
+#include "glstate.hpp"
 #include "stb_image.hpp"
 
 Model::Model(const char* path)
@@ -18,6 +21,9 @@ Model::Model(const char* path)
     // Calculate tangent and bitangent vectors
     calculateTangents();
 
+    // Calculate bounding volumes
+    calculateBounds();
+
     // Setup buffers
     setupBuffers();
 }
@@ -37,88 +43,60 @@ void Model::draw(unsigned int& shaderID)
     {
         // Bind texture
         std::string name = textures[i].type;
-        glActiveTexture(GL_TEXTURE0 + i);
         glUniform1i(glGetUniformLocation(shaderID, (name + "Map").c_str()), i);
-        glBindTexture(GL_TEXTURE_2D, textures[i].id);
+        GLState::bindTexture(i, GL_TEXTURE_2D, textures[i].id);
     }
 
-    // Draw the triangles
-    glBindVertexArray(VAO);
-    glDrawArrays(GL_TRIANGLES, 0, static_cast<unsigned int>(vertices.size()));
-    glBindVertexArray(0);
+    // Draw the triangles (the VAO is left bound for the next draw)
+    const Mesh& mesh = GeometryBuffer::mesh(meshID);
+    GeometryBuffer::bind(mesh.block);
+    glDrawElementsBaseVertex(GL_TRIANGLES, mesh.indexCount, GL_UNSIGNED_INT,
+        (void*)(mesh.firstIndex * sizeof(unsigned int)), mesh.baseVertex);
 }
 
 void Model::setupBuffers()
 {
-    // Create and bind the Vertex Array Object (VAO)
-    glGenVertexArrays(1, &VAO);
-    glBindVertexArray(VAO);
-
-    // Create Vertex Buffer Object
-    unsigned int vertexBuffer;
-    glGenBuffers(1, &vertexBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), &vertices[0], GL_STATIC_DRAW);
-
-    // Create uv buffer
-    unsigned int uvBuffer;
-    glGenBuffers(1, &uvBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, uvBuffer);
-    glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(glm::vec2), &uvs[0], GL_STATIC_DRAW);
-
-    // Create normal buffer
-    unsigned int normalBuffer;
-    glGenBuffers(1, &normalBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, normalBuffer);
-    glBufferData(GL_ARRAY_BUFFER, normals.size() * sizeof(glm::vec3), &normals[0], GL_STATIC_DRAW);
-
-    // Bind the vertex buffer
-    glEnableVertexAttribArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-    // Bind the uv buffer
-    glEnableVertexAttribArray(1);
-    glBindBuffer(GL_ARRAY_BUFFER, uvBuffer);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-    // Bind the normal buffer
-    glEnableVertexAttribArray(2);
-    glBindBuffer(GL_ARRAY_BUFFER, normalBuffer);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-    // Create tangent buffer
-    GLuint tangentBuffer;
-    glGenBuffers(1, &tangentBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, tangentBuffer);
-    glBufferData(GL_ARRAY_BUFFER, tangents.size() * sizeof(glm::vec3), &tangents[0], GL_STATIC_DRAW);
-
-    // Create bitangent buffer
-    GLuint bitangentBuffer;
-    glGenBuffers(1, &bitangentBuffer);
-    glBindBuffer(GL_ARRAY_BUFFER, bitangentBuffer);
-    glBufferData(GL_ARRAY_BUFFER, bitangents.size() * sizeof(glm::vec3), &bitangents[0], GL_STATIC_DRAW);
-
-    // Bind the tangent buffer
-    glEnableVertexAttribArray(3);
-    glBindBuffer(GL_ARRAY_BUFFER, tangentBuffer);
-    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-    // Bind the bitangent buffer
-    glEnableVertexAttribArray(4);
-    glBindBuffer(GL_ARRAY_BUFFER, bitangentBuffer);
-    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-
-    // Unbind the VAO
-    glBindVertexArray(0);
+    // Pack the mesh into the shared vertex and index buffers
+    std::vector<Vertex> meshVertices;
+    std::vector<unsigned int> indices;
+    buildMesh(glm::mat4(1.0f), meshVertices, indices);
+    meshID = GeometryBuffer::add(meshVertices, indices);
+}
+
+void Model::buildMesh(const glm::mat4& transform, std::vector<Vertex>& meshVertices,
+    std::vector<unsigned int>& indices) const
+{
+    // Normals use the inverse transpose so non-uniform scales keep them perpendicular
+    glm::mat3 linear = glm::mat3(transform);
+    glm::mat3 normalMatrix = glm::transpose(glm::inverse(linear));
+
+    // Interleave the attributes and merge identical vertices
+    unsigned int firstVertex = static_cast<unsigned int>(meshVertices.size());
+    std::map<std::string, unsigned int> vertexIndex;
+    for (unsigned int i = 0; i < vertices.size(); i++)
+    {
+        Vertex vertex;
+        vertex.position = glm::vec3(transform * glm::vec4(vertices[i], 1.0f));
+        vertex.uv = uvs[i];
+        vertex.normal = normalMatrix * normals[i];
+        vertex.tangent = linear * tangents[i];
+        vertex.bitangent = linear * bitangents[i];
+
+        std::string key(reinterpret_cast<const char*>(&vertex), sizeof(Vertex));
+        std::map<std::string, unsigned int>::iterator it = vertexIndex.find(key);
+        if (it == vertexIndex.end())
+        {
+            it = vertexIndex.insert(std::make_pair(key, static_cast<unsigned int>(meshVertices.size()) - firstVertex)).first;
+            meshVertices.push_back(vertex);
+        }
+        indices.push_back(it->second);
+    }
 }
 
 void Model::deleteBuffers()
 {
-    glDeleteBuffers(1, &vertexBuffer);
-    glDeleteBuffers(1, &uvBuffer);
-    glDeleteBuffers(1, &normalBuffer);
-    glDeleteVertexArrays(1, &VAO);
+    // Return the mesh's ranges to the shared geometry buffers
+    GeometryBuffer::remove(meshID);
 }
 
 bool Model::loadObj(const char* path,
@@ -244,9 +222,15 @@ void Model::addTexture(const char* path, const std::string type)
 
 unsigned int Model::loadTexture(const char* path)
 {
+    // Reuse the texture if this file has been loaded before
+    static std::map<std::string, unsigned int> loaded;
+    std::map<std::string, unsigned int>::iterator it = loaded.find(path);
+    if (it != loaded.end())
+        return it->second;
 
     unsigned int textureID;
     glGenTextures(1, &textureID);
+    loaded[path] = textureID;
 
     int width, height, numComponents;
     unsigned char* data = stbi_load(path, &width, &height, &numComponents, 0);
@@ -260,7 +244,7 @@ unsigned int Model::loadTexture(const char* path)
         else if (numComponents == 4)
             format = GL_RGBA;
 
-        glBindTexture(GL_TEXTURE_2D, textureID);
+        GLState::bindTexture(0, GL_TEXTURE_2D, textureID);
         glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
         glGenerateMipmap(GL_TEXTURE_2D);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -279,6 +263,18 @@ unsigned int Model::loadTexture(const char* path)
     return textureID;
 }
 
+void Model::calculateBounds()
+{
+    aabb = AABB::fromPoints(vertices.empty() ? NULL : &vertices[0],
+        static_cast<unsigned int>(vertices.size()), sizeof(glm::vec3));
+
+    // Sphere around the box centre through the furthest vertex
+    sphere.centre = aabb.centre();
+    sphere.radius = 0.0f;
+    for (unsigned int i = 0; i < vertices.size(); i++)
+        sphere.radius = std::max(sphere.radius, glm::length(vertices[i] - sphere.centre));
+}
+
 void Model::calculateTangents()
 {
     for (unsigned int i = 0; i < vertices.size(); i += 3)
@@ -7,6 +7,9 @@
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 
+#include <common/geometry.hpp>
+#include <common/bounds.hpp>
+
 // Texture struct
 struct Texture
 {
@@ -28,6 +31,13 @@ public:
     std::vector<glm::vec3> tangents;
     std::vector<glm::vec3> bitangents;
 
+    // Mesh id in the shared geometry buffers
+    unsigned int meshID;
+
+    // Object space bounding volumes
+    AABB aabb;
+    BoundingSphere sphere;
+
     // Constructor
     Model(const char* path);
 
@@ -40,16 +50,15 @@ public:
     // Cleanup
     void deleteBuffers();
 
-private:
+    // Append interleaved, indexed vertices transformed by a matrix (indices
+    // are relative to the first appended vertex)
+    void buildMesh(const glm::mat4& transform, std::vector<Vertex>& meshVertices,
+        std::vector<unsigned int>& indices) const;
 
-    // Array buffers
-    unsigned int VAO;
-    unsigned int vertexBuffer;
-    unsigned int uvBuffer;
-    unsigned int normalBuffer;
+    // Load texture (each file is only loaded once)
+    static unsigned int loadTexture(const char* path);
 
-    unsigned int tangentBuffer;
-    unsigned int bitangentBuffer;
+private:
 
     // Load .obj file method
     bool loadObj(const char* path,
@@ -60,9 +69,9 @@ private:
     // Setup buffers
     void setupBuffers();
 
-    // Load texture
-    unsigned int loadTexture(const char* path);
-
     // Calculate tangents and bitangents
     void calculateTangents();
+
+    // Calculate the bounding box and sphere
+    void calculateBounds();
 };
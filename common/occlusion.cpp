@@ -0,0 +1,307 @@
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+
+#include <common/occlusion.hpp>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define OCCLUSION_SSE
+#endif
+
+OcclusionBuffer::OcclusionBuffer()
+{
+    depth.assign(width * height, 1.0f);
+    tileTriangles.resize(tilesX * tilesY);
+
+    // Mip chain of the farthest depth in each 2x2 block
+    unsigned int w = width, h = height;
+    while (true)
+    {
+        hiZWidth.push_back(w);
+        hiZHeight.push_back(h);
+        hiZ.push_back(std::vector<float>(w * h, 1.0f));
+        if (w == 1 && h == 1)
+            break;
+        w = std::max(1u, (w + 1) / 2);
+        h = std::max(1u, (h + 1) / 2);
+    }
+
+    // The main thread rasterizes too, so leave a core for it
+    unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    unsigned int numWorkers = std::min(3u, cores - 1);
+    for (unsigned int i = 0; i < numWorkers; i++)
+        workers.push_back(std::thread(&OcclusionBuffer::workerLoop, this));
+}
+
+OcclusionBuffer::~OcclusionBuffer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    startWork.notify_all();
+    for (unsigned int i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+void OcclusionBuffer::begin(const glm::mat4& viewProjection)
+{
+    this->viewProjection = viewProjection;
+    triangles.clear();
+    for (unsigned int i = 0; i < tileTriangles.size(); i++)
+        tileTriangles[i].clear();
+    occluderTriangles = 0;
+    testedCount = 0;
+    occludedCount = 0;
+}
+
+void OcclusionBuffer::addOccluder(const std::vector<glm::vec3>& vertices, const glm::mat4& transform)
+{
+    glm::mat4 MVP = viewProjection * transform;
+    for (unsigned int i = 0; i + 2 < vertices.size(); i += 3)
+    {
+        // Skip triangles crossing the near plane (leaving out an occluder is always safe)
+        Triangle triangle;
+        bool clipped = false;
+        for (int j = 0; j < 3 && !clipped; j++)
+        {
+            glm::vec4 clip = MVP * glm::vec4(vertices[i + j], 1.0f);
+            if (clip.w < 1e-4f || clip.z < -clip.w)
+                clipped = true;
+            glm::vec3 ndc = glm::vec3(clip) / clip.w;
+            triangle.v[j] = glm::vec3((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height,
+                ndc.z * 0.5f + 0.5f);
+        }
+        if (clipped)
+            continue;
+
+        // Bin into the tiles the triangle's screen box touches
+        glm::vec3 lo = glm::min(triangle.v[0], glm::min(triangle.v[1], triangle.v[2]));
+        glm::vec3 hi = glm::max(triangle.v[0], glm::max(triangle.v[1], triangle.v[2]));
+        if (hi.x < 0.0f || hi.y < 0.0f || lo.x >= width || lo.y >= height || lo.z > 1.0f)
+            continue;
+        int x0 = std::max(0, static_cast<int>(lo.x) / static_cast<int>(tileSize));
+        int y0 = std::max(0, static_cast<int>(lo.y) / static_cast<int>(tileSize));
+        int x1 = std::min(static_cast<int>(tilesX) - 1, static_cast<int>(hi.x) / static_cast<int>(tileSize));
+        int y1 = std::min(static_cast<int>(tilesY) - 1, static_cast<int>(hi.y) / static_cast<int>(tileSize));
+
+        unsigned int index = static_cast<unsigned int>(triangles.size());
+        triangles.push_back(triangle);
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+                tileTriangles[y * tilesX + x].push_back(index);
+        }
+    }
+    occluderTriangles = static_cast<unsigned int>(triangles.size());
+}
+
+void OcclusionBuffer::render()
+{
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    // Wake the workers and rasterize alongside them
+    nextTile = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        busyWorkers = static_cast<unsigned int>(workers.size());
+        generation++;
+    }
+    startWork.notify_all();
+    rasterizeTiles();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        workDone.wait(lock, [this] { return busyWorkers == 0; });
+    }
+
+    buildHiZ();
+
+    renderTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void OcclusionBuffer::workerLoop()
+{
+    unsigned int seen = 0;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            startWork.wait(lock, [&] { return quit || generation != seen; });
+            if (quit)
+                return;
+            seen = generation;
+        }
+
+        rasterizeTiles();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busyWorkers--;
+        }
+        workDone.notify_one();
+    }
+}
+
+void OcclusionBuffer::rasterizeTiles()
+{
+    unsigned int tile;
+    while ((tile = nextTile++) < tilesX * tilesY)
+        rasterizeTile(tile);
+}
+
+void OcclusionBuffer::rasterizeTile(unsigned int tile)
+{
+    int tileX = (tile % tilesX) * tileSize;
+    int tileY = (tile / tilesX) * tileSize;
+
+    // Clear the tile
+    for (unsigned int y = 0; y < tileSize; y++)
+        std::fill_n(&depth[(tileY + y) * width + tileX], tileSize, 1.0f);
+
+    const std::vector<unsigned int>& list = tileTriangles[tile];
+    for (unsigned int t = 0; t < list.size(); t++)
+    {
+        glm::vec3 v0 = triangles[list[t]].v[0];
+        glm::vec3 v1 = triangles[list[t]].v[1];
+        glm::vec3 v2 = triangles[list[t]].v[2];
+
+        // Both windings occlude, so make the edge functions positive inside
+        float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+        if (std::abs(area) < 1e-6f)
+            continue;
+        if (area < 0.0f)
+        {
+            std::swap(v1, v2);
+            area = -area;
+        }
+
+        // Edge functions E(x, y) = A * x + B * y + C
+        float A0 = v1.y - v2.y, B0 = v2.x - v1.x, C0 = -(A0 * v1.x + B0 * v1.y);
+        float A1 = v2.y - v0.y, B1 = v0.x - v2.x, C1 = -(A1 * v2.x + B1 * v2.y);
+        float A2 = v0.y - v1.y, B2 = v1.x - v0.x, C2 = -(A2 * v0.x + B2 * v0.y);
+
+        // Depth is linear in screen space
+        float dzdx = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+        float dzdy = ((v2.z - v0.z) * (v1.x - v0.x) - (v1.z - v0.z) * (v2.x - v0.x)) / area;
+        float z0 = v0.z - dzdx * v0.x - dzdy * v0.y;
+
+        // Triangle's box inside the tile, with x rounded to groups of four
+        int minX = std::max(tileX, static_cast<int>(std::floor(std::min(v0.x, std::min(v1.x, v2.x)))));
+        int minY = std::max(tileY, static_cast<int>(std::floor(std::min(v0.y, std::min(v1.y, v2.y)))));
+        int maxX = std::min(tileX + static_cast<int>(tileSize) - 1, static_cast<int>(std::ceil(std::max(v0.x, std::max(v1.x, v2.x)))));
+        int maxY = std::min(tileY + static_cast<int>(tileSize) - 1, static_cast<int>(std::ceil(std::max(v0.y, std::max(v1.y, v2.y)))));
+        minX &= ~3;
+        if (minX > maxX || minY > maxY)
+            continue;
+
+        for (int y = minY; y <= maxY; y++)
+        {
+            float py = y + 0.5f;
+            float* row = &depth[y * width];
+#ifdef OCCLUSION_SSE
+            __m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+            __m128 zero = _mm_setzero_ps();
+            for (int x = minX; x <= maxX; x += 4)
+            {
+                __m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), offsets);
+                __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A0), px), _mm_set1_ps(B0 * py + C0));
+                __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A1), px), _mm_set1_ps(B1 * py + C1));
+                __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A2), px), _mm_set1_ps(B2 * py + C2));
+                __m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero),
+                    _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+                if (_mm_movemask_ps(inside) == 0)
+                    continue;
+
+                // Keep the nearer depth where the pixel is covered
+                __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(dzdx), px), _mm_set1_ps(dzdy * py + z0));
+                __m128 old = _mm_loadu_ps(row + x);
+                __m128 nearer = _mm_min_ps(old, z);
+                _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+            }
+#else
+            for (int x = minX; x <= maxX; x++)
+            {
+                float px = x + 0.5f;
+                if (A0 * px + B0 * py + C0 < 0.0f || A1 * px + B1 * py + C1 < 0.0f || A2 * px + B2 * py + C2 < 0.0f)
+                    continue;
+                float z = z0 + dzdx * px + dzdy * py;
+                row[x] = std::min(row[x], z);
+            }
+#endif
+        }
+    }
+}
+
+void OcclusionBuffer::buildHiZ()
+{
+    hiZ[0] = depth;
+    for (unsigned int level = 1; level < hiZ.size(); level++)
+    {
+        const std::vector<float>& src = hiZ[level - 1];
+        unsigned int srcW = hiZWidth[level - 1], srcH = hiZHeight[level - 1];
+        std::vector<float>& dst = hiZ[level];
+        for (unsigned int y = 0; y < hiZHeight[level]; y++)
+        {
+            for (unsigned int x = 0; x < hiZWidth[level]; x++)
+            {
+                unsigned int sx = 2 * x, sy = 2 * y;
+                unsigned int sx1 = std::min(sx + 1, srcW - 1), sy1 = std::min(sy + 1, srcH - 1);
+                dst[y * hiZWidth[level] + x] = std::max(std::max(src[sy * srcW + sx], src[sy * srcW + sx1]),
+                    std::max(src[sy1 * srcW + sx], src[sy1 * srcW + sx1]));
+            }
+        }
+    }
+}
+
+bool OcclusionBuffer::visible(const AABB& box)
+{
+    testedCount++;
+
+    // Screen rectangle and nearest depth of the box's corners
+    glm::vec2 lo(INFINITY), hi(-INFINITY);
+    float nearest = INFINITY;
+    for (int i = 0; i < 8; i++)
+    {
+        glm::vec3 corner((i & 1) ? box.max.x : box.min.x, (i & 2) ? box.max.y : box.min.y,
+            (i & 4) ? box.max.z : box.min.z);
+        glm::vec4 clip = viewProjection * glm::vec4(corner, 1.0f);
+
+        // Boxes crossing the near plane are treated as visible
+        if (clip.w < 1e-4f || clip.z < -clip.w)
+            return true;
+        glm::vec3 ndc = glm::vec3(clip) / clip.w;
+        glm::vec2 screen((ndc.x * 0.5f + 0.5f) * width, (ndc.y * 0.5f + 0.5f) * height);
+        lo = glm::min(lo, screen);
+        hi = glm::max(hi, screen);
+        nearest = std::min(nearest, ndc.z * 0.5f + 0.5f);
+    }
+
+    // Off screen boxes are left to frustum culling
+    int x0 = std::max(0, static_cast<int>(std::floor(lo.x)));
+    int y0 = std::max(0, static_cast<int>(std::floor(lo.y)));
+    int x1 = std::min(static_cast<int>(width) - 1, static_cast<int>(hi.x));
+    int y1 = std::min(static_cast<int>(height) - 1, static_cast<int>(hi.y));
+    if (x0 > x1 || y0 > y1)
+        return true;
+
+    // Pick the level where the rectangle covers at most 2x2 texels
+    unsigned int level = 0;
+    while (level + 1 < hiZ.size() && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+        level++;
+
+    float farthest = 0.0f;
+    unsigned int w = hiZWidth[level];
+    for (int y = y0 >> level; y <= (y1 >> level); y++)
+    {
+        for (int x = x0 >> level; x <= (x1 >> level); x++)
+            farthest = std::max(farthest, hiZ[level][y * w + x]);
+    }
+
+    if (nearest > farthest)
+    {
+        occludedCount++;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <glm/glm.hpp>
+
+#include <common/bounds.hpp>
+
+// Software occlusion culling. Occluder triangles are binned into screen
+// tiles and rasterized into a small depth buffer by worker threads (four
+// pixels at a time with SSE), then a max-depth hierarchy is built so the
+// screen-space box of an occludee can be tested with a few reads.
+class OcclusionBuffer
+{
+public:
+    // Depth buffer size and tile size in pixels
+    static const unsigned int width = 256;
+    static const unsigned int height = 192;
+    static const unsigned int tileSize = 32;
+
+    // Stats for the last frame
+    unsigned int occluderTriangles = 0;
+    unsigned int testedCount = 0;
+    unsigned int occludedCount = 0;
+    float renderTime = 0.0f;  // ms
+
+    // Constructor starts the worker threads, destructor stops them
+    OcclusionBuffer();
+    ~OcclusionBuffer();
+
+    // Start a frame
+    void begin(const glm::mat4& viewProjection);
+
+    // Add an occluder given as a list of triangle vertices
+    void addOccluder(const std::vector<glm::vec3>& triangles, const glm::mat4& transform);
+
+    // Rasterize the occluders and build the depth hierarchy
+    void render();
+
+    // Could any part of the world-space box be visible
+    bool visible(const AABB& box);
+
+private:
+    // Screen-space triangle (x, y in pixels, z in [0, 1])
+    struct Triangle
+    {
+        glm::vec3 v[3];
+    };
+
+    static const unsigned int tilesX = width / tileSize;
+    static const unsigned int tilesY = height / tileSize;
+
+    glm::mat4 viewProjection;
+    std::vector<Triangle> triangles;
+    std::vector<std::vector<unsigned int> > tileTriangles;
+
+    // Depth buffer and its max-depth mip chain
+    std::vector<float> depth;
+    std::vector<std::vector<float> > hiZ;
+    std::vector<unsigned int> hiZWidth, hiZHeight;
+
+    // Worker threads take tiles from a shared counter
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable startWork, workDone;
+    unsigned int generation = 0;
+    unsigned int busyWorkers = 0;
+    bool quit = false;
+    std::atomic<unsigned int> nextTile;
+
+    void workerLoop();
+    void rasterizeTiles();
+    void rasterizeTile(unsigned int tile);
+    void buildHiZ();
+};
@@ -0,0 +1,150 @@
+#include <common/occlusionquery.hpp>
+#include <common/glstate.hpp>
+
+OcclusionQueries::OcclusionQueries(unsigned int shaderID)
+{
+    this->shaderID = shaderID;
+
+    // Unit cube from -1 to 1, scaled to each box when it is drawn
+    float vertices[] = {
+        -1.0f, -1.0f, -1.0f,   1.0f, -1.0f, -1.0f,   1.0f,  1.0f, -1.0f,  -1.0f,  1.0f, -1.0f,
+        -1.0f, -1.0f,  1.0f,   1.0f, -1.0f,  1.0f,   1.0f,  1.0f,  1.0f,  -1.0f,  1.0f,  1.0f
+    };
+    unsigned int indices[] = {
+        0, 2, 1,  0, 3, 2,   4, 5, 6,  4, 6, 7,   0, 1, 5,  0, 5, 4,
+        3, 6, 2,  3, 7, 6,   0, 4, 7,  0, 7, 3,   1, 2, 6,  1, 6, 5
+    };
+
+    glGenVertexArrays(1, &VAO);
+    GLState::bindVertexArray(VAO);
+    glGenBuffers(1, &vertexBuffer);
+    GLState::bindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
+    glGenBuffers(1, &indexBuffer);
+    GLState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
+}
+
+void OcclusionQueries::test(unsigned int id, const AABB& box)
+{
+    if (id >= queries.size())
+        queries.resize(id + 1);
+    queued.push_back(std::make_pair(id, box));
+}
+
+void OcclusionQueries::issue(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& eye)
+{
+    // Pick up the results the GPU has finished without waiting for the others
+    hiddenCount = 0;
+    for (unsigned int i = 0; i < queries.size(); i++)
+    {
+        if (queries[i].pending)
+        {
+            unsigned int available = 0;
+            glGetQueryObjectuiv(queries[i].query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (available)
+            {
+                unsigned int samplesPassed = 0;
+                glGetQueryObjectuiv(queries[i].query, GL_QUERY_RESULT, &samplesPassed);
+                queries[i].visible = samplesPassed != 0;
+                queries[i].pending = false;
+            }
+        }
+        if (!queries[i].visible)
+            hiddenCount++;
+    }
+
+    issuedCount = 0;
+    if (queued.empty())
+        return;
+
+    // Depth test the boxes without writing anything, from both sides
+    GLState::useProgram(shaderID);
+    GLState::bindVertexArray(VAO);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+    GLState::disable(GL_CULL_FACE);
+
+    glm::mat4 viewProjection = projection * view;
+    for (unsigned int i = 0; i < queued.size(); i++)
+    {
+        Query& query = queries[queued[i].first];
+        const AABB& box = queued[i].second;
+
+        // The near plane would cut a box around the camera, so it is always visible
+        glm::vec3 margin(0.5f);
+        if (glm::all(glm::greaterThan(eye, box.min - margin)) && glm::all(glm::lessThan(eye, box.max + margin)))
+        {
+            query.visible = true;
+            query.issued = false;
+            continue;
+        }
+
+        // Keep waiting on a query the GPU has not finished
+        if (query.pending)
+            continue;
+        if (query.query == 0)
+            glGenQueries(1, &query.query);
+
+        // Grown a little, so an object whose box is its own surface (the platform) is not hidden by its own depth
+        glm::mat4 model(1.0f);
+        glm::vec3 extent = box.extent() * 1.02f + glm::vec3(0.01f);
+        model[0][0] = extent.x;
+        model[1][1] = extent.y;
+        model[2][2] = extent.z;
+        model[3] = glm::vec4(box.centre(), 1.0f);
+        glm::mat4 MVP = viewProjection * model;
+        glUniformMatrix4fv(glGetUniformLocation(shaderID, "MVP"), 1, GL_FALSE, &MVP[0][0]);
+
+        glBeginQuery(GL_ANY_SAMPLES_PASSED, query.query);
+        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, (void*)0);
+        glEndQuery(GL_ANY_SAMPLES_PASSED);
+        query.pending = true;
+        query.issued = true;
+        issuedCount++;
+    }
+
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+    GLState::enable(GL_CULL_FACE);
+    queued.clear();
+}
+
+bool OcclusionQueries::visible(unsigned int id) const
+{
+    return id >= queries.size() || queries[id].visible;
+}
+
+void OcclusionQueries::beginConditionalRender(unsigned int id)
+{
+    if (id >= queries.size() || !queries[id].issued)
+        return;
+
+    // Draw anyway if the result is not ready rather than stall
+    glBeginConditionalRender(queries[id].query, GL_QUERY_NO_WAIT);
+    conditional = true;
+}
+
+void OcclusionQueries::endConditionalRender()
+{
+    if (!conditional)
+        return;
+    glEndConditionalRender();
+    conditional = false;
+}
+
+void OcclusionQueries::deleteBuffers()
+{
+    for (unsigned int i = 0; i < queries.size(); i++)
+    {
+        if (queries[i].query != 0)
+            glDeleteQueries(1, &queries[i].query);
+    }
+    queries.clear();
+    glDeleteBuffers(1, &vertexBuffer);
+    glDeleteBuffers(1, &indexBuffer);
+    glDeleteVertexArrays(1, &VAO);
+    GLState::invalidate();
+}
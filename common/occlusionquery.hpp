@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <common/bounds.hpp>
+
+// GPU occlusion tests. Bounding boxes are drawn with colour and depth
+// writes off inside GL_ANY_SAMPLES_PASSED queries; results are only picked
+// up once the GPU has made them available, so nothing ever waits on a
+// readback. A query can also drive conditional rendering of later draws.
+class OcclusionQueries
+{
+public:
+    // Stats for the last issue() call
+    unsigned int issuedCount = 0;
+    unsigned int hiddenCount = 0;
+
+    // Constructor (needs a current GL context and a shader taking a position and an MVP)
+    OcclusionQueries(unsigned int shaderID);
+
+    // Queue a box to be tested by the next issue() call
+    void test(unsigned int id, const AABB& box);
+
+    // Collect finished results and draw the queued boxes against the current depth buffer
+    void issue(const glm::mat4& view, const glm::mat4& projection, const glm::vec3& eye);
+
+    // Last available result for an id (visible until a query has finished)
+    bool visible(unsigned int id) const;
+
+    // Let the GPU skip the draws up to endConditionalRender() if the id's last box was hidden
+    void beginConditionalRender(unsigned int id);
+    void endConditionalRender();
+
+    // Cleanup
+    void deleteBuffers();
+
+private:
+    struct Query
+    {
+        unsigned int query = 0;
+        bool pending = false;
+        bool visible = true;
+        bool issued = false;
+    };
+
+    unsigned int shaderID;
+    unsigned int VAO, vertexBuffer, indexBuffer;
+    std::vector<Query> queries;
+    std::vector<std::pair<unsigned int, AABB> > queued;
+    bool conditional = false;
+};
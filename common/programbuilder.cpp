@@ -0,0 +1,140 @@
+#include <common/programbuilder.hpp>
+#include <common/shader.hpp>
+#include <common/glstate.hpp>
+
+ProgramBuilder::ProgramBuilder()
+{
+    parallel = GLState::extensionSupported("GL_KHR_parallel_shader_compile");
+
+    // Let the driver pick how many threads to use
+    typedef void (APIENTRY* MaxShaderCompilerThreads)(GLuint count);
+    MaxShaderCompilerThreads maxThreads = NULL;
+    if (parallel)
+        maxThreads = reinterpret_cast<MaxShaderCompilerThreads>(glfwGetProcAddress("glMaxShaderCompilerThreadsKHR"));
+    if (maxThreads != NULL)
+        maxThreads(0xFFFFFFFF);
+}
+
+unsigned int ProgramBuilder::submit(const char* vertexPath, const char* fragmentPath, const std::string& defines)
+{
+    std::string vertexCode, fragmentCode;
+    if (!ReadShaderCode(vertexPath, vertexCode) || !ReadShaderCode(fragmentPath, fragmentCode))
+        return 0;
+    vertexCode = InsertDefines(vertexCode, defines);
+    fragmentCode = InsertDefines(fragmentCode, defines);
+
+    // Compile and link without asking for any status, which would wait for the driver
+    printf("Building program : %s, %s\n", vertexPath, fragmentPath);
+    Pending build;
+    const char* source = vertexCode.c_str();
+    build.vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(build.vertexShader, 1, &source, NULL);
+    glCompileShader(build.vertexShader);
+
+    source = fragmentCode.c_str();
+    build.fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(build.fragmentShader, 1, &source, NULL);
+    glCompileShader(build.fragmentShader);
+
+    build.program = glCreateProgram();
+    if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+        glProgramParameteri(build.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glAttachShader(build.program, build.vertexShader);
+    glAttachShader(build.program, build.fragmentShader);
+    glLinkProgram(build.program);
+
+    pending.push_back(build);
+    return build.program;
+}
+
+void ProgramBuilder::poll()
+{
+    for (unsigned int i = 0; i < pending.size();)
+    {
+        GLint done = GL_TRUE;
+        if (parallel)
+            glGetProgramiv(pending[i].program, GL_COMPLETION_STATUS_KHR, &done);
+        if (done == GL_TRUE)
+        {
+            complete(pending[i]);
+            pending.erase(pending.begin() + i);
+        }
+        else
+            i++;
+    }
+}
+
+void ProgramBuilder::finish()
+{
+    for (unsigned int i = 0; i < pending.size(); i++)
+        complete(pending[i]);
+    pending.clear();
+}
+
+bool ProgramBuilder::ready(unsigned int programID) const
+{
+    for (unsigned int i = 0; i < pending.size(); i++)
+    {
+        if (pending[i].program == programID)
+            return false;
+    }
+    return true;
+}
+
+bool ProgramBuilder::linked(unsigned int programID)
+{
+    // 0 is what submit returns when the sources could not be read
+    if (programID == 0 || !ready(programID))
+        return false;
+    std::set<unsigned int>::iterator it = failed.find(programID);
+    if (it == failed.end())
+        return true;
+
+    // The shader reloader may have copied a working binary into it since
+    GLint status = GL_FALSE;
+    glGetProgramiv(programID, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+        return false;
+    failed.erase(it);
+    return true;
+}
+
+unsigned int ProgramBuilder::pendingCount() const
+{
+    return static_cast<unsigned int>(pending.size());
+}
+
+void ProgramBuilder::complete(const Pending& build)
+{
+    printLog(build.vertexShader, false);
+    printLog(build.fragmentShader, false);
+    printLog(build.program, true);
+
+    GLint status = GL_FALSE;
+    glGetProgramiv(build.program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE)
+        failed.insert(build.program);
+
+    glDetachShader(build.program, build.vertexShader);
+    glDetachShader(build.program, build.fragmentShader);
+    glDeleteShader(build.vertexShader);
+    glDeleteShader(build.fragmentShader);
+}
+
+void ProgramBuilder::printLog(unsigned int id, bool program)
+{
+    GLint length = 0;
+    if (program)
+        glGetProgramiv(id, GL_INFO_LOG_LENGTH, &length);
+    else
+        glGetShaderiv(id, GL_INFO_LOG_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    std::vector<char> message(length + 1);
+    if (program)
+        glGetProgramInfoLog(id, length, NULL, &message[0]);
+    else
+        glGetShaderInfoLog(id, length, NULL, &message[0]);
+    printf("%s\n", &message[0]);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+#include <set>
+#include <string>
+
+#include <GL/glew.h>
+
+// From KHR_parallel_shader_compile (not in GLEW 1.13)
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+// Starts compiling and linking programs without waiting for them. With
+// KHR_parallel_shader_compile the driver builds them on its own threads and
+// poll() asks GL_COMPLETION_STATUS_KHR which have finished, so the wait can
+// be spread over asset loading and the first frames. Without the extension
+// the first status query waits, so poll() finishes everything at once.
+class ProgramBuilder
+{
+public:
+    // The driver compiles in the background (KHR_parallel_shader_compile)
+    bool parallel = false;
+
+    // Constructor (needs a current GL context)
+    ProgramBuilder();
+
+    // Start building a program, returns its id straight away
+    unsigned int submit(const char* vertexPath, const char* fragmentPath, const std::string& defines = "");
+
+    // Finish the programs the driver has built, without waiting
+    void poll();
+
+    // Wait for every program
+    void finish();
+
+    // Has a program finished building (successfully or not)
+    bool ready(unsigned int programID) const;
+
+    // Has a program finished building and linked (never for 0, and a failed program counts again once something relinks it)
+    bool linked(unsigned int programID);
+
+    // Programs still building
+    unsigned int pendingCount() const;
+
+private:
+    struct Pending
+    {
+        unsigned int program;
+        unsigned int vertexShader, fragmentShader;
+    };
+
+    std::vector<Pending> pending;
+
+    // Finished programs that did not link
+    std::set<unsigned int> failed;
+
+    // Print any errors and note a failed link, then detach and delete the shaders
+    void complete(const Pending& build);
+
+    // Print a shader's or program's info log
+    static void printLog(unsigned int id, bool program);
+};
@@ -0,0 +1,510 @@
+#include <algorithm>
+
+#include <common/renderer.hpp>
+#include <common/glstate.hpp>
+#include <common/gpuculling.hpp>
+#include <common/clusters.hpp>
+#include <common/shadervariants.hpp>
+#include <common/shadows.hpp>
+
+Renderer::Renderer()
+{
+    // Multi-draw indirect needs base instance support to index the per-draw data
+    multiDrawIndirect = GLEW_VERSION_4_3 || (GLState::extensionSupported("GL_ARB_multi_draw_indirect") &&
+        GLState::extensionSupported("GL_ARB_base_instance"));
+
+    // Per-object transforms and per-material properties are read through texture buffers
+    glGenBuffers(1, &transformBuffer);
+    upload(GL_TEXTURE_BUFFER, transformBuffer, sizeof(glm::mat4), NULL);
+    glGenTextures(1, &transformTexture);
+    GLState::bindTexture(transformUnit, GL_TEXTURE_BUFFER, transformTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, transformBuffer);
+
+    glGenBuffers(1, &normalMatrixBuffer);
+    upload(GL_TEXTURE_BUFFER, normalMatrixBuffer, 3 * sizeof(glm::vec4), NULL);
+    glGenTextures(1, &normalMatrixTexture);
+    GLState::bindTexture(normalMatrixUnit, GL_TEXTURE_BUFFER, normalMatrixTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, normalMatrixBuffer);
+
+    glGenBuffers(1, &materialBuffer);
+    upload(GL_TEXTURE_BUFFER, materialBuffer, sizeof(glm::vec4), NULL);
+    glGenTextures(1, &materialTexture);
+    GLState::bindTexture(materialUnit, GL_TEXTURE_BUFFER, materialTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, materialBuffer);
+
+    // Per-draw data is an instanced vertex attribute, selected by each command's base instance
+    glGenBuffers(1, &drawDataBuffer);
+    upload(GL_ARRAY_BUFFER, drawDataBuffer, sizeof(DrawData), NULL);
+    GeometryBuffer::bind(0);
+    if (multiDrawIndirect)
+    {
+        GLState::bindBuffer(GL_ARRAY_BUFFER, drawDataBuffer);
+        glEnableVertexAttribArray(5);
+        glVertexAttribIPointer(5, 4, GL_UNSIGNED_INT, sizeof(DrawData), (void*)0);
+        glVertexAttribDivisor(5, 1);
+    }
+
+    glGenBuffers(1, &indirectBuffer);
+    glGenBuffers(1, &depthIndirectBuffer);
+
+    glGenQueries(overdrawQueryCount, overdrawQueries);
+    for (unsigned int i = 0; i < overdrawQueryCount; i++)
+    {
+        overdrawPending[i] = false;
+        overdrawSamples[i] = 0.0f;
+    }
+
+    // Flat normal and neutral specular maps for models without them
+    defaultNormalMap = Model::loadTexture("../assets/neutral_normal.png");
+    defaultSpecularMap = Model::loadTexture("../assets/neutral_specular.png");
+}
+
+void Renderer::submit(Model& model, const glm::mat4& transform)
+{
+    submit(model, model.meshID, transform);
+}
+
+void Renderer::submit(Model& model, unsigned int meshID, const glm::mat4& transform)
+{
+    // Give each model a material slot the first time it is drawn
+    if (materialIndex.find(&model) == materialIndex.end())
+    {
+        materialIndex[&model] = static_cast<unsigned int>(materials.size());
+        materials.push_back(glm::vec4(model.ka, model.kd, model.ks, model.Ns));
+        materialsChanged = true;
+    }
+
+    drawModels.push_back(&model);
+    drawMeshes.push_back(meshID);
+    transforms.push_back(transform);
+}
+
+std::vector<Renderer::Batch> Renderer::buildBatches()
+{
+    std::vector<Batch> batches;
+    std::map<std::vector<unsigned int>, unsigned int> batchIndex;
+    for (unsigned int i = 0; i < drawModels.size(); i++)
+    {
+        if (!visible[i])
+            continue;
+
+        // Models in the same geometry block with the same textures can share a multi-draw
+        unsigned int block = GeometryBuffer::mesh(drawMeshes[i]).block;
+        std::vector<unsigned int> key(1, block);
+        for (unsigned int j = 0; j < drawModels[i]->textures.size(); j++)
+            key.push_back(drawModels[i]->textures[j].id);
+
+        std::map<std::vector<unsigned int>, unsigned int>::iterator it = batchIndex.find(key);
+        if (it == batchIndex.end())
+        {
+            it = batchIndex.insert(std::make_pair(key, static_cast<unsigned int>(batches.size()))).first;
+            Batch batch;
+            batch.block = block;
+            batch.model = drawModels[i];
+            batches.push_back(batch);
+        }
+        batches[it->second].draws.push_back(i);
+    }
+    return batches;
+}
+
+void Renderer::bindTextures(const Model& model)
+{
+    unsigned int diffuseMap = 0;
+    unsigned int normalMap = defaultNormalMap;
+    unsigned int specularMap = defaultSpecularMap;
+    for (unsigned int i = 0; i < model.textures.size(); i++)
+    {
+        if (model.textures[i].type == "diffuse")
+            diffuseMap = model.textures[i].id;
+        else if (model.textures[i].type == "normal")
+            normalMap = model.textures[i].id;
+        else if (model.textures[i].type == "specular")
+            specularMap = model.textures[i].id;
+    }
+
+    GLState::bindTexture(diffuseUnit, GL_TEXTURE_2D, diffuseMap);
+    GLState::bindTexture(normalUnit, GL_TEXTURE_2D, normalMap);
+    GLState::bindTexture(specularUnit, GL_TEXTURE_2D, specularMap);
+}
+
+void Renderer::useProgram(unsigned int shaderID, const glm::mat4& view, const glm::mat4& projection)
+{
+    GLState::useProgram(shaderID);
+    glUniformMatrix4fv(glGetUniformLocation(shaderID, "V"), 1, GL_FALSE, &view[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(shaderID, "P"), 1, GL_FALSE, &projection[0][0]);
+    glUniform1i(glGetUniformLocation(shaderID, "diffuseMap"), diffuseUnit);
+    glUniform1i(glGetUniformLocation(shaderID, "normalMap"), normalUnit);
+    glUniform1i(glGetUniformLocation(shaderID, "specularMap"), specularUnit);
+    glUniform1i(glGetUniformLocation(shaderID, "transformBuffer"), transformUnit);
+    glUniform1i(glGetUniformLocation(shaderID, "materialBuffer"), materialUnit);
+    glUniform1i(glGetUniformLocation(shaderID, "normalMatrixBuffer"), normalMatrixUnit);
+    if (lights != NULL)
+        lights->toShader(shaderID);
+    if (shadows != NULL)
+        shadows->toShader(shaderID);
+}
+
+void Renderer::draw(unsigned int shaderID, const glm::mat4& view, const glm::mat4& projection)
+{
+    objectCount = static_cast<unsigned int>(drawModels.size());
+    culledCount = 0;
+    drawCalls = 0;
+    if (drawModels.empty())
+        return;
+
+    // Cull the objects' world-space boxes against the view frustum, unless the GPU does it
+    if (gpuCulling != NULL)
+        visible.assign(objectCount, 1);
+    else
+        culledCount = cull(projection * view);
+    if (culledCount == objectCount)
+    {
+        clearDraws();
+        return;
+    }
+
+    // Upload materials when new models have been added
+    if (materialsChanged)
+    {
+        upload(GL_TEXTURE_BUFFER, materialBuffer, materials.size() * sizeof(glm::vec4), &materials[0]);
+        materialsChanged = false;
+    }
+
+    // Upload this frame's transforms
+    upload(GL_TEXTURE_BUFFER, transformBuffer, transforms.size() * sizeof(glm::mat4), &transforms[0]);
+
+    // Work out the normal matrices once per object rather than once per vertex
+    normalMatrices.resize(3 * transforms.size());
+    for (unsigned int i = 0; i < transforms.size(); i++)
+    {
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(transforms[i])));
+        normalMatrices[3 * i] = glm::vec4(normalMatrix[0], 0.0f);
+        normalMatrices[3 * i + 1] = glm::vec4(normalMatrix[1], 0.0f);
+        normalMatrices[3 * i + 2] = glm::vec4(normalMatrix[2], 0.0f);
+    }
+    upload(GL_TEXTURE_BUFFER, normalMatrixBuffer, normalMatrices.size() * sizeof(glm::vec4), &normalMatrices[0]);
+
+    // Build the per-draw data and indirect commands in batch order
+    std::vector<Batch> batches = buildBatches();
+    std::vector<DrawData> drawData;
+    std::vector<DrawCommand> commands;
+    std::vector<CullInput> cullInputs;
+    bool objectLights = lights != NULL && lights->maxObjectLights > 0;
+    if (objectLights)
+        lights->beginObjectLights();
+    buildDraws(batches, objectLights, drawData, commands, gpuCulling != NULL ? &cullInputs : NULL);
+    if (objectLights)
+        lights->uploadObjectLights();
+    if (multiDrawIndirect)
+    {
+        upload(GL_ARRAY_BUFFER, drawDataBuffer, drawData.size() * sizeof(DrawData), &drawData[0]);
+        if (gpuCulling == NULL)
+            upload(GL_DRAW_INDIRECT_BUFFER, indirectBuffer, commands.size() * sizeof(DrawCommand), &commands[0]);
+    }
+
+    // The compute shader writes the visible commands into its own indirect buffer
+    if (gpuCulling != NULL)
+    {
+        GLState::bindTexture(transformUnit, GL_TEXTURE_BUFFER, transformTexture);
+        gpuCulling->cull(commands, cullInputs, static_cast<unsigned int>(batches.size()), projection * view, transforms);
+    }
+
+    GLState::bindTexture(transformUnit, GL_TEXTURE_BUFFER, transformTexture);
+    GLState::bindTexture(normalMatrixUnit, GL_TEXTURE_BUFFER, normalMatrixTexture);
+    GLState::bindTexture(materialUnit, GL_TEXTURE_BUFFER, materialTexture);
+
+    // Write the depth first, then only shade the fragments that match it
+    bool prepass = depthPrepass && depthShaderID != 0;
+    if (prepass)
+    {
+        drawCalls += drawDepth(batches, drawData, commands, view, projection, gpuCulling != NULL);
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
+    }
+    beginOverdrawQuery();
+
+    // Draw each batch, setting up its program the first time it is used this frame
+    std::vector<unsigned int> programsUsed;
+    unsigned int first = 0;
+    for (unsigned int i = 0; i < batches.size(); i++)
+    {
+        unsigned int programID = variants != NULL ? variants->program(*batches[i].model) : shaderID;
+        if (std::find(programsUsed.begin(), programsUsed.end(), programID) == programsUsed.end())
+        {
+            useProgram(programID, view, projection);
+            programsUsed.push_back(programID);
+        }
+        else
+            GLState::useProgram(programID);
+
+        unsigned int count = static_cast<unsigned int>(batches[i].draws.size());
+        GeometryBuffer::bind(batches[i].block);
+        bindTextures(*batches[i].model);
+
+        if (gpuCulling != NULL)
+        {
+            gpuCulling->draw(i, first, count);
+            drawCalls++;
+        }
+        else if (multiDrawIndirect)
+        {
+            GLState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                (void*)(first * sizeof(DrawCommand)), count, 0);
+            drawCalls++;
+        }
+        else
+        {
+            // Without base instance the per-draw data is set as a constant attribute
+            for (unsigned int j = first; j < first + count; j++)
+            {
+                glVertexAttribI4ui(5, drawData[j].transformIndex, drawData[j].materialIndex,
+                    drawData[j].lightOffset, drawData[j].lightCount);
+                glDrawElementsBaseVertex(GL_TRIANGLES, commands[j].count, GL_UNSIGNED_INT,
+                    (void*)(commands[j].firstIndex * sizeof(unsigned int)), commands[j].baseVertex);
+                drawCalls++;
+            }
+        }
+        first += count;
+    }
+
+    endOverdrawQuery();
+    if (prepass)
+    {
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+    }
+
+    // Start the next frame's draw list
+    clearDraws();
+}
+
+void Renderer::drawDepthOnly(const glm::mat4& view, const glm::mat4& projection)
+{
+    depthObjectCount = 0;
+    if (drawModels.empty() || depthShaderID == 0 || cull(projection * view) == drawModels.size())
+    {
+        clearDraws();
+        return;
+    }
+
+    upload(GL_TEXTURE_BUFFER, transformBuffer, transforms.size() * sizeof(glm::mat4), &transforms[0]);
+    std::vector<Batch> batches = buildBatches();
+    std::vector<DrawData> drawData;
+    std::vector<DrawCommand> commands;
+    buildDraws(batches, false, drawData, commands, NULL);
+    depthObjectCount = static_cast<unsigned int>(commands.size());
+    if (multiDrawIndirect)
+        upload(GL_ARRAY_BUFFER, drawDataBuffer, drawData.size() * sizeof(DrawData), &drawData[0]);
+
+    GLState::bindTexture(transformUnit, GL_TEXTURE_BUFFER, transformTexture);
+    drawDepth(batches, drawData, commands, view, projection, false);
+    clearDraws();
+}
+
+unsigned int Renderer::cull(const glm::mat4& viewProjection)
+{
+    bounds.clear();
+    for (unsigned int i = 0; i < drawModels.size(); i++)
+        bounds.add(GeometryBuffer::mesh(drawMeshes[i]).bounds.transform(transforms[i]));
+    Frustum frustum(viewProjection);
+    return static_cast<unsigned int>(drawModels.size()) - frustum.cull(bounds, visible);
+}
+
+void Renderer::buildDraws(const std::vector<Batch>& batches, bool objectLights, std::vector<DrawData>& drawData,
+    std::vector<DrawCommand>& commands, std::vector<CullInput>* cullInputs)
+{
+    for (unsigned int i = 0; i < batches.size(); i++)
+    {
+        unsigned int batchFirst = static_cast<unsigned int>(commands.size());
+        for (unsigned int j = 0; j < batches[i].draws.size(); j++)
+        {
+            unsigned int index = batches[i].draws[j];
+            const Mesh& mesh = GeometryBuffer::mesh(drawMeshes[index]);
+
+            DrawData data;
+            data.transformIndex = index;
+            data.materialIndex = materialIndex[drawModels[index]];
+            data.lightOffset = 0;
+            data.lightCount = 0;
+            if (objectLights)
+            {
+                glm::uvec2 list = lights->objectLights(mesh.bounds.transform(transforms[index]));
+                data.lightOffset = list.x;
+                data.lightCount = list.y;
+            }
+
+            DrawCommand command;
+            command.count = mesh.indexCount;
+            command.instanceCount = 1;
+            command.firstIndex = mesh.firstIndex;
+            command.baseVertex = mesh.baseVertex;
+            command.baseInstance = static_cast<unsigned int>(drawData.size());
+
+            drawData.push_back(data);
+            commands.push_back(command);
+
+            if (cullInputs != NULL)
+            {
+                CullInput input;
+                input.centre = glm::vec4(mesh.bounds.centre(), 1.0f);
+                input.extent = glm::vec4(mesh.bounds.extent(), 0.0f);
+                input.transformIndex = index;
+                input.batch = i;
+                input.batchFirst = batchFirst;
+                input.padding = 0;
+                cullInputs->push_back(input);
+            }
+        }
+    }
+}
+
+void Renderer::clearDraws()
+{
+    drawModels.clear();
+    drawMeshes.clear();
+    transforms.clear();
+}
+
+unsigned int Renderer::drawDepth(const std::vector<Batch>& batches, const std::vector<DrawData>& drawData,
+    const std::vector<DrawCommand>& commands, const glm::mat4& view, const glm::mat4& projection, bool gpuCulled)
+{
+    GLState::useProgram(depthShaderID);
+    glUniformMatrix4fv(glGetUniformLocation(depthShaderID, "V"), 1, GL_FALSE, &view[0][0]);
+    glUniformMatrix4fv(glGetUniformLocation(depthShaderID, "P"), 1, GL_FALSE, &projection[0][0]);
+    glUniform1i(glGetUniformLocation(depthShaderID, "transformBuffer"), transformUnit);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    unsigned int calls = 0;
+
+    // The GPU-culled commands never come back to the CPU, so they are drawn in batch order
+    if (gpuCulled)
+    {
+        unsigned int first = 0;
+        for (unsigned int i = 0; i < batches.size(); i++)
+        {
+            unsigned int count = static_cast<unsigned int>(batches[i].draws.size());
+            GeometryBuffer::bind(batches[i].block);
+            gpuCulling->draw(i, first, count);
+            calls++;
+            first += count;
+        }
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        return calls;
+    }
+
+    // Sort the commands by the distance from the camera to their boxes, ignoring texture sets
+    glm::vec3 eye = glm::vec3(glm::inverse(view)[3]);
+    std::vector<std::pair<float, unsigned int> > order;
+    std::vector<unsigned int> blocks;
+    for (unsigned int i = 0; i < batches.size(); i++)
+    {
+        for (unsigned int j = 0; j < batches[i].draws.size(); j++)
+        {
+            unsigned int index = batches[i].draws[j];
+            glm::vec3 centre(bounds.centreX[index], bounds.centreY[index], bounds.centreZ[index]);
+            order.push_back(std::make_pair(glm::length(centre - eye), static_cast<unsigned int>(blocks.size())));
+            blocks.push_back(batches[i].block);
+        }
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<DrawCommand> depthCommands(order.size());
+    for (unsigned int i = 0; i < order.size(); i++)
+        depthCommands[i] = commands[order[i].second];
+    if (multiDrawIndirect)
+        upload(GL_DRAW_INDIRECT_BUFFER, depthIndirectBuffer, depthCommands.size() * sizeof(DrawCommand), &depthCommands[0]);
+
+    // One multi-draw for each run of commands in the same geometry block
+    for (unsigned int first = 0; first < order.size();)
+    {
+        unsigned int block = blocks[order[first].second];
+        unsigned int count = 1;
+        while (first + count < order.size() && blocks[order[first + count].second] == block)
+            count++;
+        GeometryBuffer::bind(block);
+
+        if (multiDrawIndirect)
+        {
+            GLState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, depthIndirectBuffer);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                (void*)(first * sizeof(DrawCommand)), count, 0);
+            calls++;
+        }
+        else
+        {
+            for (unsigned int j = first; j < first + count; j++)
+            {
+                const DrawData& data = drawData[order[j].second];
+                glVertexAttribI4ui(5, data.transformIndex, data.materialIndex, data.lightOffset, data.lightCount);
+                glDrawElementsBaseVertex(GL_TRIANGLES, depthCommands[j].count, GL_UNSIGNED_INT,
+                    (void*)(depthCommands[j].firstIndex * sizeof(unsigned int)), depthCommands[j].baseVertex);
+                calls++;
+            }
+        }
+        first += count;
+    }
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    return calls;
+}
+
+void Renderer::beginOverdrawQuery()
+{
+    // Pick up the counts the GPU has finished without waiting for the others
+    for (unsigned int i = 0; i < overdrawQueryCount; i++)
+    {
+        if (!overdrawPending[i])
+            continue;
+        unsigned int available = 0;
+        glGetQueryObjectuiv(overdrawQueries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available)
+        {
+            unsigned int samplesPassed = 0;
+            glGetQueryObjectuiv(overdrawQueries[i], GL_QUERY_RESULT, &samplesPassed);
+            overdraw = samplesPassed / overdrawSamples[i];
+            overdrawPending[i] = false;
+        }
+    }
+
+    // Skip counting this frame if the next query is still in flight
+    overdrawCounting = !overdrawPending[overdrawQuery];
+    if (!overdrawCounting)
+        return;
+
+    // Samples in the framebuffer being drawn to (the G-buffer is not multisampled)
+    GLint viewport[4], samples = 0;
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetIntegerv(GL_SAMPLES, &samples);
+    overdrawSamples[overdrawQuery] = static_cast<float>(viewport[2]) * viewport[3] * std::max(samples, 1);
+    glBeginQuery(GL_SAMPLES_PASSED, overdrawQueries[overdrawQuery]);
+    overdrawPending[overdrawQuery] = true;
+}
+
+void Renderer::endOverdrawQuery()
+{
+    if (!overdrawCounting)
+        return;
+    glEndQuery(GL_SAMPLES_PASSED);
+    overdrawQuery = (overdrawQuery + 1) % overdrawQueryCount;
+}
+
+void Renderer::upload(GLenum target, unsigned int buffer, size_t bytes, const void* data)
+{
+    GLState::bindBuffer(target, buffer);
+    glBufferData(target, bytes, data, GL_STREAM_DRAW);
+}
+
+void Renderer::deleteBuffers()
+{
+    glDeleteBuffers(1, &transformBuffer);
+    glDeleteBuffers(1, &normalMatrixBuffer);
+    glDeleteBuffers(1, &materialBuffer);
+    glDeleteBuffers(1, &drawDataBuffer);
+    glDeleteBuffers(1, &indirectBuffer);
+    glDeleteBuffers(1, &depthIndirectBuffer);
+    glDeleteQueries(overdrawQueryCount, overdrawQueries);
+    glDeleteTextures(1, &transformTexture);
+    glDeleteTextures(1, &normalMatrixTexture);
+    glDeleteTextures(1, &materialTexture);
+    GLState::invalidate();
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <vector>
+#include <map>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <common/model.hpp>
+#include <common/bounds.hpp>
+
+// Layout of glMultiDrawElementsIndirect commands
+struct DrawCommand
+{
+    unsigned int count;
+    unsigned int instanceCount;
+    unsigned int firstIndex;
+    int baseVertex;
+    unsigned int baseInstance;
+};
+
+// Per-draw data read by the vertex shader
+struct DrawData
+{
+    unsigned int transformIndex;
+    unsigned int materialIndex;
+    unsigned int lightOffset;
+    unsigned int lightCount;
+};
+
+// Texture units used by the renderer
+enum TextureUnit
+{
+    diffuseUnit = 0,
+    normalUnit = 1,
+    specularUnit = 2,
+    transformUnit = 3,
+    materialUnit = 4,
+    hiZUnit = 5,
+    lightUnit = 6,
+    clusterUnit = 7,
+    lightIndexUnit = 8,
+    depthUnit = 9,
+    objectLightUnit = 10,
+    normalMatrixUnit = 11,
+    shadowUnit = 12,
+    pointShadowUnit = 13,
+    gizmoUnit = 14
+};
+
+class GPUCulling;
+struct CullInput;
+class ClusteredLights;
+class ShaderVariants;
+class ShadowMaps;
+
+// Collects the objects drawn each frame and submits them with one
+// glMultiDrawElementsIndirect per texture set. Without GL 4.3 the same draw
+// list is walked with glDrawElementsBaseVertex instead. With the depth
+// pre-pass on, the objects are first drawn front to back with a
+// position-only program and colour writes off, then the lighting pass
+// tests GL_EQUAL against that depth, so each pixel is shaded once.
+class Renderer
+{
+public:
+    // Use glMultiDrawElementsIndirect (GL 4.3 or ARB_multi_draw_indirect)
+    bool multiDrawIndirect;
+
+    // Cull on the GPU instead of the CPU when set (needs GL 4.3)
+    GPUCulling* gpuCulling = NULL;
+
+    // Lights sent to each program drawn with, which also give each draw its
+    // own light list when they keep per-object lists
+    ClusteredLights* lights = NULL;
+
+    // Draw each texture set with the program specialised for it instead of the one passed to draw
+    ShaderVariants* variants = NULL;
+
+    // Shadow maps sent to each program drawn with
+    ShadowMaps* shadows = NULL;
+
+    // Lay down the depth with this position-only program before shading when set
+    bool depthPrepass = false;
+    unsigned int depthShaderID = 0;
+
+    // Stats for the last frame
+    unsigned int objectCount = 0;
+    unsigned int culledCount = 0;
+    unsigned int drawCalls = 0;
+
+    // Samples that passed the depth test in the shading pass per sample on screen, as last read
+    // back (the GPU's results are picked up a few frames late rather than waited for)
+    float overdraw = 0.0f;
+
+    // Objects drawn by the last drawDepthOnly call
+    unsigned int depthObjectCount = 0;
+
+    // Constructor (needs a current GL context)
+    Renderer();
+
+    // Add an object to this frame's draw list
+    void submit(Model& model, const glm::mat4& transform);
+
+    // Add a different mesh drawn with a model's material
+    void submit(Model& model, unsigned int meshID, const glm::mat4& transform);
+
+    // Draw everything submitted since the last call that is inside the view frustum
+    void draw(unsigned int shaderID, const glm::mat4& view, const glm::mat4& projection);
+
+    // Draw everything submitted since the last call into the depth buffer only, with the depth
+    // program (for shadow maps, so it is culled on the CPU and leaves the stats above alone)
+    void drawDepthOnly(const glm::mat4& view, const glm::mat4& projection);
+
+    // Cleanup
+    void deleteBuffers();
+
+private:
+    // Objects sharing a geometry block and texture set
+    struct Batch
+    {
+        unsigned int block;
+        Model* model;
+        std::vector<unsigned int> draws;
+    };
+
+    // Submitted objects
+    std::vector<Model*> drawModels;
+    std::vector<unsigned int> drawMeshes;
+    std::vector<glm::mat4> transforms;
+
+    // Inverse transpose of each transform's upper 3x3, as three texels
+    std::vector<glm::vec4> normalMatrices;
+
+    // World-space bounds of the submitted objects and the result of culling them
+    BoxList bounds;
+    std::vector<unsigned char> visible;
+
+    // Materials (ka, kd, ks, Ns) indexed by model
+    std::map<Model*, unsigned int> materialIndex;
+    std::vector<glm::vec4> materials;
+    bool materialsChanged = false;
+
+    // Textures used when a model does not have a map of that type
+    unsigned int defaultNormalMap;
+    unsigned int defaultSpecularMap;
+
+    // Buffers
+    unsigned int transformBuffer, transformTexture;
+    unsigned int normalMatrixBuffer, normalMatrixTexture;
+    unsigned int materialBuffer, materialTexture;
+    unsigned int drawDataBuffer;
+    unsigned int indirectBuffer;
+    unsigned int depthIndirectBuffer;
+
+    // Ring of GL_SAMPLES_PASSED queries around the shading pass, with the samples on screen for each
+    static const unsigned int overdrawQueryCount = 3;
+    unsigned int overdrawQueries[overdrawQueryCount];
+    bool overdrawPending[overdrawQueryCount];
+    float overdrawSamples[overdrawQueryCount];
+    unsigned int overdrawQuery = 0;
+    bool overdrawCounting = false;
+
+    // Cull the submitted objects' world-space boxes into visible, returns the number culled
+    unsigned int cull(const glm::mat4& viewProjection);
+
+    // Group the visible objects into batches
+    std::vector<Batch> buildBatches();
+
+    // Build the per-draw data and indirect commands in batch order (and the GPU culling inputs if given)
+    void buildDraws(const std::vector<Batch>& batches, bool objectLights, std::vector<DrawData>& drawData,
+        std::vector<DrawCommand>& commands, std::vector<CullInput>* cullInputs);
+
+    // Start the next draw list
+    void clearDraws();
+
+    // Bind a model's textures to the fixed texture units
+    void bindTextures(const Model& model);
+
+    // Bind a program and send it the view, projection, texture units, lights and shadows
+    void useProgram(unsigned int shaderID, const glm::mat4& view, const glm::mat4& projection);
+
+    // Draw the batches' depth only, front to back unless the GPU culled the commands, returns the draw calls made
+    unsigned int drawDepth(const std::vector<Batch>& batches, const std::vector<DrawData>& drawData,
+        const std::vector<DrawCommand>& commands, const glm::mat4& view, const glm::mat4& projection, bool gpuCulled);
+
+    // Count the samples the shading pass writes, picking up finished counts first
+    void beginOverdrawQuery();
+    void endOverdrawQuery();
+
+    // Upload data to a buffer, orphaning the old storage
+    void upload(GLenum target, unsigned int buffer, size_t bytes, const void* data);
+};
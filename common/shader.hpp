@@ -6,9 +6,31 @@
 #include <vector>
 #include <fstream>
 #include <sstream>
+#include <string>
 
-unsigned int LoadShaders(const char* vertex_file_path,
-    const char* fragment_file_path)
+#include <common/shadersources.hpp>
+
+// Read a shader file with its #includes expanded, returns false if it cannot be opened
+inline bool ReadShaderCode(const char* file_path, std::string& ShaderCode)
+{
+    return ShaderSources::load(file_path, ShaderCode);
+}
+
+// Insert a block of #defines after a shader's #version line
+inline std::string InsertDefines(const std::string& ShaderCode, const std::string& Defines)
+{
+    if (Defines.empty())
+        return ShaderCode;
+    size_t Version = ShaderCode.find("#version");
+    size_t LineEnd = Version == std::string::npos ? std::string::npos : ShaderCode.find('\n', Version);
+    if (LineEnd == std::string::npos)
+        return Defines + ShaderCode;
+    return ShaderCode.substr(0, LineEnd + 1) + Defines + ShaderCode.substr(LineEnd + 1);
+}
+
+// Compile and link a vertex and fragment shader, optionally specialised with #defines
+inline unsigned int LoadShaders(const char* vertex_file_path,
+    const char* fragment_file_path, const std::string& Defines = "")
 {
 
     // Create the shaders
@@ -17,35 +39,22 @@ unsigned int LoadShaders(const char* vertex_file_path,
 
     // Read the Vertex Shader code from the file
     std::string VertexShaderCode;
-    std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-    if (VertexShaderStream.is_open()) {
-        std::stringstream sstr;
-        sstr << VertexShaderStream.rdbuf();
-        VertexShaderCode = sstr.str();
-        VertexShaderStream.close();
-    }
-    else
+    if (!ReadShaderCode(vertex_file_path, VertexShaderCode))
     {
-        printf("Impossible to open %s. Are you in the right directory?\n",
-            vertex_file_path);
         getchar();
         return 0;
     }
 
     // Read the Fragment Shader code from the file
     std::string FragmentShaderCode;
-    std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-    if (FragmentShaderStream.is_open())
-    {
-        std::stringstream sstr;
-        sstr << FragmentShaderStream.rdbuf();
-        FragmentShaderCode = sstr.str();
-        FragmentShaderStream.close();
-    }
+    ReadShaderCode(fragment_file_path, FragmentShaderCode);
 
     GLint Result = GL_FALSE;
     int InfoLogLength;
 
+    VertexShaderCode = InsertDefines(VertexShaderCode, Defines);
+    FragmentShaderCode = InsertDefines(FragmentShaderCode, Defines);
+
     // Compile Vertex Shader
     printf("Compiling shader : %s\n", vertex_file_path);
     char const* VertexSourcePointer = VertexShaderCode.c_str();
@@ -80,9 +89,11 @@ unsigned int LoadShaders(const char* vertex_file_path,
         printf("%s\n", &FragmentShaderErrorMessage[0]);
     }
 
-    // Link the program
+    // Link the program, letting the shader cache read back its binary
     printf("Linking program\n");
     unsigned int ProgramID = glCreateProgram();
+    if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+        glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glAttachShader(ProgramID, VertexShaderID);
     glAttachShader(ProgramID, FragmentShaderID);
     glLinkProgram(ProgramID);
@@ -106,3 +117,58 @@ unsigned int LoadShaders(const char* vertex_file_path,
 
     return ProgramID;
 }
+
+inline unsigned int LoadComputeShader(const char* compute_file_path)
+{
+    // Create the shader
+    unsigned int ComputeShaderID = glCreateShader(GL_COMPUTE_SHADER);
+
+    // Read the Compute Shader code from the file
+    std::string ComputeShaderCode;
+    if (!ReadShaderCode(compute_file_path, ComputeShaderCode))
+        return 0;
+
+    GLint Result = GL_FALSE;
+    int InfoLogLength;
+
+    // Compile Compute Shader
+    printf("Compiling shader : %s\n", compute_file_path);
+    char const* ComputeSourcePointer = ComputeShaderCode.c_str();
+    glShaderSource(ComputeShaderID, 1, &ComputeSourcePointer, NULL);
+    glCompileShader(ComputeShaderID);
+
+    // Check Compute Shader
+    glGetShaderiv(ComputeShaderID, GL_COMPILE_STATUS, &Result);
+    glGetShaderiv(ComputeShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+    if (InfoLogLength > 0)
+    {
+        std::vector<char> ComputeShaderErrorMessage(InfoLogLength + 1);
+        glGetShaderInfoLog(ComputeShaderID, InfoLogLength, NULL,
+            &ComputeShaderErrorMessage[0]);
+        printf("%s\n", &ComputeShaderErrorMessage[0]);
+    }
+
+    // Link the program, letting the shader cache read back its binary
+    printf("Linking program\n");
+    unsigned int ProgramID = glCreateProgram();
+    if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+        glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glAttachShader(ProgramID, ComputeShaderID);
+    glLinkProgram(ProgramID);
+
+    // Check the program
+    glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+    glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+    if (InfoLogLength > 0)
+    {
+        std::vector<char> ProgramErrorMessage(InfoLogLength + 1);
+        glGetProgramInfoLog(ProgramID, InfoLogLength, NULL,
+            &ProgramErrorMessage[0]);
+        printf("%s\n", &ProgramErrorMessage[0]);
+    }
+
+    glDetachShader(ProgramID, ComputeShaderID);
+    glDeleteShader(ComputeShaderID);
+
+    return ProgramID;
+}
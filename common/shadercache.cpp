@@ -0,0 +1,225 @@
+#include <cstdio>
+#include <fstream>
+
+#include <common/shadercache.hpp>
+#include <common/shader.hpp>
+
+// Cache file header
+static const char cacheMagic[4] = { 'G', 'L', 'P', 'B' };
+
+ShaderCache::ShaderCache(const char* path)
+    : path(path)
+{
+    GLint formats = 0;
+    if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    supported = formats > 0;
+    if (!supported)
+        return;
+
+    // Binaries only load on the driver that made them
+    driver = std::string(reinterpret_cast<const char*>(glGetString(GL_VENDOR))) + "\n" +
+        reinterpret_cast<const char*>(glGetString(GL_RENDERER)) + "\n" +
+        reinterpret_cast<const char*>(glGetString(GL_VERSION));
+
+    // Entries are a key, format and length followed by the binary
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    std::streamoff size = file.tellg();
+    file.seekg(0);
+    char magic[4];
+    unsigned int count = 0;
+    if (!file.read(magic, sizeof(magic)) || std::string(magic, 4) != std::string(cacheMagic, 4) ||
+        !file.read(reinterpret_cast<char*>(&count), sizeof(count)))
+        return;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        // A truncated or corrupt file drops the whole cache, and the programs are compiled again
+        unsigned long long entryKey;
+        unsigned int format, length;
+        if (!file.read(reinterpret_cast<char*>(&entryKey), sizeof(entryKey)) ||
+            !file.read(reinterpret_cast<char*>(&format), sizeof(format)) ||
+            !file.read(reinterpret_cast<char*>(&length), sizeof(length)) ||
+            length > size - static_cast<std::streamoff>(file.tellg()))
+        {
+            printf("Shader cache %s is corrupt, compiling the programs again\n", path);
+            entries.clear();
+            saved.clear();
+            changed = true;
+            return;
+        }
+        Entry entry;
+        entry.format = format;
+        entry.binary.resize(length);
+        if (length > 0)
+            file.read(&entry.binary[0], length);
+        entries[entryKey] = entry;
+        saved.insert(entryKey);
+    }
+}
+
+unsigned int ShaderCache::load(const char* vertexPath, const char* fragmentPath, const std::string& defines)
+{
+    unsigned long long programKey = key(readFile(vertexPath) + '\0' + readFile(fragmentPath) + '\0' + defines);
+    unsigned int programID = find(programKey);
+    if (programID != 0)
+        return programID;
+
+    misses++;
+    if (builder != NULL)
+    {
+        programID = builder->submit(vertexPath, fragmentPath, defines);
+        building.push_back(std::make_pair(programKey, programID));
+        return programID;
+    }
+    programID = LoadShaders(vertexPath, fragmentPath, defines);
+    store(programKey, programID);
+    return programID;
+}
+
+unsigned int ShaderCache::loadCompute(const char* computePath)
+{
+    unsigned long long programKey = key(readFile(computePath));
+    unsigned int programID = find(programKey);
+    if (programID != 0)
+        return programID;
+
+    misses++;
+    programID = LoadComputeShader(computePath);
+    store(programKey, programID);
+    return programID;
+}
+
+void ShaderCache::update()
+{
+    for (unsigned int i = 0; i < building.size();)
+    {
+        if (builder->ready(building[i].second))
+        {
+            store(building[i].first, building[i].second);
+            building.erase(building.begin() + i);
+        }
+        else
+            i++;
+    }
+}
+
+void ShaderCache::save()
+{
+    // Entries not used this run stay in memory, in case they are looked up later, but are left out of the file
+    bool unused = false;
+    for (std::set<unsigned long long>::const_iterator it = saved.begin(); it != saved.end() && !unused; ++it)
+        unused = used.count(*it) == 0;
+    if (!changed && !unused)
+        return;
+
+    // Write a temporary file and move it over the cache, so a crash while saving leaves the old cache whole
+    std::string tempPath = path + ".tmp";
+    std::ofstream file(tempPath.c_str(), std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+    {
+        printf("Could not write the shader cache %s\n", tempPath.c_str());
+        return;
+    }
+    std::set<unsigned long long> written;
+    for (std::map<unsigned long long, Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        if (used.count(it->first) > 0)
+            written.insert(it->first);
+    }
+    unsigned int count = static_cast<unsigned int>(written.size());
+    file.write(cacheMagic, sizeof(cacheMagic));
+    file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+    for (std::map<unsigned long long, Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+    {
+        if (written.count(it->first) == 0)
+            continue;
+        unsigned int format = it->second.format;
+        unsigned int length = static_cast<unsigned int>(it->second.binary.size());
+        file.write(reinterpret_cast<const char*>(&it->first), sizeof(it->first));
+        file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+        file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        file.write(it->second.binary.data(), length);
+    }
+    file.close();
+    if (file.fail())
+    {
+        printf("Could not write the shader cache %s\n", tempPath.c_str());
+        std::remove(tempPath.c_str());
+        return;
+    }
+
+    // Windows will not rename over an existing file, so remove the old cache first there
+    if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        std::remove(path.c_str());
+        if (std::rename(tempPath.c_str(), path.c_str()) != 0)
+        {
+            printf("Could not replace the shader cache %s\n", path.c_str());
+            std::remove(tempPath.c_str());
+            return;
+        }
+    }
+    saved.swap(written);
+    changed = false;
+}
+
+unsigned int ShaderCache::find(unsigned long long programKey)
+{
+    if (!supported)
+        return 0;
+    used.insert(programKey);
+    std::map<unsigned long long, Entry>::iterator it = entries.find(programKey);
+    if (it == entries.end())
+        return 0;
+
+    // An entry left out of the file by an earlier save goes back in
+    if (saved.count(programKey) == 0)
+        changed = true;
+
+    // The driver may still reject a binary, in which case the program is compiled again
+    unsigned int programID = glCreateProgram();
+    glProgramBinary(programID, it->second.format, it->second.binary.data(),
+        static_cast<GLsizei>(it->second.binary.size()));
+    GLint linked = GL_FALSE;
+    glGetProgramiv(programID, GL_LINK_STATUS, &linked);
+    if (linked != GL_TRUE)
+    {
+        glDeleteProgram(programID);
+        entries.erase(it);
+        changed = true;
+        return 0;
+    }
+    hits++;
+    return programID;
+}
+
+void ShaderCache::store(unsigned long long programKey, unsigned int programID)
+{
+    if (!supported || programID == 0)
+        return;
+
+    GLint linked = GL_FALSE, length = 0;
+    glGetProgramiv(programID, GL_LINK_STATUS, &linked);
+    glGetProgramiv(programID, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (linked != GL_TRUE || length <= 0)
+        return;
+
+    Entry entry;
+    entry.binary.resize(length);
+    glGetProgramBinary(programID, length, NULL, &entry.format, &entry.binary[0]);
+    entries[programKey] = entry;
+    used.insert(programKey);
+    changed = true;
+}
+
+unsigned long long ShaderCache::key(const std::string& sources) const
+{
+    return ShaderSources::hash(sources + '\0' + driver);
+}
+
+std::string ShaderCache::readFile(const char* path)
+{
+    std::string contents;
+    ReadShaderCode(path, contents);
+    return contents;
+}
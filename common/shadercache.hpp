@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <set>
+#include <string>
+
+#include <GL/glew.h>
+
+#include <common/programbuilder.hpp>
+
+// Linked programs saved with glGetProgramBinary and reloaded with
+// glProgramBinary on later runs. Each program is keyed by a hash of its
+// sources, its defines and the driver's vendor, renderer and version, so
+// editing a shader or changing driver quietly compiles it again, as does a
+// binary the driver refuses to load.
+class ShaderCache
+{
+public:
+    // Program binaries are available (GL 4.1 or ARB_get_program_binary with at least one format)
+    bool supported = false;
+
+    // Programs loaded from the cache and compiled this run
+    unsigned int hits = 0;
+    unsigned int misses = 0;
+
+    // Build the programs that are not cached with this without waiting for them when set
+    ProgramBuilder* builder = NULL;
+
+    // Constructor (needs a current GL context), reads the cache file if there is one
+    ShaderCache(const char* path);
+
+    // Load a vertex and fragment program, compiling it if it is not cached
+    unsigned int load(const char* vertexPath, const char* fragmentPath, const std::string& defines = "");
+
+    // Load a compute program in the same way
+    unsigned int loadCompute(const char* computePath);
+
+    // Keep the binaries of programs the builder has finished
+    void update();
+
+    // Write the cache file if programs have been added or some in it went unused, keeping only
+    // the programs looked up or built this run so binaries of old sources do not pile up
+    void save();
+
+private:
+    struct Entry
+    {
+        GLenum format;
+        std::vector<char> binary;
+    };
+
+    std::string path;
+    std::string driver;
+    std::map<unsigned long long, Entry> entries;
+    bool changed = false;
+
+    // Keys looked up or stored this run, and the keys in the file as last read or written
+    std::set<unsigned long long> used, saved;
+
+    // Programs the builder has not finished and their keys
+    std::vector<std::pair<unsigned long long, unsigned int> > building;
+
+    // Create a program from a cached binary, or return 0
+    unsigned int find(unsigned long long key);
+
+    // Keep a newly linked program's binary
+    void store(unsigned long long key, unsigned int programID);
+
+    // Key for a set of sources
+    unsigned long long key(const std::string& sources) const;
+
+    // Expanded source of a file, empty if it cannot be opened
+    static std::string readFile(const char* path);
+};
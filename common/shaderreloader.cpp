@@ -0,0 +1,121 @@
+#include <algorithm>
+
+#include <common/shaderreloader.hpp>
+#include <common/shadersources.hpp>
+
+#include <GLFW/glfw3.h>
+
+ShaderReloader::ShaderReloader(ShaderCache& shaderCache, ProgramBuilder& builder)
+    : shaderCache(shaderCache), builder(builder)
+{
+    GLint formats = 0;
+    if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    supported = formats > 0 && ShaderSources::watch();
+}
+
+void ShaderReloader::add(unsigned int programID, const char* vertexPath, const char* fragmentPath, const std::string& defines)
+{
+    if (!supported || programID == 0)
+        return;
+    Program program;
+    program.programID = programID;
+    program.vertexPath = vertexPath;
+    program.fragmentPath = fragmentPath;
+    program.defines = defines;
+    program.rebuildID = 0;
+    program.changeTime = 0.0;
+    program.stale = false;
+    programs.push_back(program);
+}
+
+void ShaderReloader::update()
+{
+    if (!supported)
+        return;
+
+    // Start a rebuild of every program using a changed file. A rebuild still going is left to finish
+    // (the builder and cache still refer to it) and marked to be thrown away and started again.
+    std::vector<std::string> changed = ShaderSources::changed();
+    for (unsigned int i = 0; i < changed.size(); i++)
+    {
+        printf("Shader changed : %s\n", changed[i].c_str());
+        for (unsigned int j = 0; j < programs.size(); j++)
+        {
+            Program& program = programs[j];
+            if (!uses(program, changed[i]))
+                continue;
+            program.changeTime = glfwGetTime();
+            if (program.rebuildID != 0 && !builder.ready(program.rebuildID))
+            {
+                program.stale = true;
+                continue;
+            }
+            if (program.rebuildID != 0)
+                glDeleteProgram(program.rebuildID);
+            rebuild(program);
+        }
+    }
+
+    // Swap in the rebuilt programs the builder has finished (and whose old program has finished too)
+    for (unsigned int i = 0; i < programs.size(); i++)
+    {
+        Program& program = programs[i];
+        if (program.rebuildID == 0 || !builder.ready(program.rebuildID) || !builder.ready(program.programID))
+            continue;
+        if (program.stale)
+        {
+            glDeleteProgram(program.rebuildID);
+            rebuild(program);
+            continue;
+        }
+        if (swap(program))
+        {
+            reloadCount++;
+            swapTime = static_cast<float>(1000.0 * (glfwGetTime() - program.changeTime));
+            printf("Reloaded program %u (%s, %s) in %.1f ms\n", program.programID,
+                program.vertexPath.c_str(), program.fragmentPath.c_str(), swapTime);
+        }
+        else
+        {
+            failedCount++;
+            printf("Keeping program %u (%s, %s), the new version did not link\n", program.programID,
+                program.vertexPath.c_str(), program.fragmentPath.c_str());
+        }
+        glDeleteProgram(program.rebuildID);
+        program.rebuildID = 0;
+    }
+}
+
+void ShaderReloader::rebuild(Program& program)
+{
+    program.stale = false;
+    program.rebuildID = shaderCache.load(program.vertexPath.c_str(), program.fragmentPath.c_str(), program.defines);
+    if (program.rebuildID == 0)
+        failedCount++;
+}
+
+bool ShaderReloader::uses(const Program& program, const std::string& file)
+{
+    std::vector<std::string> vertexFiles = ShaderSources::dependencies(program.vertexPath);
+    std::vector<std::string> fragmentFiles = ShaderSources::dependencies(program.fragmentPath);
+    return std::find(vertexFiles.begin(), vertexFiles.end(), file) != vertexFiles.end() ||
+        std::find(fragmentFiles.begin(), fragmentFiles.end(), file) != fragmentFiles.end();
+}
+
+bool ShaderReloader::swap(Program& program)
+{
+    GLint linked = GL_FALSE, length = 0;
+    glGetProgramiv(program.rebuildID, GL_LINK_STATUS, &linked);
+    glGetProgramiv(program.rebuildID, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (linked != GL_TRUE || length <= 0)
+        return false;
+
+    // Relinking the old id in place keeps every copy of it valid (uniforms are set again each frame)
+    std::vector<char> binary(length);
+    GLenum format;
+    glGetProgramBinary(program.rebuildID, length, NULL, &format, &binary[0]);
+    glProgramBinary(program.programID, format, binary.data(), length);
+    glGetProgramiv(program.programID, GL_LINK_STATUS, &linked);
+    return linked == GL_TRUE;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include <common/shadercache.hpp>
+#include <common/programbuilder.hpp>
+
+// Rebuilds programs when a file they are built from (including the files
+// they #include) changes on disk. The new program is built through the cache
+// and the builder, so drawing carries on with the old one while it compiles,
+// and a program that fails to compile or link is thrown away with its log
+// printed. A program that links is copied into the old program's id with
+// glGetProgramBinary and glProgramBinary, so every copy of the id picks it
+// up at once, which needs program binary support.
+class ShaderReloader
+{
+public:
+    // Program binaries are available to copy the new programs into the old ids
+    bool supported = false;
+
+    // Programs swapped in and rebuilds thrown away
+    unsigned int reloadCount = 0;
+    unsigned int failedCount = 0;
+
+    // Time from the last change being seen to its program being swapped in (ms)
+    float swapTime = 0.0f;
+
+    // Constructor (needs a current GL context), starts watching the working directory
+    ShaderReloader(ShaderCache& shaderCache, ProgramBuilder& builder);
+
+    // Rebuild a program when its files change
+    void add(unsigned int programID, const char* vertexPath, const char* fragmentPath, const std::string& defines = "");
+
+    // Start rebuilding the programs whose files changed and swap in the ones that are ready
+    void update();
+
+private:
+    struct Program
+    {
+        unsigned int programID;
+        std::string vertexPath, fragmentPath, defines;
+
+        // Program being built to replace it (0 if none) and when its change was seen
+        unsigned int rebuildID;
+        double changeTime;
+
+        // A file changed again while it was building, so it is thrown away and built again once finished
+        bool stale;
+    };
+
+    ShaderCache& shaderCache;
+    ProgramBuilder& builder;
+    std::vector<Program> programs;
+
+    // Start building a program again from its files
+    void rebuild(Program& program);
+
+    // Does a program's source depend on a file
+    static bool uses(const Program& program, const std::string& file);
+
+    // Copy a linked program into the old program's id, returns false if it did not link
+    bool swap(Program& program);
+};
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <common/shadersources.hpp>
+
+std::map<std::string, ShaderSources::File> ShaderSources::files;
+std::map<std::string, ShaderSources::Expansion> ShaderSources::expansions;
+int ShaderSources::watchID = -1;
+
+// Deepest include nesting before giving up (catches files that include each other)
+static const unsigned int maxIncludeDepth = 16;
+
+bool ShaderSources::load(const std::string& path, std::string& source)
+{
+    std::map<std::string, Expansion>::const_iterator it = expansions.find(path);
+    if (it == expansions.end())
+    {
+        Expansion expansion;
+        if (!expand(path, expansion.source, expansion.dependencies, 0))
+            return false;
+        it = expansions.insert(std::make_pair(path, expansion)).first;
+    }
+    source = it->second.source;
+    return true;
+}
+
+std::vector<std::string> ShaderSources::dependencies(const std::string& path)
+{
+    std::string source;
+    if (!load(path, source))
+        return std::vector<std::string>(1, path);
+    return expansions[path].dependencies;
+}
+
+bool ShaderSources::watch()
+{
+#ifdef __linux__
+    if (watchID >= 0)
+        return true;
+    watchID = inotify_init1(IN_NONBLOCK);
+    if (watchID < 0)
+        return false;
+
+    // Editors often save by writing a new file and renaming it over the old one
+    if (inotify_add_watch(watchID, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        close(watchID);
+        watchID = -1;
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::vector<std::string> ShaderSources::changed()
+{
+    std::vector<std::string> result;
+#ifdef __linux__
+    if (watchID < 0)
+        return result;
+
+    // Collect the names of the files written since the last call
+    std::vector<std::string> names;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+    while ((length = ::read(watchID, buffer, sizeof(buffer))) > 0)
+    {
+        for (char* p = buffer; p < buffer + length;)
+        {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+            if (event->len > 0 && std::find(names.begin(), names.end(), event->name) == names.end())
+                names.push_back(event->name);
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+
+    // Only files that have been loaded and whose contents are different count
+    for (unsigned int i = 0; i < names.size(); i++)
+    {
+        std::map<std::string, File>::iterator file = files.find(names[i]);
+        if (file == files.end())
+            continue;
+        unsigned long long oldHash = file->second.hash;
+        if (!read(names[i]) || files[names[i]].hash == oldHash)
+            continue;
+        result.push_back(names[i]);
+
+        // Drop the expansions built from it
+        for (std::map<std::string, Expansion>::iterator it = expansions.begin(); it != expansions.end();)
+        {
+            const std::vector<std::string>& used = it->second.dependencies;
+            if (std::find(used.begin(), used.end(), names[i]) != used.end())
+                expansions.erase(it++);
+            else
+                ++it;
+        }
+    }
+#endif
+    return result;
+}
+
+unsigned long long ShaderSources::hash(const std::string& text)
+{
+    unsigned long long value = 14695981039346656037ULL;
+    for (size_t i = 0; i < text.size(); i++)
+    {
+        value ^= static_cast<unsigned char>(text[i]);
+        value *= 1099511628211ULL;
+    }
+    return value;
+}
+
+bool ShaderSources::read(const std::string& path)
+{
+    std::ifstream stream(path.c_str(), std::ios::in);
+    if (!stream.is_open())
+        return false;
+    std::stringstream sstr;
+    sstr << stream.rdbuf();
+
+    File file;
+    file.text = sstr.str();
+    file.hash = hash(file.text);
+    files[path] = file;
+    return true;
+}
+
+bool ShaderSources::expand(const std::string& path, std::string& source,
+    std::vector<std::string>& dependencies, unsigned int depth)
+{
+    if (depth > maxIncludeDepth)
+    {
+        printf("Shader includes nested too deeply at %s\n", path.c_str());
+        return false;
+    }
+    if (files.find(path) == files.end() && !read(path))
+    {
+        printf("Impossible to open %s. Are you in the right directory?\n", path.c_str());
+        return false;
+    }
+    if (std::find(dependencies.begin(), dependencies.end(), path) == dependencies.end())
+        dependencies.push_back(path);
+
+    // Copy the file line by line, replacing includes with the file they name
+    std::istringstream lines(files[path].text);
+    std::string line;
+    unsigned int lineNumber = 0;
+    while (std::getline(lines, line))
+    {
+        lineNumber++;
+        size_t start = line.find_first_not_of(" \t");
+        if (start == std::string::npos || line.compare(start, 8, "#include") != 0)
+        {
+            source += line + "\n";
+            continue;
+        }
+
+        size_t open = line.find('"', start);
+        size_t close = open == std::string::npos ? std::string::npos : line.find('"', open + 1);
+        if (close == std::string::npos)
+        {
+            printf("%s(%u): expected #include \"file\"\n", path.c_str(), lineNumber);
+            return false;
+        }
+
+        // Number the included lines from 1, then carry on from the next line of this file
+        source += "#line 1\n";
+        if (!expand(line.substr(open + 1, close - open - 1), source, dependencies, depth + 1))
+            return false;
+        source += "#line " + std::to_string(lineNumber + 1) + "\n";
+    }
+    return true;
+}
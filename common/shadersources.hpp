@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <string>
+
+// Reads GLSL files, expanding #include "file" lines (relative to the working
+// directory) and keeping the results, so each file is only read from disk
+// once. On Linux the working directory can be watched with inotify: when a
+// file's contents hash differently, it and every expansion that includes it
+// are dropped and reported as changed.
+class ShaderSources
+{
+public:
+    // Expanded source of a file, returns false if it or one of its includes cannot be opened
+    static bool load(const std::string& path, std::string& source);
+
+    // Files a shader is built from (itself and everything it includes)
+    static std::vector<std::string> dependencies(const std::string& path);
+
+    // Start watching the working directory, returns false where inotify is not available
+    static bool watch();
+
+    // Files whose contents have changed since the last call (never waits)
+    static std::vector<std::string> changed();
+
+    // 64-bit FNV-1a
+    static unsigned long long hash(const std::string& text);
+
+private:
+    // A file as read from disk
+    struct File
+    {
+        std::string text;
+        unsigned long long hash;
+    };
+
+    // A file with its includes expanded, and the files that went into it
+    struct Expansion
+    {
+        std::string source;
+        std::vector<std::string> dependencies;
+    };
+
+    static std::map<std::string, File> files;
+    static std::map<std::string, Expansion> expansions;
+    static int watchID;
+
+    // Read a file into the cache
+    static bool read(const std::string& path);
+
+    // Expand a file's includes, appending to source and dependencies
+    static bool expand(const std::string& path, std::string& source,
+        std::vector<std::string>& dependencies, unsigned int depth);
+};
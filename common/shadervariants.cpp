@@ -0,0 +1,81 @@
+#include <common/shadervariants.hpp>
+#include <common/shader.hpp>
+
+ShaderVariants::ShaderVariants(const char* vertexPath, const char* fragmentPath)
+    : vertexPath(vertexPath), fragmentPath(fragmentPath)
+{
+}
+
+void ShaderVariants::beginLights()
+{
+    pointCount = 0;
+    spotCount = 0;
+    directionalCount = 0;
+}
+
+void ShaderVariants::addLights(const Light& lights)
+{
+    for (unsigned int i = 0; i < static_cast<unsigned int>(lights.lightSources.size()); i++)
+    {
+        if (lights.lightSources[i].type == 1)
+            pointCount++;
+        else if (lights.lightSources[i].type == 2)
+            spotCount++;
+        else if (lights.lightSources[i].type == 3)
+            directionalCount++;
+    }
+}
+
+unsigned int ShaderVariants::program(const Model& model)
+{
+    // Build the define block from the maps the model has and the light counts
+    bool normalMap = false, specularMap = false;
+    for (unsigned int i = 0; i < model.textures.size(); i++)
+    {
+        if (model.textures[i].type == "normal")
+            normalMap = true;
+        else if (model.textures[i].type == "specular")
+            specularMap = true;
+    }
+    std::string defines;
+    if (normalMap)
+        defines += "#define HAS_NORMAL_MAP\n";
+    if (specularMap)
+        defines += "#define HAS_SPECULAR_MAP\n";
+    // Only whether there are point and spot lights changes the code, so other counts share a program
+    defines += "#define NUM_POINT_LIGHTS " + std::to_string(pointCount > 0 ? 1 : 0) + "\n";
+    defines += "#define NUM_SPOT_LIGHTS " + std::to_string(spotCount > 0 ? 1 : 0) + "\n";
+    defines += "#define NUM_DIR_LIGHTS " + std::to_string(directionalCount) + "\n";
+
+    // Compile each combination once
+    unsigned int programID;
+    std::map<std::string, unsigned int>::iterator it = cache.find(defines);
+    if (it != cache.end())
+        programID = it->second;
+    else
+    {
+        if (shaderCache != NULL)
+            programID = shaderCache->load(vertexPath.c_str(), fragmentPath.c_str(), defines);
+        else if (builder != NULL)
+            programID = builder->submit(vertexPath.c_str(), fragmentPath.c_str(), defines);
+        else
+            programID = LoadShaders(vertexPath.c_str(), fragmentPath.c_str(), defines);
+        cache[defines] = programID;
+        programs.push_back(programID);
+        if (reloader != NULL)
+            reloader->add(programID, vertexPath.c_str(), fragmentPath.c_str(), defines);
+    }
+
+    // Draw with the fallback until the variant has built, and while it does not link or its sources could not be read
+    if (fallback != 0 && (programID == 0 || (builder != NULL && !builder->linked(programID))))
+        return fallback;
+    return programID;
+}
+
+void ShaderVariants::deletePrograms()
+{
+    for (unsigned int i = 0; i < programs.size(); i++)
+        glDeleteProgram(programs[i]);
+    programs.clear();
+    cache.clear();
+}
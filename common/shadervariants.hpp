@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+#include <map>
+#include <string>
+
+#include <common/model.hpp>
+#include <common/light.hpp>
+#include <common/shadercache.hpp>
+#include <common/programbuilder.hpp>
+#include <common/shaderreloader.hpp>
+
+// Versions of a lighting program specialised with #defines for the maps a
+// model has (HAS_NORMAL_MAP, HAS_SPECULAR_MAP), whether the scene has point
+// and spot lights (NUM_POINT_LIGHTS, NUM_SPOT_LIGHTS, 0 or 1) and the number
+// of directional lights (NUM_DIR_LIGHTS, which the shader loops over).
+// Each version is compiled the first time it is asked for and cached by its
+// defines, so the code for a missing map or light type is never run.
+class ShaderVariants
+{
+public:
+    // Programs compiled so far
+    std::vector<unsigned int> programs;
+
+    // Load the programs through a program binary cache when set
+    ShaderCache* shaderCache = NULL;
+
+    // Build the programs in the background when set, drawing with the fallback program until they are ready
+    ProgramBuilder* builder = NULL;
+    unsigned int fallback = 0;
+
+    // Rebuild the programs when their files change when set
+    ShaderReloader* reloader = NULL;
+
+    // Constructor
+    ShaderVariants(const char* vertexPath, const char* fragmentPath);
+
+    // Start counting the lights
+    void beginLights();
+
+    // Count a set of lights
+    void addLights(const Light& lights);
+
+    // Program for a model's maps and the counted lights (or the fallback while it builds, or if it did not link)
+    unsigned int program(const Model& model);
+
+    // Cleanup
+    void deletePrograms();
+
+private:
+    std::string vertexPath, fragmentPath;
+
+    // Lights of each type
+    unsigned int pointCount = 0, spotCount = 0, directionalCount = 0;
+
+    // Programs by their defines
+    std::map<std::string, unsigned int> cache;
+};
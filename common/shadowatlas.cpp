@@ -0,0 +1,358 @@
+#include <cmath>
+#include <algorithm>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <common/shadowatlas.hpp>
+#include <common/renderer.hpp>
+#include <common/glstate.hpp>
+
+// Cube faces in the order +X, -X, +Y, -Y, +Z, -Z, with the same up vectors as shadows.glsl
+static const glm::vec3 faceDirections[6] = {
+    glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f),
+    glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+    glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f) };
+static const glm::vec3 faceUps[6] = {
+    glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+    glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+    glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f) };
+
+// Near plane of the faces, also used by shadows.glsl
+static const float faceNear = 0.05f;
+
+ShadowAtlas::ShadowAtlas(unsigned int size) : size(size), maxFaceSize(size / 8), minFaceSize(size / 64)
+{
+    glGenTextures(1, &texture);
+    GLState::bindTexture(pointShadowUnit, GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+    // Depth only
+    glGenFramebuffers(1, &FBO);
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, texture, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    // Start with the whole atlas free
+    freeTiles.resize(level(minFaceSize) + 1);
+    freeTiles[0].push_back(glm::uvec2(0));
+
+    glGenQueries(timerCount, timers);
+    for (unsigned int i = 0; i < timerCount; i++)
+        timerPending[i] = false;
+}
+
+void ShadowAtlas::update(Light& lights, const Camera& camera)
+{
+    lightCount = updateCount = parkedCount = 0;
+    updates.clear();
+    cameraView = camera.view;
+    readTimers();
+
+    // Rate the point lights by the fraction of the screen height their range covers
+    std::vector<std::pair<float, unsigned int> > candidates;
+    Frustum frustum(camera.projection * camera.view);
+    glm::vec3 eye = glm::vec3(glm::inverse(camera.view)[3]);
+    for (unsigned int i = 0; i < lights.lightSources.size(); i++)
+    {
+        const LightSource& light = lights.lightSources[i];
+        if (!enabled || light.type != 1 || light.range <= 0.0f)
+            continue;
+        if (light.position.y < parkedHeight)
+        {
+            parkedCount++;
+            continue;
+        }
+        BoundingSphere sphere;
+        sphere.centre = light.position;
+        sphere.radius = std::min(light.range, 100.0f);
+        if (!frustum.contains(sphere))
+            continue;
+        float distance = std::max(glm::length(light.position - eye), sphere.radius);
+        candidates.push_back(std::make_pair(std::min(sphere.radius / distance * camera.projection[1][1], 1.0f), i));
+    }
+    std::sort(candidates.rbegin(), candidates.rend());
+    if (candidates.size() > maxLights)
+        candidates.resize(maxLights);
+
+    // Free the slots of lights that dropped out
+    for (unsigned int s = 0; s < maxLights; s++)
+    {
+        bool kept = false;
+        for (unsigned int j = 0; j < candidates.size(); j++)
+            kept = kept || slots[s].light == static_cast<int>(candidates[j].second);
+        if (!kept && slots[s].light >= 0)
+            releaseSlot(slots[s]);
+    }
+
+    // Halve the faces for each halving of the screen coverage, moving a light when its size changes
+    for (unsigned int j = 0; j < candidates.size(); j++)
+    {
+        float importance = candidates[j].first;
+        unsigned int faceSize = maxFaceSize;
+        while (faceSize > minFaceSize && importance * maxFaceSize < 0.5f * faceSize)
+            faceSize /= 2;
+
+        Slot* slot = NULL;
+        for (unsigned int s = 0; s < maxLights && slot == NULL; s++)
+        {
+            if (slots[s].light == static_cast<int>(candidates[j].second))
+                slot = &slots[s];
+        }
+        if (slot != NULL && slot->faceSize != faceSize)
+            releaseSlot(*slot);
+        if (slot == NULL || slot->light < 0)
+        {
+            for (unsigned int s = 0; s < maxLights && (slot == NULL || slot->light >= 0); s++)
+                slot = &slots[s];
+            if (!allocateSlot(*slot, faceSize))
+                continue;
+            slot->light = static_cast<int>(candidates[j].second);
+        }
+        slot->importance = importance;
+    }
+
+    // Redraw the lights without faces first, then the ones that moved, then by importance times age
+    std::vector<std::pair<float, unsigned int> > priorities;
+    for (unsigned int s = 0; s < maxLights; s++)
+    {
+        Slot& slot = slots[s];
+        if (slot.light < 0)
+            continue;
+        const LightSource& light = lights.lightSources[slot.light];
+        slot.age++;
+        float priority = slot.importance * slot.age;
+        if (!slot.drawn)
+            priority += 2.0f * maxLights;
+        else if (light.position != slot.position || std::min(light.range, 100.0f) != slot.far)
+            priority += 1.0f * maxLights;
+        priorities.push_back(std::make_pair(priority, s));
+    }
+    std::sort(priorities.rbegin(), priorities.rend());
+
+    // Take as many as fit in the budget at the measured cost per face, always taking one
+    float time = 0.0f;
+    for (unsigned int j = 0; j < priorities.size() && updates.size() < maxUpdates; j++)
+    {
+        time += 6.0f * faceTime;
+        if (!updates.empty() && time > budget)
+            break;
+
+        Slot& slot = slots[priorities[j].second];
+        const LightSource& light = lights.lightSources[slot.light];
+        slot.position = light.position;
+        slot.far = std::min(light.range, 100.0f);
+        slot.projection = glm::perspective(glm::radians(90.0f), 1.0f, faceNear, slot.far);
+        slot.drawn = true;
+        slot.age = 0;
+        updates.push_back(priorities[j].second);
+    }
+    updateCount = static_cast<unsigned int>(updates.size());
+
+    // Point the lights at their slots once they have faces
+    for (unsigned int s = 0; s < maxLights; s++)
+    {
+        if (slots[s].light >= 0 && slots[s].drawn)
+        {
+            lights.lightSources[slots[s].light].shadow = static_cast<int>(s);
+            lightCount++;
+        }
+    }
+
+    glGetIntegerv(GL_VIEWPORT, viewport);
+}
+
+void ShadowAtlas::begin()
+{
+    // Skip timing this frame if the next timer is still in flight
+    timing = !timerPending[timer];
+    if (timing)
+    {
+        timerFaces[timer] = 6 * updateCount;
+        glBeginQuery(GL_TIME_ELAPSED, timers[timer]);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+    GLState::enable(GL_SCISSOR_TEST);
+
+    // Push the casters back a little so surfaces do not shadow themselves
+    GLState::enable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0f, 4.0f);
+}
+
+void ShadowAtlas::beginFace(unsigned int update, unsigned int face)
+{
+    const Slot& slot = slots[updates[update]];
+    const glm::uvec2& tile = slot.tiles[face];
+    glViewport(tile.x, tile.y, slot.faceSize, slot.faceSize);
+    glScissor(tile.x, tile.y, slot.faceSize, slot.faceSize);
+    glClear(GL_DEPTH_BUFFER_BIT);
+}
+
+void ShadowAtlas::end()
+{
+    GLState::disable(GL_POLYGON_OFFSET_FILL);
+    GLState::disable(GL_SCISSOR_TEST);
+    glBindFramebuffer(GL_FRAMEBUFFER, GLState::sceneFramebuffer);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+
+    if (timing)
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        timerPending[timer] = true;
+        timer = (timer + 1) % timerCount;
+    }
+}
+
+glm::mat4 ShadowAtlas::view(unsigned int update, unsigned int face) const
+{
+    const glm::vec3& position = slots[updates[update]].position;
+    return glm::lookAt(position, position + faceDirections[face], faceUps[face]);
+}
+
+const glm::mat4& ShadowAtlas::projection(unsigned int update) const
+{
+    return slots[updates[update]].projection;
+}
+
+void ShadowAtlas::toShader(unsigned int shaderID)
+{
+    GLState::bindTexture(pointShadowUnit, GL_TEXTURE_2D, texture);
+    glUniform1i(glGetUniformLocation(shaderID, "pointShadowAtlas"), pointShadowUnit);
+
+    // Tiles in atlas texture coordinates, and the view space positions the faces were drawn from
+    glm::vec4 tiles[6 * maxLights];
+    glm::vec4 positions[maxLights];
+    for (unsigned int s = 0; s < maxLights; s++)
+    {
+        const Slot& slot = slots[s];
+        for (unsigned int face = 0; face < 6; face++)
+            tiles[6 * s + face] = glm::vec4(glm::vec2(slot.tiles[face]), slot.faceSize, 0.0f) / static_cast<float>(size);
+        positions[s] = glm::vec4(glm::vec3(cameraView * glm::vec4(slot.position, 1.0f)), slot.far);
+    }
+    glUniform4fv(glGetUniformLocation(shaderID, "pointShadowTiles"), 6 * maxLights, &tiles[0][0]);
+    glUniform4fv(glGetUniformLocation(shaderID, "pointShadowLights"), maxLights, &positions[0][0]);
+
+    // The faces are aligned with the world axes
+    glm::mat3 rotation = glm::transpose(glm::mat3(cameraView));
+    glUniformMatrix3fv(glGetUniformLocation(shaderID, "pointShadowRotation"), 1, GL_FALSE, &rotation[0][0]);
+}
+
+void ShadowAtlas::deleteBuffers()
+{
+    glDeleteQueries(timerCount, timers);
+    glDeleteFramebuffers(1, &FBO);
+    glDeleteTextures(1, &texture);
+    GLState::invalidate();
+}
+
+unsigned int ShadowAtlas::level(unsigned int faceSize) const
+{
+    unsigned int result = 0;
+    while ((size >> result) > faceSize)
+        result++;
+    return result;
+}
+
+bool ShadowAtlas::allocate(unsigned int level, glm::uvec2& corner)
+{
+    if (freeTiles[level].empty())
+    {
+        // Split a tile from the level above into four
+        glm::uvec2 parent;
+        if (level == 0 || !allocate(level - 1, parent))
+            return false;
+        unsigned int half = size >> level;
+        freeTiles[level].push_back(parent + glm::uvec2(half, half));
+        freeTiles[level].push_back(parent + glm::uvec2(0, half));
+        freeTiles[level].push_back(parent + glm::uvec2(half, 0));
+        freeTiles[level].push_back(parent);
+    }
+    corner = freeTiles[level].back();
+    freeTiles[level].pop_back();
+    return true;
+}
+
+void ShadowAtlas::release(unsigned int level, const glm::uvec2& corner)
+{
+    std::vector<glm::uvec2>& tiles = freeTiles[level];
+    tiles.push_back(corner);
+    if (level == 0)
+        return;
+
+    // Merge the four tiles of the parent back together when they are all free
+    unsigned int parentSize = size >> (level - 1);
+    glm::uvec2 parent = corner / parentSize * parentSize;
+    unsigned int buddies = 0;
+    for (unsigned int i = 0; i < tiles.size(); i++)
+        buddies += tiles[i] / parentSize * parentSize == parent ? 1 : 0;
+    if (buddies < 4)
+        return;
+    for (unsigned int i = 0; i < tiles.size(); )
+    {
+        if (tiles[i] / parentSize * parentSize == parent)
+        {
+            tiles[i] = tiles.back();
+            tiles.pop_back();
+        }
+        else
+        {
+            i++;
+        }
+    }
+    release(level - 1, parent);
+}
+
+void ShadowAtlas::releaseSlot(Slot& slot)
+{
+    for (unsigned int face = 0; face < 6; face++)
+        release(level(slot.faceSize), slot.tiles[face]);
+    slot = Slot();
+}
+
+bool ShadowAtlas::allocateSlot(Slot& slot, unsigned int faceSize)
+{
+    for (; faceSize >= minFaceSize; faceSize /= 2)
+    {
+        unsigned int count = 0;
+        while (count < 6 && allocate(level(faceSize), slot.tiles[count]))
+            count++;
+        if (count == 6)
+        {
+            slot.faceSize = faceSize;
+            return true;
+        }
+        while (count > 0)
+        {
+            count--;
+            release(level(faceSize), slot.tiles[count]);
+        }
+    }
+    return false;
+}
+
+void ShadowAtlas::readTimers()
+{
+    // Average the cost per face over the redraws the GPU has finished
+    for (unsigned int i = 0; i < timerCount; i++)
+    {
+        if (!timerPending[i])
+            continue;
+        unsigned int available = 0;
+        glGetQueryObjectuiv(timers[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            continue;
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(timers[i], GL_QUERY_RESULT, &nanoseconds);
+        if (timerFaces[i] > 0)
+            faceTime = 0.8f * faceTime + 0.2f * (nanoseconds / 1.0e6f / timerFaces[i]);
+        timerPending[i] = false;
+    }
+}
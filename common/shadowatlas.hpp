@@ -0,0 +1,132 @@
+#pragma once
+
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <common/light.hpp>
+#include <common/camera.hpp>
+#include <common/bounds.hpp>
+
+// Shadows for point lights, drawn as six cube faces into square tiles of one
+// shared depth atlas. Each light's faces are sized by how much of the screen
+// its range covers, and the tiles come from a buddy allocator so a light
+// keeps its place until its size changes. Drawing six faces for every light
+// each frame would cost far too much, so a scheduler only redraws the few
+// lights with the most need (no map yet, moved, then importance times age)
+// that fit in a GPU time budget, and the rest keep last frame's faces.
+// Lights parked under the floor are left without a shadow.
+class ShadowAtlas
+{
+public:
+    // Most point lights given a shadow (the size of the shaders' arrays)
+    static const unsigned int maxLights = 8;
+
+    // Width and height of the atlas, and the largest and smallest faces
+    const unsigned int size;
+    const unsigned int maxFaceSize, minFaceSize;
+
+    // Give point lights shadows
+    bool enabled = true;
+
+    // Most lights redrawn each frame, and the GPU time the redraws should fit in (milliseconds)
+    unsigned int maxUpdates = 2;
+    float budget = 1.0f;
+
+    // Lights below this height have been lowered out of the scene
+    float parkedHeight = -10.0f;
+
+    // Stats for the last frame
+    unsigned int lightCount = 0;
+    unsigned int updateCount = 0;
+    unsigned int parkedCount = 0;
+    float faceTime = 0.1f;  // measured GPU milliseconds per face
+
+    // Constructor (needs a current GL context)
+    ShadowAtlas(unsigned int size = 2048);
+
+    // Give the point lights that matter most a place in the atlas and pick the ones to redraw this frame
+    void update(Light& lights, const Camera& camera);
+
+    // Start and finish this frame's redraws, timing them on the GPU
+    void begin();
+    void end();
+
+    // Clear and bind one face of a light picked for redrawing
+    void beginFace(unsigned int update, unsigned int face);
+
+    // Light's view and projection matrices for a face of a light picked for redrawing
+    glm::mat4 view(unsigned int update, unsigned int face) const;
+    const glm::mat4& projection(unsigned int update) const;
+
+    // Bind the atlas and send the tiles and light positions to the shader
+    void toShader(unsigned int shaderID);
+
+    // Cleanup
+    void deleteBuffers();
+
+private:
+    struct Slot
+    {
+        // Light in the slot (-1 when free), and how much it matters
+        int light = -1;
+        float importance = 0.0f;
+
+        // Face size and tile corners in texels
+        unsigned int faceSize = 0;
+        glm::uvec2 tiles[6];
+
+        // Light position and range the faces were last drawn with
+        glm::vec3 position;
+        float far = 0.0f;
+        glm::mat4 projection;
+        bool drawn = false;
+
+        // Frames since the faces were drawn
+        unsigned int age = 0;
+    };
+
+    Slot slots[maxLights];
+
+    // Slots picked for redrawing this frame
+    std::vector<unsigned int> updates;
+
+    // Free tiles for each level of the buddy allocator (level 0 is the whole atlas)
+    std::vector<std::vector<glm::uvec2> > freeTiles;
+
+    // Camera view this frame, for the light positions sent to the shaders
+    glm::mat4 cameraView;
+
+    // Atlas
+    unsigned int texture, FBO;
+
+    // GPU timers for the redraws, read back a few frames later
+    static const unsigned int timerCount = 3;
+    unsigned int timers[timerCount];
+    unsigned int timerFaces[timerCount];
+    bool timerPending[timerCount];
+    unsigned int timer = 0;
+    bool timing = false;
+
+    // Scene viewport to go back to
+    GLint viewport[4];
+
+    // Allocator level of a face size
+    unsigned int level(unsigned int faceSize) const;
+
+    // Take a free tile of a level, splitting larger ones as needed
+    bool allocate(unsigned int level, glm::uvec2& corner);
+
+    // Give a tile back, merging it with its buddies when they are all free
+    void release(unsigned int level, const glm::uvec2& corner);
+
+    // Give a slot's tiles back
+    void releaseSlot(Slot& slot);
+
+    // Give a slot six tiles, trying smaller faces when the atlas is full
+    bool allocateSlot(Slot& slot, unsigned int faceSize);
+
+    // Pick up the redraw times the GPU has finished
+    void readTimers();
+};
@@ -0,0 +1,169 @@
+#include <cmath>
+#include <algorithm>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <common/shadows.hpp>
+#include <common/renderer.hpp>
+#include <common/glstate.hpp>
+
+ShadowMaps::ShadowMaps(unsigned int size) : size(size)
+{
+    shadowTexture = createArray(size, true);
+    staticTexture = createArray(size, false);
+    glGenFramebuffers(1, &shadowFBO);
+    glGenFramebuffers(1, &staticFBO);
+
+    // Depth only
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glBindFramebuffer(GL_FRAMEBUFFER, staticFBO);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+unsigned int ShadowMaps::createArray(unsigned int size, bool compare)
+{
+    unsigned int texture;
+    glGenTextures(1, &texture);
+    GLState::bindTexture(shadowUnit, GL_TEXTURE_2D_ARRAY, texture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT32F, size, size, maxShadows, 0,
+        GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, compare ? GL_LINEAR : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, compare ? GL_LINEAR : GL_NEAREST);
+
+    // Anything outside a map is lit
+    float border[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, border);
+    if (compare)
+    {
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    }
+    return texture;
+}
+
+void ShadowMaps::update(Light& lights, const Camera& camera)
+{
+    shadowCount = 0;
+    staticRedraws = 0;
+    glm::mat4 toTexture = glm::translate(glm::mat4(1.0f), glm::vec3(0.5f)) * glm::scale(glm::mat4(1.0f), glm::vec3(0.5f));
+    glm::mat4 inverseView = glm::inverse(camera.view);
+
+    for (unsigned int i = 0; i < lights.lightSources.size(); i++)
+    {
+        LightSource& light = lights.lightSources[i];
+        light.shadow = -1;
+        if (!enabled || shadowCount == maxShadows || (light.type != 2 && light.type != 3))
+            continue;
+
+        // Pick an up vector that is not parallel to the light
+        Shadow& shadow = shadows[shadowCount];
+        glm::vec3 direction = glm::normalize(light.direction);
+        glm::vec3 up = std::abs(direction.y) < 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(0.0f, 0.0f, 1.0f);
+        if (light.type == 2)
+        {
+            // Cover the cone with a little to spare, out to the light's range
+            float angle = 2.0f * std::acos(light.cosPhi) + glm::radians(4.0f);
+            float far = std::min(light.range, 100.0f);
+            shadow.view = glm::lookAt(light.position, light.position + direction, up);
+            shadow.projection = glm::perspective(std::min(angle, glm::radians(170.0f)), 1.0f, 0.05f, far);
+        }
+        else
+        {
+            // Fit an orthographic box around the scene's bounding sphere
+            glm::vec3 centre = sceneBounds.centre();
+            float radius = glm::length(sceneBounds.extent());
+            shadow.view = glm::lookAt(centre - direction * radius, centre, up);
+            shadow.projection = glm::ortho(-radius, radius, -radius, radius, 0.0f, 2.0f * radius);
+        }
+        shadow.matrix = toTexture * shadow.projection * shadow.view * inverseView;
+        light.shadow = static_cast<int>(shadowCount);
+        shadowCount++;
+    }
+
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    points.update(lights, camera);
+}
+
+bool ShadowMaps::staticStale(unsigned int shadow, unsigned int staticVersion) const
+{
+    const Shadow& s = shadows[shadow];
+    return !s.cached || s.cachedVersion != staticVersion || s.cachedViewProjection != s.projection * s.view;
+}
+
+void ShadowMaps::beginStatic(unsigned int shadow, unsigned int staticVersion)
+{
+    Shadow& s = shadows[shadow];
+    s.cached = true;
+    s.cachedVersion = staticVersion;
+    s.cachedViewProjection = s.projection * s.view;
+    staticRedraws++;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, staticFBO);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticTexture, 0, shadow);
+    glViewport(0, 0, size, size);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    // Push the casters back a little so surfaces do not shadow themselves
+    GLState::enable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0f, 4.0f);
+}
+
+void ShadowMaps::beginDynamic(unsigned int shadow)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, staticFBO);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, staticTexture, 0, shadow);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, shadowTexture, 0, shadow);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, staticFBO);
+    glBlitFramebuffer(0, 0, size, size, 0, 0, size, size, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowFBO);
+    glViewport(0, 0, size, size);
+
+    GLState::enable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0f, 4.0f);
+}
+
+void ShadowMaps::end()
+{
+    GLState::disable(GL_POLYGON_OFFSET_FILL);
+    glBindFramebuffer(GL_FRAMEBUFFER, GLState::sceneFramebuffer);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+const glm::mat4& ShadowMaps::view(unsigned int shadow) const
+{
+    return shadows[shadow].view;
+}
+
+const glm::mat4& ShadowMaps::projection(unsigned int shadow) const
+{
+    return shadows[shadow].projection;
+}
+
+void ShadowMaps::toShader(unsigned int shaderID)
+{
+    GLState::bindTexture(shadowUnit, GL_TEXTURE_2D_ARRAY, shadowTexture);
+    glUniform1i(glGetUniformLocation(shaderID, "shadowMaps"), shadowUnit);
+    glUniform1i(glGetUniformLocation(shaderID, "shadowFilter"), filter);
+    glm::mat4 matrices[maxShadows];
+    for (unsigned int i = 0; i < shadowCount; i++)
+        matrices[i] = shadows[i].matrix;
+    glUniformMatrix4fv(glGetUniformLocation(shaderID, "shadowMatrices"), maxShadows, GL_FALSE, &matrices[0][0][0]);
+    points.toShader(shaderID);
+}
+
+void ShadowMaps::deleteBuffers()
+{
+    glDeleteFramebuffers(1, &shadowFBO);
+    glDeleteFramebuffers(1, &staticFBO);
+    glDeleteTextures(1, &shadowTexture);
+    glDeleteTextures(1, &staticTexture);
+    points.deleteBuffers();
+    GLState::invalidate();
+}
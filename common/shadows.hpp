@@ -0,0 +1,97 @@
+#pragma once
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include <common/light.hpp>
+#include <common/bounds.hpp>
+#include <common/camera.hpp>
+#include <common/shadowatlas.hpp>
+
+// Shadow maps for spot and directional lights, one layer of a depth texture
+// array each. Drawing a light's static geometry (the floor and platform) is
+// cached in a second array that is only redrawn when the light moves or the
+// static geometry is rebuilt. Each frame the cached depth is copied into the
+// layer the lighting shaders sample and only the moving objects are drawn on
+// top of it. The shaders filter the maps with a square PCF kernel. Point
+// lights get their shadows from an atlas of cube faces kept alongside.
+class ShadowMaps
+{
+public:
+    // Most lights given a shadow (the size of the shaders' matrix array)
+    static const unsigned int maxShadows = 4;
+
+    // Width and height of each map
+    const unsigned int size;
+
+    // Give lights shadows (the lights are left without a layer when off)
+    bool enabled = true;
+
+    // PCF kernel radius in texels: 0 for one bilinear comparison, 1 for 3x3, 2 for 5x5
+    int filter = 1;
+
+    // Point light shadows
+    ShadowAtlas points;
+
+    // Box around every caster, which the directional lights' projections are fitted to
+    AABB sceneBounds;
+
+    // Stats for the last frame
+    unsigned int shadowCount = 0;
+    unsigned int staticRedraws = 0;
+
+    // Constructor (needs a current GL context)
+    ShadowMaps(unsigned int size = 1024);
+
+    // Give the first spot and directional lights a layer each and work out their matrices,
+    // then give the point lights their places in the atlas
+    void update(Light& lights, const Camera& camera);
+
+    // Does a layer's cached static depth need drawing again (staticVersion changes with the static geometry)
+    bool staticStale(unsigned int shadow, unsigned int staticVersion) const;
+
+    // Clear and bind a layer's static cache to draw the static casters into
+    void beginStatic(unsigned int shadow, unsigned int staticVersion);
+
+    // Copy a layer's static cache into its map and bind it to draw the moving casters into
+    void beginDynamic(unsigned int shadow);
+
+    // Go back to the scene's framebuffer and viewport
+    void end();
+
+    // Light's view and projection matrices for a layer
+    const glm::mat4& view(unsigned int shadow) const;
+    const glm::mat4& projection(unsigned int shadow) const;
+
+    // Bind the maps and the atlas and send the matrices and filter to the shader
+    void toShader(unsigned int shaderID);
+
+    // Cleanup
+    void deleteBuffers();
+
+private:
+    struct Shadow
+    {
+        glm::mat4 view, projection;
+
+        // Camera view space to map texture space, for the shaders
+        glm::mat4 matrix;
+
+        // What the static cache was last drawn with
+        glm::mat4 cachedViewProjection;
+        unsigned int cachedVersion = 0;
+        bool cached = false;
+    };
+
+    Shadow shadows[maxShadows];
+
+    // Maps sampled by the shaders, and the static caches
+    unsigned int shadowTexture, staticTexture;
+    unsigned int shadowFBO, staticFBO;
+
+    // Scene viewport to go back to
+    GLint viewport[4];
+
+    // Create a depth texture array with a layer for each shadow
+    static unsigned int createArray(unsigned int size, bool compare);
+};
@@ -0,0 +1,106 @@
+#include <algorithm>
+
+#include <common/staticbatch.hpp>
+
+unsigned int StaticBatcher::add(Model& model, const glm::mat4& transform)
+{
+    // Bake the world transform into the vertices
+    Member member;
+    member.model = &model;
+    member.active = true;
+    model.buildMesh(transform, member.vertices, member.indices);
+
+    unsigned int id = static_cast<unsigned int>(members.size());
+    members.push_back(member);
+
+    // Objects with the same material share a batch
+    std::map<Model*, Batch>::iterator it = batches.find(&model);
+    if (it == batches.end())
+    {
+        Batch batch;
+        batch.meshID = 0;
+        batch.built = false;
+        it = batches.insert(std::make_pair(&model, batch)).first;
+    }
+    it->second.members.push_back(id);
+    it->second.dirty = true;
+    objectCount++;
+
+    return id;
+}
+
+void StaticBatcher::remove(unsigned int id)
+{
+    if (id >= members.size() || !members[id].active)
+        return;
+
+    // The batch is merged again on the next update, which changes the version for the shadow caches
+    Batch& batch = batches[members[id].model];
+    batch.members.erase(std::find(batch.members.begin(), batch.members.end(), id));
+    batch.dirty = true;
+
+    members[id].active = false;
+    members[id].vertices.clear();
+    members[id].indices.clear();
+    objectCount--;
+}
+
+void StaticBatcher::update()
+{
+    batchCount = 0;
+    for (std::map<Model*, Batch>::iterator it = batches.begin(); it != batches.end(); ++it)
+    {
+        Batch& batch = it->second;
+        if (batch.dirty)
+        {
+            // Free the old merged mesh
+            if (batch.built)
+                GeometryBuffer::remove(batch.meshID);
+            batch.built = false;
+
+            // Concatenate the members' baked vertices
+            std::vector<Vertex> vertices;
+            std::vector<unsigned int> indices;
+            for (unsigned int i = 0; i < batch.members.size(); i++)
+            {
+                const Member& member = members[batch.members[i]];
+                unsigned int offset = static_cast<unsigned int>(vertices.size());
+                vertices.insert(vertices.end(), member.vertices.begin(), member.vertices.end());
+                for (unsigned int j = 0; j < member.indices.size(); j++)
+                    indices.push_back(member.indices[j] + offset);
+            }
+
+            if (!vertices.empty())
+            {
+                batch.meshID = GeometryBuffer::add(vertices, indices);
+                batch.built = true;
+            }
+            batch.dirty = false;
+            version++;
+        }
+
+        if (batch.built)
+            batchCount++;
+    }
+}
+
+void StaticBatcher::submit(Renderer& renderer)
+{
+    for (std::map<Model*, Batch>::iterator it = batches.begin(); it != batches.end(); ++it)
+    {
+        if (it->second.built)
+            renderer.submit(*it->first, it->second.meshID, glm::mat4(1.0f));
+    }
+}
+
+void StaticBatcher::deleteBuffers()
+{
+    for (std::map<Model*, Batch>::iterator it = batches.begin(); it != batches.end(); ++it)
+    {
+        if (it->second.built)
+            GeometryBuffer::remove(it->second.meshID);
+    }
+    batches.clear();
+    members.clear();
+    objectCount = batchCount = 0;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+#include <map>
+
+#include <glm/glm.hpp>
+
+#include <common/model.hpp>
+#include <common/renderer.hpp>
+
+// Bakes the world transforms of objects that never move into merged meshes,
+// one per material, so each batch is drawn once with an identity transform
+class StaticBatcher
+{
+public:
+    // Objects added and baked batches
+    unsigned int objectCount = 0;
+    unsigned int batchCount = 0;
+
+    // Changes whenever a batch is rebuilt, so anything caching the static geometry knows to redraw it
+    unsigned int version = 0;
+
+    // Add a static object, returns its id
+    unsigned int add(Model& model, const glm::mat4& transform);
+
+    // Take an object out of static batching (only its batch is rebuilt, from the other members' baked vertices)
+    void remove(unsigned int id);
+
+    // Rebuild the batches that have changed
+    void update();
+
+    // Add the batches to the renderer's draw list
+    void submit(Renderer& renderer);
+
+    // Cleanup
+    void deleteBuffers();
+
+private:
+    // A static object's baked vertices, kept so batches can be rebuilt
+    // without transforming the other members again
+    struct Member
+    {
+        Model* model;
+        std::vector<Vertex> vertices;
+        std::vector<unsigned int> indices;
+        bool active;
+    };
+
+    // Merged mesh for the objects sharing a material
+    struct Batch
+    {
+        std::vector<unsigned int> members;
+        unsigned int meshID;
+        bool built;
+        bool dirty;
+    };
+
+    std::vector<Member> members;
+    std::map<Model*, Batch> batches;
+};
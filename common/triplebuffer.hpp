@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+
+// Lock-free handoff of the newest value from one writer thread to one reader
+// thread. The writer fills the back slot and swaps it with the middle one,
+// the reader swaps its front slot with the middle one when a newer value is
+// there, so neither ever waits and a value is never read while it is written.
+// Values the reader was too slow to take are overwritten.
+template <typename T>
+class TripleBuffer
+{
+public:
+    // Values published and taken, so the reader can see how many it missed
+    std::atomic<unsigned int> publishedCount;
+    unsigned int takenCount = 0;
+
+    // Constructor fills every slot with the same value, so the reader always has one
+    TripleBuffer(const T& value = T())
+        : publishedCount(0), middle(1)
+    {
+        for (unsigned int i = 0; i < 3; i++)
+            slots[i] = value;
+    }
+
+    // Slot to fill with the next value (writer only)
+    T& back()
+    {
+        return slots[backSlot];
+    }
+
+    // Hand the back slot to the reader, taking back whichever slot it is not using
+    void publish()
+    {
+        backSlot = middle.exchange(backSlot | freshBit, std::memory_order_acq_rel) & slotMask;
+        publishedCount.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Take the newest value if one has been published since the last call (reader only)
+    bool update()
+    {
+        if (!(middle.load(std::memory_order_acquire) & freshBit))
+            return false;
+        frontSlot = middle.exchange(frontSlot, std::memory_order_acq_rel) & slotMask;
+        takenCount++;
+        return true;
+    }
+
+    // Value the reader has (reader only)
+    const T& front() const
+    {
+        return slots[frontSlot];
+    }
+
+private:
+    static const unsigned int slotMask = 3;
+    static const unsigned int freshBit = 4;
+
+    T slots[3];
+
+    // Slot between the two threads, with a bit set while it holds a value the reader has not taken
+    std::atomic<unsigned int> middle;
+
+    unsigned int frontSlot = 0;
+    unsigned int backSlot = 2;
+};
@@ -1,6 +1,10 @@
 #include <iostream>
 #include <cmath>
 #include <array>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <atomic>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <glm/gtc/random.hpp>
@@ -11,15 +15,44 @@
 #include <common/camera.hpp>
 #include <common/model.hpp>
 #include <common/light.hpp>
+#include <common/glstate.hpp>
+#include <common/renderer.hpp>
+#include <common/staticbatch.hpp>
+#include <common/bvh.hpp>
+#include <common/occlusion.hpp>
+#include <common/occlusionquery.hpp>
+#include <common/gpuculling.hpp>
+#include <common/clusters.hpp>
+#include <common/deferred.hpp>
+#include <common/shadervariants.hpp>
+#include <common/shadercache.hpp>
+#include <common/programbuilder.hpp>
+#include <common/shaderreloader.hpp>
+#include <common/shadows.hpp>
+#include <common/dynamicresolution.hpp>
+#include <common/triplebuffer.hpp>
+#include <common/jobsystem.hpp>
 
 //Function prototypes
-void keyboardInput(GLFWwindow* window);
+void settingsInput(GLFWwindow* window);
 void mouseInput(GLFWwindow* window);
 
 //Frame timer floats
 float previousTime = 0.0f;  // time of previous iteration of the loop
 float deltaTime = 0.0f;  // time elapsed since the previous frame
 
+//Fixed simulation step (the amounts things move by each step were tuned at 60 frames a second)
+const float stepTime = 1.0f / 60.0f;  // game time advanced by one step
+const int maxSteps = 8;  // most steps taken in one frame, so a slow frame does not make the next one slower still
+float stepAccumulator = 0.0f;  // time passed that has not been simulated yet
+int stepCount = 0;  // steps taken since the last frame
+
+//Time from sampling the input to showing a frame with its effect, averaged over the last second (ms)
+float inputLatency = 0.0f;
+
+//Debug stats shown in the window title
+float statsTime = 0.0f;  // time the stats were last shown
+
 // Create camera object
 Camera camera(glm::vec3(0.0f, 0.0f, 5.0f), glm::vec3(0.0f, 0.0f, 0.0f));
 
@@ -31,13 +64,104 @@ struct Object
     glm::vec3 scale = glm::vec3(1.0f, 1.0f, 1.0f);
     float angle = 0.0f;
     std::string name;
+    bool isStatic = false;      // never moves, drawn from a static batch
+    unsigned int staticID = 0;  // id in the static batcher
+    Model* model = NULL;        // model drawn for the object
+    unsigned int treeID = 0;    // id in the scene BVH
+};
+
+//Calculate an object's model matrix
+glm::mat4 modelMatrix(const Object& object);
+
+//Scatter small point and spot lights over the floor
+void addExtraLights(Light& lights, int count);
+
+//Draw a grid of small teapots just in front of the camera's starting position
+void submitTeapots(Renderer& renderer, Model& teapot, int count);
+
+//Submit the moving objects to a shadow map pass at this frame's model matrices (the player's box only in third person)
+void submitMovingCasters(Renderer& renderer, const std::vector<Object>& objects, const std::vector<glm::mat4>& models);
+
+//Keys the simulation reads, as bits of Input::keys
+enum InputKey
+{
+    keyForward = 1,
+    keyBack = 2,
+    keyLeft = 4,
+    keyRight = 8,
+    keySprint = 16,
+    keyJump = 32,
+    keyLoosen = 64
+};
+
+//Input the simulation reads, sampled on the main thread (GLFW only reads input there)
+struct Input
+{
+    unsigned int keys = 0;
+    glm::vec3 front = glm::vec3(0.0f, 0.0f, -1.0f);  // camera heading to walk along
+    glm::vec3 right = glm::vec3(1.0f, 0.0f, 0.0f);
+    double time = 0.0;  // when it was sampled
+};
+
+//Game state the simulation owns, copied from the scene at the start so it shares nothing with drawing
+struct Simulation
+{
+    glm::vec3 eye;
+    std::vector<Object> objects;
+    Light lights;
+    Input input;  // newest input taken
+    unsigned int steps = 0;
+    unsigned int looseStep = 0;  // step the platform came loose on
+    float platformHeight = 0.0f;  // height it bobs up from
+};
+
+//Positions and light state the simulation changes
+struct SimulationState
+{
+    glm::vec3 eye;
+    std::vector<glm::vec3> objectPositions;
+    std::vector<unsigned char> objectStatic;  // still drawn from a static batch
+    std::vector<LightSource> lights;
+};
+
+//What a frame is drawn from, remade after every step
+struct Snapshot
+{
+    SimulationState previous, current;  // the last two steps
+    double time = 0.0;  // when the current step was due
+    double inputTime = 0.0;  // when the input the current step read was sampled
+    unsigned int steps = 0;  // steps taken so far
 };
 
+//Sample the keys the simulation reads, and the heading the camera had in the last frame
+Input sampleInput(GLFWwindow* window);
+
+//Advance the game by one fixed step
+void simulate(Simulation& simulation);
+
+//Move the player with the keys in the simulation's input
+void keyboardInput(Simulation& simulation);
+
+//Take a step due at a time, moving the current state to the previous one
+void step(Simulation& simulation, Snapshot& snapshot, double due);
+
+//Store the simulated state
+void saveState(SimulationState& state, const Simulation& simulation);
+
+//Put the state at a time between the snapshot's two steps into the scene that is drawn
+void applySnapshot(const Snapshot& snapshot, double time, std::vector<Object>& objects, Light& lights);
+
+//Simulation thread: take each step when it is due with the newest input, publishing a snapshot after each,
+//until told to stop
+void simulationLoop(Simulation& simulation, Snapshot snapshot, TripleBuffer<Input>& inputs,
+    TripleBuffer<Snapshot>& snapshots, const std::atomic<bool>& stop);
+
 //Position vector
 glm::vec3 positionVector;
 
 //Bools
 bool centralised = false;
+bool depthPrepass = false;
 bool hasJumped = false;
 bool loggedYPos;
 bool startJumpHeight;
@@ -51,14 +175,170 @@ int downPressed = 0;
 int leftPressed = 0;
 int rightPressed = 0;
 int lastPressed = 0;
+int prepassPressed = 0;
 
 //Floats
 float jumpLength;
 float jumpPower;
 
 
-int main(void)
+int main(int argc, char* argv[])
 {
+    //Command line options
+    bool useGPUCulling = false;
+    bool verifyGPUCulling = false;
+    int testGPUCullingFrames = 0;
+    int extraLightCount = 0;
+    bool useDeferred = false;
+    bool benchmarkLights = false;
+    int objectLightCount = 0;
+    int teapotCount = 0;
+    bool benchmarkTeapots = false;
+    bool useShaderVariants = true;
+    bool useShaderCache = true;
+    bool asyncShaders = true;
+    bool reloadShaders = true;
+    bool useShadows = true;
+    int shadowFilter = 1;
+    bool usePointShadows = true;
+    int pointShadowUpdates = 2;
+    float pointShadowBudget = 1.0f;
+    int frameCap = 0;
+    bool useSimulationThread = false;
+    bool benchmarkThreads = false;
+    bool useDynamicResolution = false;
+    float frameBudget = 16.7f;
+    float sharpness = 0.0f;
+    int jobThreads = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string option = argv[i];
+
+        //Time the scene BVH without opening a window
+        if (option == "--benchmark-bvh")
+        {
+            BVH::benchmark(100000);
+            return 0;
+        }
+
+        //Time the per object work of a large scene on the job system with 1 thread up to one per core
+        if (option == "--benchmark-jobs")
+        {
+            JobSystem::benchmark(100000);
+            return 0;
+        }
+
+        //Cull with compute shaders, optionally checking the results against the CPU
+        if (option == "--gpu-culling")
+            useGPUCulling = true;
+        if (option == "--verify-gpu-culling")
+            useGPUCulling = verifyGPUCulling = true;
+
+        //Verify the GPU culling for a number of frames (60 if not given) in a hidden window, and exit
+        //with status 0 if it matched the CPU, 1 if it did not, or 2 if there is no GL 4.3 to run it on
+        if (option == "--test-gpu-culling")
+        {
+            useGPUCulling = verifyGPUCulling = true;
+            testGPUCullingFrames = 60;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                testGPUCullingFrames = std::max(1, std::atoi(argv[++i]));
+        }
+
+        //Scatter extra point and spot lights over the floor to stress the clustered lighting
+        if (option == "--lights" && i + 1 < argc)
+            extraLightCount = std::atoi(argv[++i]);
+
+        //Shade with a G-buffer and light volumes instead of clustered forward lighting
+        if (option == "--deferred")
+            useDeferred = true;
+
+        //Time forward and deferred shading with increasing numbers of lights
+        if (option == "--benchmark-lights")
+            benchmarkLights = true;
+
+        //Give each object a list of its brightest few lights instead of using the clusters
+        if (option == "--object-lights" && i + 1 < argc)
+            objectLightCount = std::atoi(argv[++i]);
+
+        //Draw a grid of teapots to load the vertex shader
+        if (option == "--teapots" && i + 1 < argc)
+            teapotCount = std::atoi(argv[++i]);
+
+        //Time the vertex shader with increasing numbers of teapots
+        if (option == "--benchmark-teapots")
+            benchmarkTeapots = true;
+
+        //Draw everything with the general lighting shader instead of per texture set variants
+        if (option == "--no-shader-variants")
+            useShaderVariants = false;
+
+        //Compile every shader from source instead of loading saved program binaries
+        if (option == "--no-shader-cache")
+            useShaderCache = false;
+
+        //Wait for each shader to compile instead of building them in the background
+        if (option == "--sync-shaders")
+            asyncShaders = false;
+
+        //Ignore edits to the shader files while running instead of rebuilding the programs
+        if (option == "--no-shader-reload")
+            reloadShaders = false;
+
+        //Start with the depth pre-pass on (P toggles it)
+        if (option == "--depth-prepass")
+            depthPrepass = true;
+
+        //Draw the lights without shadow maps
+        if (option == "--no-shadows")
+            useShadows = false;
+
+        //Shadow filtering: 0 for one bilinear comparison, 1 for 3x3 PCF, 2 for 5x5 PCF
+        if (option == "--shadow-filter" && i + 1 < argc)
+            shadowFilter = std::atoi(argv[++i]);
+
+        //Leave the point lights without shadows
+        if (option == "--no-point-shadows")
+            usePointShadows = false;
+
+        //Most point lights whose shadows are redrawn each frame, and the GPU milliseconds they may take
+        if (option == "--point-shadow-updates" && i + 1 < argc)
+            pointShadowUpdates = std::atoi(argv[++i]);
+        if (option == "--point-shadow-budget" && i + 1 < argc)
+            pointShadowBudget = static_cast<float>(std::atof(argv[++i]));
+
+        //Run the simulation on its own thread, a step ahead of drawing
+        if (option == "--simulation-thread")
+            useSimulationThread = true;
+
+        //Time frames and input latency with the simulation on the main thread, then on its own
+        if (option == "--benchmark-threads")
+            benchmarkThreads = true;
+
+        //Wait between frames to draw no more than this many a second (the simulation runs at the same rate either way)
+        if (option == "--frame-cap" && i + 1 < argc)
+            frameCap = std::atoi(argv[++i]);
+
+        //Lower the resolution to keep the GPU frame time within a budget (milliseconds, 16.7 if not given)
+        if (option == "--dynamic-resolution")
+        {
+            useDynamicResolution = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                frameBudget = static_cast<float>(std::atof(argv[++i]));
+        }
+
+        //Sharpen the scene as it is scaled up by dynamic resolution (0 for plain bilinear)
+        if (option == "--sharpen" && i + 1 < argc)
+            sharpness = static_cast<float>(std::atof(argv[++i]));
+
+        //Threads running the per frame jobs, counting the main thread (one per core if not given)
+        if (option == "--threads" && i + 1 < argc)
+            jobThreads = std::atoi(argv[++i]);
+    }
+
+    //Spread a grid of teapots past the edges of the view for the culling test to have draws to drop
+    if (testGPUCullingFrames > 0 && teapotCount == 0)
+        teapotCount = 1024;
+
 //--->          WINDOW CREATION         <---
     // Initialise GLFW
     if (!glfwInit())
@@ -70,14 +350,22 @@ int main(void)
 
     glfwWindowHint(GLFW_SAMPLES, 4);
     glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    if (testGPUCullingFrames > 0)
+        glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
 
-    // Open a window and create its OpenGL context
+    // Open a window and create its OpenGL context (GL 4.3 for multi-draw
+    // indirect, falling back to GL 3.3)
     GLFWwindow* window;
     window = glfwCreateWindow(1024, 768, "Obelisks", NULL, NULL);
+    if (window == NULL) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        window = glfwCreateWindow(1024, 768, "Obelisks", NULL, NULL);
+    }
 
     if (window == NULL) {
         fprintf(stderr, "Failed to open GLFW window.\n");
@@ -98,10 +386,10 @@ int main(void)
 //--->          END WINDOW CREATION         <---
 
     // Enable depth test
-    glEnable(GL_DEPTH_TEST);
+    GLState::enable(GL_DEPTH_TEST);
 
     // Use back face culling
-    glEnable(GL_CULL_FACE);
+    GLState::enable(GL_CULL_FACE);
 
     // Ensure we can capture keyboard inputs
     glfwSetInputMode(window, GLFW_STICKY_KEYS, GL_TRUE);
@@ -111,13 +399,46 @@ int main(void)
     glfwPollEvents();
     glfwSetCursorPos(window, 1024 / 2, 768 / 2);
 
-    // Compile shader program
+    // Start compiling the shader programs (while the assets load), or load them from the program binary cache
+    double shaderStart = glfwGetTime();
+    ProgramBuilder programBuilder;
+    ShaderCache shaderCache("shaders.cache");
+    if (!useShaderCache)
+        shaderCache.supported = false;
+    if (asyncShaders)
+        shaderCache.builder = &programBuilder;
     unsigned int shaderID, lightShaderID;
-    shaderID = LoadShaders("vertexShader.glsl", "fragmentShader.glsl");
-    lightShaderID = LoadShaders("lightVertexShader.glsl", "lightFragmentShader.glsl");
+    shaderID = shaderCache.load("vertexShader.glsl", "fragmentShader.glsl");
+    lightShaderID = shaderCache.load("lightVertexShader.glsl", "lightFragmentShader.glsl");
+    unsigned int gBufferShaderID, deferredLightShaderID, deferredCompositeShaderID;
+    gBufferShaderID = shaderCache.load("vertexShader.glsl", "gBufferFragmentShader.glsl");
+    deferredLightShaderID = shaderCache.load("deferredLightVertexShader.glsl", "deferredLightFragmentShader.glsl");
+    deferredCompositeShaderID = shaderCache.load("deferredLightVertexShader.glsl", "deferredCompositeFragmentShader.glsl");
+    unsigned int depthShaderID = shaderCache.load("depthVertexShader.glsl", "depthFragmentShader.glsl");
+    unsigned int gizmoShaderID = shaderCache.load("gizmoVertexShader.glsl", "gizmoFragmentShader.glsl");
+    double shaderTime = glfwGetTime() - shaderStart;
+
+    // Rebuild the programs when their shader files are edited
+    ShaderReloader shaderReloader(shaderCache, programBuilder);
+    if (!reloadShaders)
+        shaderReloader.supported = false;
+    shaderReloader.add(shaderID, "vertexShader.glsl", "fragmentShader.glsl");
+    shaderReloader.add(lightShaderID, "lightVertexShader.glsl", "lightFragmentShader.glsl");
+    shaderReloader.add(gBufferShaderID, "vertexShader.glsl", "gBufferFragmentShader.glsl");
+    shaderReloader.add(deferredLightShaderID, "deferredLightVertexShader.glsl", "deferredLightFragmentShader.glsl");
+    shaderReloader.add(deferredCompositeShaderID, "deferredLightVertexShader.glsl", "deferredCompositeFragmentShader.glsl");
+    shaderReloader.add(depthShaderID, "depthVertexShader.glsl", "depthFragmentShader.glsl");
+    shaderReloader.add(gizmoShaderID, "gizmoVertexShader.glsl", "gizmoFragmentShader.glsl");
+
+    // Lighting shader specialised for each texture set and the scene's lights
+    ShaderVariants shaderVariants("vertexShader.glsl", "fragmentShader.glsl");
+    shaderVariants.shaderCache = &shaderCache;
+    if (asyncShaders)
+        shaderVariants.builder = &programBuilder;
+    shaderVariants.reloader = &shaderReloader;
 
     // Activate shader
-    glUseProgram(shaderID);
+    GLState::useProgram(shaderID);
 
     // Load models
     Model obelisk("../assets/cube.obj");
@@ -172,8 +493,63 @@ int main(void)
     floor.ks = 1.0f;
     floor.Ns = 20.0f;
 
+    //Teapots (only loaded when drawn)
+    Model* teapot = NULL;
+    if (teapotCount > 0 || benchmarkTeapots)
+    {
+        teapot = new Model("../assets/teapot.obj");
+        teapot->addTexture("../assets/stones_diffuse.png", "diffuse");
+        teapot->ka = 0.2f;
+        teapot->kd = 1.0f;
+        teapot->ks = 1.0f;
+        teapot->Ns = 20.0f;
+    }
+
+    // Report how the meshes were packed into the shared geometry buffers
+    GeometryBuffer::printStats();
+
+    // Create renderer (objects are drawn with one multi-draw per texture set)
+    Renderer renderer;
+    renderer.depthShaderID = depthShaderID;
+
+    // Cull the draws on the GPU if asked to and GL 4.3 is available
+    GPUCulling* gpuCulling = NULL;
+    if (useGPUCulling && GLEW_VERSION_4_3 && renderer.multiDrawIndirect)
+    {
+        gpuCulling = new GPUCulling(shaderCache.loadCompute("cullComputeShader.glsl"),
+            shaderCache.loadCompute("hiZComputeShader.glsl"));
+        gpuCulling->verify = verifyGPUCulling;
+        renderer.gpuCulling = gpuCulling;
+    }
+    else if (testGPUCullingFrames > 0)
+    {
+        printf("GPU culling needs OpenGL 4.3, nothing to test\n");
+        glfwTerminate();
+        return 2;
+    }
+    else if (useGPUCulling)
+    {
+        printf("GPU culling needs OpenGL 4.3, culling on the CPU instead\n");
+    }
+
+    // Draw the scene offscreen at a scale that keeps the GPU within its budget if asked to
+    unsigned int upscaleShaderID = 0;
+    DynamicResolution* dynamicResolution = NULL;
+    if (useDynamicResolution)
+    {
+        upscaleShaderID = shaderCache.load("upscaleVertexShader.glsl", "upscaleFragmentShader.glsl");
+        shaderReloader.add(upscaleShaderID, "upscaleVertexShader.glsl", "upscaleFragmentShader.glsl");
+        dynamicResolution = new DynamicResolution(upscaleShaderID);
+        dynamicResolution->budget = frameBudget;
+        dynamicResolution->sharpness = sharpness;
+    }
+
+    // Split the per object and per light work of each frame over the cores
+    JobSystem jobs(static_cast<unsigned int>(std::max(jobThreads, 0)));
+
     // Add light sources
     Light lightSources;
+    lightSources.jobs = &jobs;
 
     //Spotlight
     lightSources.addSpotLight(glm::vec3(0.0f, 3.0f, 0.0f),          // position
@@ -192,6 +568,70 @@ int main(void)
             0.002f, 20.0f, 0.002f);                                           // attenuation
     }
 
+    //Extra small lights (not animated and without gizmos)
+    Light extraLights;
+    extraLights.jobs = &jobs;
+    addExtraLights(extraLights, extraLightCount);
+
+    //Wait for the shaders still compiling after loading the assets
+    double shaderWaitStart = glfwGetTime();
+    programBuilder.finish();
+    shaderCache.update();
+    double shaderWait = glfwGetTime() - shaderWaitStart;
+
+    //Start building the lighting variants, drawing with the general lighting shader until they are ready
+    shaderVariants.fallback = shaderID;
+    shaderVariants.beginLights();
+    shaderVariants.addLights(lightSources);
+    shaderVariants.addLights(extraLights);
+    Model* variantModels[] = { &obelisk, &collisionBox, &platform, &floor };
+    for (unsigned int i = 0; i < sizeof(variantModels) / sizeof(variantModels[0]); i++)
+        shaderVariants.program(*variantModels[i]);
+
+    //Bin the lights into view frustum clusters each frame
+    ClusteredLights clusters;
+    clusters.jobs = &jobs;
+    clusters.maxObjectLights = objectLightCount > 0 ? objectLightCount : 0;
+
+    //Shadow maps for the spot light, caching the depth of the static objects, and an atlas
+    //for the point lights that only redraws a few of them each frame
+    ShadowMaps shadowMaps;
+    shadowMaps.enabled = useShadows;
+    shadowMaps.filter = std::max(0, std::min(shadowFilter, 2));
+    shadowMaps.points.enabled = useShadows && usePointShadows;
+    shadowMaps.points.maxUpdates = static_cast<unsigned int>(std::max(pointShadowUpdates, 1));
+    shadowMaps.points.budget = pointShadowBudget;
+    renderer.shadows = &shadowMaps;
+
+    //G-buffer and light volumes for deferred shading
+    DeferredRenderer deferred(deferredLightShaderID, deferredCompositeShaderID);
+    deferred.shadows = &shadowMaps;
+
+    //Light counts timed by the benchmark, each with forward then deferred shading
+    const int benchmarkCounts[] = { 0, 250, 500, 1000, 2000, 4000 };
+    const int benchmarkSteps = 2 * sizeof(benchmarkCounts) / sizeof(benchmarkCounts[0]);
+    const int benchmarkWarmup = 5, benchmarkFrames = 20;
+    int benchmarkStep = 0, benchmarkFrame = 0;
+    double benchmarkStart = 0.0;
+    double benchmarkResults[benchmarkSteps];
+    if (benchmarkLights)
+    {
+        extraLights.lightSources.clear();
+        addExtraLights(extraLights, benchmarkCounts[0]);
+        useDeferred = false;
+    }
+
+    //Teapot counts timed by the vertex benchmark
+    const int teapotCounts[] = { 16, 64, 256 };
+    const int teapotSteps = sizeof(teapotCounts) / sizeof(teapotCounts[0]);
+    int teapotStep = 0;
+    double teapotResults[teapotSteps];
+    if (benchmarkTeapots)
+    {
+        teapotCount = teapotCounts[0];
+        benchmarkLights = false;
+    }
+
     //Establish object vector
     std::vector<Object> objects;
     Object object;
@@ -200,16 +640,21 @@ int main(void)
     object.name = "platform";
     object.position = glm::vec3(0, -0.8f, 0);
     object.scale = glm::vec3(1.0f, 0.2f, 1.0f);
+    object.isStatic = true;
+    object.model = &platform;
     objects.push_back(object);
 
     //Collision Box
     object.name = "collisionBox";
+    object.isStatic = false;
+    object.model = &collisionBox;
     object.position = camera.eye;
     object.scale = glm::vec3(0.2f, 0.2f, 0.2f);
     objects.push_back(object);
 
     //Obelisks
     object.name = "obelisk";
+    object.model = &obelisk;
     for (unsigned int i = 0; i < 6; i++)
     {
         object.position = positions[i];
@@ -229,14 +674,98 @@ int main(void)
         object.rotation = glm::vec3(0.0f, 1.0f, 0.0f);
         object.angle = 0.0f;
         object.name = "floor";
+        object.isStatic = true;
+        object.model = &floor;
         objects.push_back(object);
     }
 
+    //Bake the objects that never move into static batches
+    StaticBatcher staticBatches;
+    for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
+    {
+        if (objects[i].name == "platform" && objects[i].isStatic)
+            objects[i].staticID = staticBatches.add(platform, modelMatrix(objects[i]));
+        if (objects[i].name == "floor" && objects[i].isStatic)
+            objects[i].staticID = staticBatches.add(floor, modelMatrix(objects[i]));
+    }
+
+    //Index the objects' world-space boxes for culling and spatial queries
+    BVH sceneTree;
+    for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
+        objects[i].treeID = sceneTree.add(objects[i].model->aabb.transform(modelMatrix(objects[i])));
+    std::vector<unsigned int> visibleObjects;
+    std::vector<unsigned char> objectVisible;
+
+    //Each frame's model matrices and world boxes of the objects
+    std::vector<glm::mat4> objectModels;
+    std::vector<AABB> objectBoxes;
+
+    //Fit directional shadows around every object, leaving room for the obelisks to rise
+    for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
+    {
+        AABB box = objects[i].model->aabb.transform(modelMatrix(objects[i]));
+        shadowMaps.sceneBounds.min = i == 0 ? box.min : glm::min(shadowMaps.sceneBounds.min, box.min);
+        shadowMaps.sceneBounds.max = i == 0 ? box.max : glm::max(shadowMaps.sceneBounds.max, box.max);
+    }
+    shadowMaps.sceneBounds.max.y += 3.0f;
+
+    //Low resolution CPU depth buffer for occlusion culling
+    OcclusionBuffer occlusion;
+
+    //GPU occlusion queries on the objects' and light gizmos' boxes
+    OcclusionQueries objectQueries(lightShaderID);
+    OcclusionQueries gizmoQueries(lightShaderID);
+
     //--->          RENDER LOOP         <---
+    bool firstFrame = true;
+    bool variantsBuilding = programBuilder.pendingCount() > 0;
+    int frameCount = 0;
+
+    //The simulation steps its own copy of the scene, and frames are drawn from snapshots of it
+    Simulation simulation;
+    simulation.eye = camera.eye;
+    simulation.objects = objects;
+    simulation.lights.lightSources = lightSources.lightSources;
+    simulation.lights.jobs = &jobs;
+    Snapshot snapshot;
+    saveState(snapshot.current, simulation);
+    snapshot.previous = snapshot.current;
+    snapshot.time = glfwGetTime();
+    unsigned int drawnSteps = 0;
+    float latencySum = 0.0f;
+    unsigned int latencyCount = 0;
+
+    //Triple buffers taking the input to the simulation thread and bringing its snapshots back
+    TripleBuffer<Input> inputs;
+    TripleBuffer<Snapshot> snapshots(snapshot);
+    std::atomic<bool> stopSimulation(false);
+    std::thread simulationThread;
+    if (useSimulationThread && !benchmarkThreads)
+    {
+        simulationThread = std::thread(simulationLoop, std::ref(simulation), snapshot, std::ref(inputs),
+            std::ref(snapshots), std::cref(stopSimulation));
+    }
+
+    //Frames timed by the thread benchmark, on the main thread then with the simulation thread
+    const int threadWarmup = 10, threadFrames = 60;
+    int threadStep = 0, threadFrame = 0;
+    double threadStart = 0.0, threadLatency = 0.0;
+    double threadResults[2][2];
     while (!glfwWindowShouldClose(window))
     {
-        //Ensure player can't float
-        camera.eye.y = 0.0f;
+        //Pick up the shader variants that have finished building, and save them once they all have
+        programBuilder.poll();
+        shaderCache.update();
+        shaderReloader.update();
+        frameCount++;
+        if (testGPUCullingFrames > 0 && frameCount >= testGPUCullingFrames)
+            glfwSetWindowShouldClose(window, true);
+        if (variantsBuilding && programBuilder.pendingCount() == 0)
+        {
+            printf("Shader variants ready after %.1f ms (frame %d)\n", 1000.0 * glfwGetTime(), frameCount);
+            shaderCache.save();
+            variantsBuilding = false;
+        }
 
         //Update timer
         float time = glfwGetTime();
@@ -244,8 +773,50 @@ int main(void)
         previousTime = time;
 
         //Get inputs
-        keyboardInput(window);
+        settingsInput(window);
         mouseInput(window);
+        Input input = sampleInput(window);
+
+        //Hand the input to the simulation thread and take its newest snapshot, or simulate the time that
+        //has passed in fixed steps here
+        const Snapshot* drawn = &snapshot;
+        if (simulationThread.joinable())
+        {
+            inputs.back() = input;
+            inputs.publish();
+            snapshots.update();
+            drawn = &snapshots.front();
+        }
+        else
+        {
+            simulation.input = input;
+            stepAccumulator = std::min(stepAccumulator + deltaTime, maxSteps * stepTime);
+            while (stepAccumulator >= stepTime)
+            {
+                stepAccumulator -= stepTime;
+                step(simulation, snapshot, time - stepAccumulator);
+            }
+        }
+        stepCount = drawn->steps - drawnSteps;
+        drawnSteps = drawn->steps;
+        double drawnInputTime = drawn->inputTime;
+
+        //Draw the frame at the time it shows, between the last two steps
+        applySnapshot(*drawn, time, objects, lightSources);
+
+        //Take the objects the simulation has let move out of their static batches
+        for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
+        {
+            if (objects[i].isStatic && !drawn->current.objectStatic[i])
+            {
+                staticBatches.remove(objects[i].staticID);
+                objects[i].isStatic = false;
+            }
+        }
+
+        //Pick this frame's resolution and draw into its framebuffer
+        if (dynamicResolution != NULL)
+            dynamicResolution->begin();
 
         //Clear the window
         glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
@@ -265,104 +836,165 @@ int main(void)
         }
 
         //Activate shader
-        glUseProgram(shaderID);
-
-        //Send light source properties to the shader
-        lightSources.toShader(shaderID, camera.view);
+        GLState::useProgram(shaderID);
+
+        //Give the lights their shadow maps before their light data is packed
+        shadowMaps.update(lightSources, camera);
+
+        //Bin the light sources into clusters (the renderer sends them to the programs it draws with)
+        clusters.clustering = !useDeferred && clusters.maxObjectLights == 0;
+        renderer.lights = useDeferred ? NULL : &clusters;
+        renderer.variants = useDeferred || !useShaderVariants ? NULL : &shaderVariants;
+        renderer.depthPrepass = depthPrepass;
+        clusters.begin(camera);
+        clusters.add(lightSources);
+        clusters.add(extraLights);
+        clusters.build();
+
+        //Count the lights compiled into the shader variants
+        shaderVariants.beginLights();
+        shaderVariants.addLights(lightSources);
+        shaderVariants.addLights(extraLights);
+
+        //Calculate the objects' model matrices and world boxes in parallel
+        objectModels.resize(objects.size());
+        objectBoxes.resize(objects.size());
+        jobs.parallelFor(static_cast<unsigned int>(objects.size()), 64, [&](unsigned int begin, unsigned int end)
+        {
+            for (unsigned int i = begin; i < end; i++)
+            {
+                objectModels[i] = modelMatrix(objects[i]);
+                objectBoxes[i] = objects[i].model->aabb.transform(objectModels[i]);
+            }
+        });
 
-        //Loop through objects
+        //Refit the scene BVH around the moving objects and find the ones in view
         for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
         {
-            //Calculate model matrix
-            glm::mat4 translate = Maths::translate(objects[i].position);
-            glm::mat4 scale = Maths::scale(objects[i].scale);
-            glm::mat4 rotate = Maths::rotate(objects[i].angle, objects[i].rotation);
-            glm::mat4 model = translate * rotate * scale;
-
-            //Send the MVP and MV matrices to the vertex shader
-            glm::mat4 MV = camera.view * model;
-            glm::mat4 MVP = camera.projection * MV;
-            glUniformMatrix4fv(glGetUniformLocation(shaderID, "MVP"), 1, GL_FALSE, &MVP[0][0]);
-            glUniformMatrix4fv(glGetUniformLocation(shaderID, "MV"), 1, GL_FALSE, &MV[0][0]);
+            if (!objects[i].isStatic)
+                sceneTree.update(objects[i].treeID, objectBoxes[i]);
+        }
+        sceneTree.update();
+        visibleObjects.clear();
+        sceneTree.query(Frustum(camera.projection * camera.view), visibleObjects);
+        objectVisible.assign(objects.size(), 0);
+        for (unsigned int i = 0; i < static_cast<unsigned int>(visibleObjects.size()); i++)
+            objectVisible[visibleObjects[i]] = 1;
+
+        //Draw the shadow maps with the objects where the BVH has them, only redrawing the cached
+        //static depth when the light or the static batches change
+        staticBatches.update();
+        for (unsigned int i = 0; i < shadowMaps.shadowCount; i++)
+        {
+            if (shadowMaps.staticStale(i, staticBatches.version))
+            {
+                shadowMaps.beginStatic(i, staticBatches.version);
+                staticBatches.submit(renderer);
+                renderer.drawDepthOnly(shadowMaps.view(i), shadowMaps.projection(i));
+            }
+            shadowMaps.beginDynamic(i);
+            submitMovingCasters(renderer, objects, objectModels);
+            renderer.drawDepthOnly(shadowMaps.view(i), shadowMaps.projection(i));
+        }
+        if (shadowMaps.shadowCount > 0)
+            shadowMaps.end();
 
-            //Draw the models
-            if (objects[i].name == "collisionBox")
+        //Redraw the six faces of the point lights the atlas picked this frame
+        if (shadowMaps.points.updateCount > 0)
+        {
+            shadowMaps.points.begin();
+            for (unsigned int i = 0; i < shadowMaps.points.updateCount; i++)
             {
-                objects[i].position = glm::vec3(camera.eye.x, camera.eye.y - 0.6f, camera.eye.z); //Check if player is centralised
-                positionVector = objects[i].position;
-                if (camera.eye.x >= -0.9f && camera.eye.x <= 0.9f &&
-                    camera.eye.z >= -0.9f && camera.eye.z <= 0.9f)
+                for (unsigned int face = 0; face < 6; face++)
                 {
-                    centralised = true;
+                    shadowMaps.points.beginFace(i, face);
+                    staticBatches.submit(renderer);
+                    submitMovingCasters(renderer, objects, objectModels);
+                    renderer.drawDepthOnly(shadowMaps.points.view(i, face), shadowMaps.points.projection(i));
                 }
-                else
-                {
-                    centralised = false;
-                }
-                loggedYPos = objects[i].position.y * jumpPower; //Grab current Y position
+            }
+            shadowMaps.points.end();
+        }
 
-                if (useThirdPerson == true)
+        //Rasterize the obelisks, platform and floor in view, then drop the objects they hide
+        occlusion.begin(camera.projection * camera.view);
+        for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
+        {
+            if (objectVisible[objects[i].treeID] && objects[i].name != "collisionBox")
+                occlusion.addOccluder(objects[i].model->vertices, objectModels[i]);
+        }
+        occlusion.render();
+        for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
+        {
+            if (objectVisible[objects[i].treeID] && !objects[i].isStatic &&
+                !occlusion.visible(sceneTree.bounds(objects[i].treeID)))
+                objectVisible[objects[i].treeID] = 0;
+        }
+
+        //Skip the objects the GPU last found hidden, and query them again after this frame's draw
+        for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
+        {
+            if (objectVisible[objects[i].treeID] && !objects[i].isStatic)
+            {
+                objectQueries.test(objects[i].treeID, sceneTree.bounds(objects[i].treeID));
+                if (!objectQueries.visible(objects[i].treeID))
+                    objectVisible[objects[i].treeID] = 0;
+            }
+        }
+
+        //Loop through objects
+        for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
+        {
+            //Calculate model matrix (static objects are baked into their batch)
+            glm::mat4 model;
+            if (!objects[i].isStatic)
+                model = objectModels[i];
+
+            //Add the models to the draw list
+            if (objects[i].name == "collisionBox")
+            {
+                if (useThirdPerson == true && objectVisible[objects[i].treeID])
                 {
-                    collisionBox.draw(shaderID);
+                    renderer.submit(collisionBox, model);
                 }
             }
             if (objects[i].name == "obelisk")
             {
-                if (objects[i].position.x + 2.5f > camera.eye.x && //Check if player is close
-                    objects[i].position.x - 2.5f < camera.eye.x &&
-                    objects[i].position.z + 2.5f > camera.eye.z &&
-                    objects[i].position.z - 2.5f < camera.eye.z)
-                {
-
-                    if (objects[i].position.y < 3)
-                    {
-                        objects[i].position = glm::vec3(objects[i].position.x, objects[i].position.y += 0.005f, objects[i].position.z);
-                    }
-                }
-                else if (objects[i].position.y > 0)
-                {
-                    objects[i].position.y = objects[i].position.y - 0.005f;
-                }
-                obelisk.draw(shaderID);
+                if (objectVisible[objects[i].treeID])
+                    renderer.submit(obelisk, model);
             }
             if (objects[i].name == "floor")
             {
-                floor.draw(shaderID);
+                if (!objects[i].isStatic && objectVisible[objects[i].treeID])
+                    renderer.submit(floor, model);
             }
             if (objects[i].name == "platform")
             {
-                if ((objects[i].position.x + 1.2f > camera.eye.x && //Check if player is colliding with platform
-                    objects[i].position.x - 1.2f < camera.eye.x &&
-                    objects[i].position.z + 1.2f > camera.eye.z &&
-                    objects[i].position.z - 1.2f < camera.eye.z) && camera.eye.y <= 1.2f)
-                {
-                    if (upPressed == 1) {
-                        camera.eye -= camera.front * 0.01f, camera.up - 1.0f;
-                    }
-                    if (downPressed == 1) {
-                        camera.eye += camera.front * 0.01f, camera.up - 1.0f;
-                    }
-                    if (leftPressed == 1) {
-                        camera.eye += camera.right * 0.01f, camera.up - 1.0f;
-                    }
-                    if (rightPressed == 1) {
-                        camera.eye -= camera.right * 0.01f, camera.up - 1.0f;
-                    }
-                }
-                platform.draw(shaderID);
+                if (!objects[i].isStatic && objectVisible[objects[i].treeID])
+                    renderer.submit(platform, model);
             }
         }
 
-        if (centralised == true) {
-            lightSources.activated();
+        //Draw the objects (any static batch an object has left was rebuilt before the shadows)
+        staticBatches.submit(renderer);
+        if (teapot != NULL)
+            submitTeapots(renderer, *teapot, teapotCount);
+        if (useDeferred)
+        {
+            //Fill the G-buffer, then add up the light volumes in the window
+            deferred.beginGeometry();
+            renderer.draw(gBufferShaderID, camera.view, camera.projection);
+            deferred.endGeometry();
+            deferred.drawLights(clusters, camera.projection);
         }
         else
         {
-            lightSources.deactivated();
+            renderer.draw(shaderID, camera.view, camera.projection);
         }
+        objectQueries.issue(camera.view, camera.projection, camera.eye);
 
-        //Draw light sources
-        lightSources.draw(lightShaderID, camera.view, camera.projection, sphere);
+        //Draw light sources (the queries still use the plain light shader for their boxes)
+        lightSources.draw(gizmoShaderID, camera.view, camera.projection, sphere, &gizmoQueries);
 
         if (camera.pitch > 1.20f) {
             camera.pitch = 1.20f;
@@ -371,42 +1003,484 @@ int main(void)
             camera.pitch = -0.5f;
         }
 
+        //Keep this frame's depth for the next frame's GPU culling
+        if (gpuCulling != NULL)
+            gpuCulling->buildHiZ(camera.view, camera.projection);
+
+        //Scale the frame up into the window
+        if (dynamicResolution != NULL)
+            dynamicResolution->end();
+
+        //Time each benchmark step once the GPU has finished its frames
+        if (benchmarkLights)
+        {
+            glFinish();
+            benchmarkFrame++;
+            if (benchmarkFrame == benchmarkWarmup)
+                benchmarkStart = glfwGetTime();
+            if (benchmarkFrame == benchmarkWarmup + benchmarkFrames)
+            {
+                benchmarkResults[benchmarkStep] = 1000.0 * (glfwGetTime() - benchmarkStart) / benchmarkFrames;
+                benchmarkStep++;
+                benchmarkFrame = 0;
+                if (benchmarkStep == benchmarkSteps)
+                {
+                    printf("lights  forward ms  deferred ms\n");
+                    for (int i = 0; i < benchmarkSteps / 2; i++)
+                        printf("%6d  %10.2f  %11.2f\n", benchmarkCounts[i], benchmarkResults[2 * i], benchmarkResults[2 * i + 1]);
+                    glfwSetWindowShouldClose(window, true);
+                }
+                else
+                {
+                    useDeferred = benchmarkStep % 2 == 1;
+                    extraLights.lightSources.clear();
+                    addExtraLights(extraLights, benchmarkCounts[benchmarkStep / 2]);
+                }
+            }
+        }
+
+        //Time each teapot count in the same way
+        if (benchmarkTeapots)
+        {
+            glFinish();
+            benchmarkFrame++;
+            if (benchmarkFrame == benchmarkWarmup)
+                benchmarkStart = glfwGetTime();
+            if (benchmarkFrame == benchmarkWarmup + benchmarkFrames)
+            {
+                teapotResults[teapotStep] = 1000.0 * (glfwGetTime() - benchmarkStart) / benchmarkFrames;
+                teapotStep++;
+                benchmarkFrame = 0;
+                if (teapotStep == teapotSteps)
+                {
+                    unsigned int triangles = GeometryBuffer::mesh(teapot->meshID).indexCount / 3;
+                    printf("teapots  triangles        ms  Mtris/s\n");
+                    for (int i = 0; i < teapotSteps; i++)
+                        printf("%7d  %9u  %8.2f  %7.2f\n", teapotCounts[i], teapotCounts[i] * triangles, teapotResults[i],
+                            teapotCounts[i] * triangles / (1000.0 * teapotResults[i]));
+                    glfwSetWindowShouldClose(window, true);
+                }
+                else
+                {
+                    teapotCount = teapotCounts[teapotStep];
+                }
+            }
+        }
+
+        //Show how many GL calls the state cache filtered out
+        GLState::endFrame();
+        if (time - statsTime > 1.0f)
+        {
+            statsTime = time;
+            std::string title = "Obelisks | GL calls issued: " + std::to_string(GLState::issuedLastFrame) +
+                ", filtered: " + std::to_string(GLState::filteredLastFrame) +
+                " | objects: " + std::to_string(renderer.objectCount) +
+                ", culled: " + std::to_string(renderer.culledCount) +
+                ", draw calls: " + std::to_string(renderer.drawCalls) +
+                " | depth pre-pass: " + (depthPrepass ? "on" : "off") +
+                " | shadows: " + std::to_string(shadowMaps.shadowCount) +
+                ", static redraws: " + std::to_string(shadowMaps.staticRedraws) +
+                ", point: " + std::to_string(shadowMaps.points.lightCount) +
+                " (" + std::to_string(shadowMaps.points.updateCount) + " redrawn, " +
+                std::to_string(shadowMaps.points.parkedCount) + " parked, " +
+                std::to_string(shadowMaps.points.faceTime) + " ms/face)" +
+                ", overdraw: " + std::to_string(renderer.overdraw) +
+                " | lights culled: " + std::to_string(lightSources.culledCount) +
+                ", impostors: " + std::to_string(lightSources.impostorCount) +
+                " | " + (useDeferred ? "deferred, volumes: " + std::to_string(deferred.volumeCount) : std::string("forward")) +
+                " | clustered lights: " + std::to_string(clusters.lightCount) +
+                ", indices: " + std::to_string(clusters.indexCount) +
+                ", max per cluster: " + std::to_string(clusters.maxPerCluster) +
+                " (" + std::to_string(clusters.buildTime) + " ms)" +
+                (clusters.maxObjectLights > 0 ? " | object lights: " + std::to_string(clusters.objectIndexCount) +
+                    ", dropped: " + std::to_string(clusters.droppedCount) : std::string()) +
+                " | BVH visible: " + std::to_string(visibleObjects.size()) + "/" + std::to_string(objects.size()) +
+                " | occluded: " + std::to_string(occlusion.occludedCount) + "/" + std::to_string(occlusion.testedCount) +
+                " (" + std::to_string(occlusion.renderTime) + " ms)" +
+                " | GPU hidden: " + std::to_string(objectQueries.hiddenCount) +
+                ", gizmos: " + std::to_string(gizmoQueries.hiddenCount) +
+                " | simulation: " + (simulationThread.joinable() ? "thread" : "main") +
+                ", steps: " + std::to_string(stepCount) +
+                ", input latency: " + std::to_string(inputLatency) + " ms" +
+                (dynamicResolution != NULL ? " | resolution: " + std::to_string(static_cast<int>(100.0f * dynamicResolution->scale + 0.5f)) +
+                    "%, GPU: " + std::to_string(dynamicResolution->gpuTime) + "/" + std::to_string(dynamicResolution->budget) + " ms" +
+                    ", CPU: " + std::to_string(dynamicResolution->cpuTime) + " ms" + (dynamicResolution->cpuBound ? " (CPU bound)" : "") : std::string()) +
+                " | job threads: " + std::to_string(jobs.threadCount()) +
+                ", jobs: " + std::to_string(jobs.jobCount.load()) +
+                ", stolen: " + std::to_string(jobs.stolenCount.load());
+            glfwSetWindowTitle(window, title.c_str());
+            jobs.resetStats();
+        }
+
         //Swap buffers
         glfwSwapBuffers(window);
         glfwPollEvents();
+
+        //Time from sampling the input the drawn step read to swapping the frame
+        float latency = 1000.0f * static_cast<float>(glfwGetTime() - drawnInputTime);
+        latencySum += latency;
+        latencyCount++;
+        if (statsTime == time)
+        {
+            inputLatency = latencySum / latencyCount;
+            latencySum = 0.0f;
+            latencyCount = 0;
+        }
+
+        //Time the frames and their latency with the simulation on each thread (without waiting for the GPU,
+        //so the two threads can overlap)
+        if (benchmarkThreads)
+        {
+            threadFrame++;
+            if (threadFrame == threadWarmup)
+            {
+                threadStart = glfwGetTime();
+                threadLatency = 0.0;
+            }
+            else if (threadFrame > threadWarmup)
+            {
+                threadLatency += latency;
+            }
+            if (threadFrame == threadWarmup + threadFrames)
+            {
+                threadResults[threadStep][0] = 1000.0 * (glfwGetTime() - threadStart) / threadFrames;
+                threadResults[threadStep][1] = threadLatency / threadFrames;
+                threadStep++;
+                threadFrame = 0;
+                if (threadStep == 2)
+                {
+                    printf("simulation  frame ms  input latency ms\n");
+                    printf("main        %8.2f  %16.2f\n", threadResults[0][0], threadResults[0][1]);
+                    printf("thread      %8.2f  %16.2f\n", threadResults[1][0], threadResults[1][1]);
+                    printf("%u cores, %u of %u snapshots drawn\n", std::thread::hardware_concurrency(),
+                        snapshots.takenCount, snapshots.publishedCount.load());
+                    glfwSetWindowShouldClose(window, true);
+                }
+                else
+                {
+                    //Hand over the state simulated so far, so the first frames draw it rather than the one from startup
+                    snapshots.back() = snapshot;
+                    snapshots.publish();
+                    simulationThread = std::thread(simulationLoop, std::ref(simulation), snapshot, std::ref(inputs),
+                        std::ref(snapshots), std::cref(stopSimulation));
+                }
+            }
+        }
+
+        //Hold the frame rate down if asked to
+        if (frameCap > 0)
+        {
+            double wait = time + 1.0 / frameCap - glfwGetTime();
+            if (wait > 0.0)
+                std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+        }
+
+        //Report the startup time once the first frame is done, and save the new programs
+        if (firstFrame)
+        {
+            glFinish();
+            printf("Startup: %.1f ms to the first frame, %.1f ms starting shaders, %.1f ms waiting for them (%u from the cache, %u compiled)\n",
+                1000.0 * glfwGetTime(), 1000.0 * shaderTime, 1000.0 * shaderWait, shaderCache.hits, shaderCache.misses);
+            shaderCache.save();
+            firstFrame = false;
+        }
     }
 
+    //Stop the simulation thread
+    stopSimulation = true;
+    if (simulationThread.joinable())
+        simulationThread.join();
+
     //Cleanup
+    shaderCache.save();
     floor.deleteBuffers();
     collisionBox.deleteBuffers();
     obelisk.deleteBuffers();
     platform.deleteBuffers();
+    if (teapot != NULL)
+    {
+        teapot->deleteBuffers();
+        delete teapot;
+    }
+    staticBatches.deleteBuffers();
+    shadowMaps.deleteBuffers();
+    renderer.deleteBuffers();
+    clusters.deleteBuffers();
+    deferred.deleteBuffers();
+    int status = 0;
+    if (gpuCulling != NULL)
+    {
+        if (testGPUCullingFrames > 0 && (gpuCulling->verifiedFrames == 0 || gpuCulling->mismatchedFrames > 0))
+            status = 1;
+        gpuCulling->deleteBuffers();
+        delete gpuCulling;
+    }
+    if (dynamicResolution != NULL)
+    {
+        dynamicResolution->deleteBuffers();
+        delete dynamicResolution;
+        glDeleteProgram(upscaleShaderID);
+    }
+    objectQueries.deleteBuffers();
+    gizmoQueries.deleteBuffers();
+    lightSources.deleteBuffers();
+    GeometryBuffer::deleteBuffers();
 
+    shaderVariants.deletePrograms();
     glDeleteProgram(shaderID);
+    glDeleteProgram(gBufferShaderID);
+    glDeleteProgram(deferredLightShaderID);
+    glDeleteProgram(deferredCompositeShaderID);
+    glDeleteProgram(depthShaderID);
+    glDeleteProgram(gizmoShaderID);
 
     //Close OpenGL window and terminate GLFW
     glfwTerminate();
-    return 0;
+    return status;
 }
 
-//Check for keyboard input
-void keyboardInput(GLFWwindow* window)
+//Calculate an object's model matrix
+glm::mat4 modelMatrix(const Object& object)
 {
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
+    glm::mat4 translate = Maths::translate(object.position);
+    glm::mat4 scale = Maths::scale(object.scale);
+    glm::mat4 rotate = Maths::rotate(object.angle, object.rotation);
+    return translate * rotate * scale;
+}
+
+//Submit the moving objects to a shadow map pass at this frame's model matrices (the player's box only in third person)
+void submitMovingCasters(Renderer& renderer, const std::vector<Object>& objects, const std::vector<glm::mat4>& models)
+{
+    for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
+    {
+        if (!objects[i].isStatic && (objects[i].name != "collisionBox" || useThirdPerson))
+            renderer.submit(*objects[i].model, models[i]);
+    }
+}
+
+//Scatter small point and spot lights over the floor
+void addExtraLights(Light& lights, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        glm::vec3 position = glm::vec3(glm::linearRand(-10.0f, 10.0f), glm::linearRand(0.2f, 2.0f), glm::linearRand(-10.0f, 10.0f));
+        glm::vec3 colour = glm::linearRand(glm::vec3(0.2f), glm::vec3(1.0f));
+        if (i % 4 == 0)
+            lights.addSpotLight(position, glm::vec3(0.0f, -1.0f, 0.0f), colour, 1.0f, 2.0f, 60.0f, std::cos(Maths::radians(30.0f)));
+        else
+            lights.addPointLight(position, colour, 1.0f, 2.0f, 60.0f);
+    }
+}
+
+//Draw a grid of small teapots just in front of the camera's starting position
+void submitTeapots(Renderer& renderer, Model& teapot, int count)
+{
+    int side = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(count))));
+    for (int i = 0; i < count; i++)
+    {
+        glm::vec3 position = glm::vec3(0.02f * (i % side - 0.5f * (side - 1)), 0.02f * (i / side - 0.5f * (side - 1)), 4.5f);
+        renderer.submit(teapot, Maths::translate(position) * Maths::scale(glm::vec3(0.005f)));
+    }
+}
+
+//Sample the keys the simulation reads, and the heading the camera had in the last frame
+Input sampleInput(GLFWwindow* window)
+{
+    const int keys[] = { GLFW_KEY_W, GLFW_KEY_S, GLFW_KEY_A, GLFW_KEY_D, GLFW_KEY_LEFT_SHIFT, GLFW_KEY_SPACE, GLFW_KEY_U };
+    Input input;
+    for (unsigned int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+    {
+        if (glfwGetKey(window, keys[i]) == GLFW_PRESS)
+            input.keys |= 1u << i;
+    }
+    input.front = camera.front;
+    input.right = camera.right;
+    input.time = glfwGetTime();
+    return input;
+}
+
+//Advance the game by one fixed step
+void simulate(Simulation& simulation)
+{
+    std::vector<Object>& objects = simulation.objects;
+    glm::vec3& eye = simulation.eye;
+    const Input& input = simulation.input;
+
+    //Ensure player can't float
+    eye.y = 0.0f;
+
+    keyboardInput(simulation);
+
+    for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
+    {
+        if (objects[i].name == "collisionBox")
+        {
+            objects[i].position = glm::vec3(eye.x, eye.y - 0.6f, eye.z); //Check if player is centralised
+            positionVector = objects[i].position;
+            if (eye.x >= -0.9f && eye.x <= 0.9f &&
+                eye.z >= -0.9f && eye.z <= 0.9f)
+            {
+                centralised = true;
+            }
+            else
+            {
+                centralised = false;
+            }
+            loggedYPos = objects[i].position.y * jumpPower; //Grab current Y position
+        }
+        if (objects[i].name == "obelisk")
+        {
+            if (objects[i].position.x + 2.5f > eye.x && //Check if player is close
+                objects[i].position.x - 2.5f < eye.x &&
+                objects[i].position.z + 2.5f > eye.z &&
+                objects[i].position.z - 2.5f < eye.z)
+            {
+
+                if (objects[i].position.y < 3)
+                {
+                    objects[i].position = glm::vec3(objects[i].position.x, objects[i].position.y += 0.005f, objects[i].position.z);
+                }
+            }
+            else if (objects[i].position.y > 0)
+            {
+                objects[i].position.y = objects[i].position.y - 0.005f;
+            }
+        }
+        if (objects[i].name == "platform")
+        {
+            //U - the platform comes loose from its static batch and bobs up and down
+            if (objects[i].isStatic && (input.keys & keyLoosen))
+            {
+                objects[i].isStatic = false;
+                simulation.looseStep = simulation.steps;
+                simulation.platformHeight = objects[i].position.y;
+            }
+            if (!objects[i].isStatic)
+            {
+                float bob = 2.0f * stepTime * (simulation.steps - simulation.looseStep);
+                objects[i].position.y = simulation.platformHeight + 0.1f * (1.0f - std::cos(bob));
+            }
+
+            if ((objects[i].position.x + 1.2f > eye.x && //Check if player is colliding with platform
+                objects[i].position.x - 1.2f < eye.x &&
+                objects[i].position.z + 1.2f > eye.z &&
+                objects[i].position.z - 1.2f < eye.z) && eye.y <= 1.2f)
+            {
+                if (upPressed == 1) {
+                    eye -= input.front * 0.01f;
+                }
+                if (downPressed == 1) {
+                    eye += input.front * 0.01f;
+                }
+                if (leftPressed == 1) {
+                    eye += input.right * 0.01f;
+                }
+                if (rightPressed == 1) {
+                    eye -= input.right * 0.01f;
+                }
+            }
+        }
+    }
+
+    if (centralised == true) {
+        simulation.lights.activated();
+    }
+    else
+    {
+        simulation.lights.deactivated();
+    }
+}
+
+//Take a step due at a time, moving the current state to the previous one
+void step(Simulation& simulation, Snapshot& snapshot, double due)
+{
+    simulate(simulation);
+    simulation.steps++;
+    std::swap(snapshot.previous, snapshot.current);
+    saveState(snapshot.current, simulation);
+    snapshot.time = due;
+    snapshot.inputTime = simulation.input.time;
+    snapshot.steps = simulation.steps;
+}
+
+//Store the simulated state
+void saveState(SimulationState& state, const Simulation& simulation)
+{
+    state.eye = simulation.eye;
+    state.objectPositions.resize(simulation.objects.size());
+    state.objectStatic.resize(simulation.objects.size());
+    for (unsigned int i = 0; i < static_cast<unsigned int>(simulation.objects.size()); i++)
+    {
+        state.objectPositions[i] = simulation.objects[i].position;
+        state.objectStatic[i] = simulation.objects[i].isStatic;
+    }
+    state.lights = simulation.lights.lightSources;
+}
+
+//Put the state at a time between the snapshot's two steps into the scene that is drawn (unmoved positions come
+//out exactly the same, and the lights keep their shadows)
+void applySnapshot(const Snapshot& snapshot, double time, std::vector<Object>& objects, Light& lights)
+{
+    const SimulationState& previous = snapshot.previous;
+    const SimulationState& current = snapshot.current;
+    float alpha = std::max(0.0f, std::min(static_cast<float>((time - snapshot.time) / stepTime), 1.0f));
+    camera.eye = previous.eye + (current.eye - previous.eye) * alpha;
+    for (unsigned int i = 0; i < static_cast<unsigned int>(objects.size()); i++)
+        objects[i].position = previous.objectPositions[i] + (current.objectPositions[i] - previous.objectPositions[i]) * alpha;
+    for (unsigned int i = 0; i < static_cast<unsigned int>(lights.lightSources.size()); i++)
+    {
+        LightSource& light = lights.lightSources[i];
+        light.position = previous.lights[i].position + (current.lights[i].position - previous.lights[i].position) * alpha;
+        light.colour = current.lights[i].colour;
+        light.linear = current.lights[i].linear;
+        light.range = current.lights[i].range;
+    }
+}
+
+//Simulation thread: take each step when it is due with the newest input, publishing a snapshot after each,
+//until told to stop
+void simulationLoop(Simulation& simulation, Snapshot snapshot, TripleBuffer<Input>& inputs,
+    TripleBuffer<Snapshot>& snapshots, const std::atomic<bool>& stop)
+{
+    double due = snapshot.time + stepTime;
+    while (!stop)
+    {
+        //Drop the time the thread could not keep up with, as the main thread does
+        double time = glfwGetTime();
+        due = std::max(due, time - maxSteps * stepTime);
+        if (time < due)
+        {
+            std::this_thread::sleep_for(std::chrono::duration<double>(due - time));
+            continue;
+        }
+
+        if (inputs.update())
+            simulation.input = inputs.front();
+        step(simulation, snapshot, due);
+        snapshots.back() = snapshot;
+        snapshots.publish();
+        due += stepTime;
+    }
+}
+
+//Move the player with the keys in the simulation's input
+void keyboardInput(Simulation& simulation)
+{
+    glm::vec3& eye = simulation.eye;
+    const Input& input = simulation.input;
     float speed = 1;
 
-    if (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS)
+    if (input.keys & keySprint)
         speed = 5;
     else speed = 1;
 
     //Move the camera using WSAD keys
 
     //W - FORWARDS
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
+    if (input.keys & keyForward)
     {
         if (!downPressed) {
-            camera.eye += 2.0f * deltaTime * camera.front * speed; //value controls speed of camera
+            eye += 2.0f * stepTime * input.front * speed; //value controls speed of camera
             upPressed = 1;
         }
         lastPressed = 0;
@@ -416,10 +1490,10 @@ void keyboardInput(GLFWwindow* window)
     }
 
     //S - BACKWARDS
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+    if (input.keys & keyBack)
     {
         if (!upPressed) {
-            camera.eye -= 2.0f * deltaTime * camera.front * speed;
+            eye -= 2.0f * stepTime * input.front * speed;
             downPressed = 1;
         }
         lastPressed = 1;
@@ -429,9 +1503,9 @@ void keyboardInput(GLFWwindow* window)
     }
 
     //A - LEFT
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+    if (input.keys & keyLeft)
     {
-        camera.eye -= 2.0f * deltaTime * camera.right * speed;
+        eye -= 2.0f * stepTime * input.right * speed;
         leftPressed = 1;
         lastPressed = 2;
     }
@@ -440,9 +1514,9 @@ void keyboardInput(GLFWwindow* window)
     }
 
     //D - RIGHT
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
+    if (input.keys & keyRight)
     {
-        camera.eye += 2.0f * deltaTime * camera.right * speed;
+        eye += 2.0f * stepTime * input.right * speed;
         rightPressed = 1;
         lastPressed = 3;
     }
@@ -450,16 +1524,10 @@ void keyboardInput(GLFWwindow* window)
         rightPressed = 0;
     }
 
-    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS)
-        useThirdPerson = 0;
-
-    if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS)
-        useThirdPerson = 1;
-
     //SPACE - JUMP
-    if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS)
+    if (input.keys & keyJump)
         if (hasJumped == false) {
-            startJumpHeight = camera.eye.y;
+            startJumpHeight = eye.y;
             hasJumped = true;
         }
 
@@ -467,9 +1535,9 @@ void keyboardInput(GLFWwindow* window)
     {
         jumpLength = jumpLength + 0.0025f;
         jumpPower = sin(jumpLength);
-        camera.eye.y = 0.8f + jumpPower;
+        eye.y = 0.8f + jumpPower;
 
-        if (camera.eye.y <= startJumpHeight)
+        if (eye.y <= startJumpHeight)
         {
             hasJumped = false;
             jumpLength = 0;
@@ -477,6 +1545,30 @@ void keyboardInput(GLFWwindow* window)
     }
 }
 
+//Check for keys that change how the scene is drawn
+void settingsInput(GLFWwindow* window)
+{
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, true);
+
+    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS)
+        useThirdPerson = 0;
+
+    if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS)
+        useThirdPerson = 1;
+
+    //P - TOGGLE THE DEPTH PRE-PASS
+    if (glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS)
+    {
+        if (!prepassPressed)
+            depthPrepass = !depthPrepass;
+        prepassPressed = 1;
+    }
+    else {
+        prepassPressed = 0;
+    }
+}
+
 //Check for mouse input
 void mouseInput(GLFWwindow* window)
 {
@@ -0,0 +1,124 @@
+#version 430 core
+
+layout(local_size_x = 64) in;
+
+// Indirect draw command
+struct DrawCommand
+{
+    uint count;
+    uint instanceCount;
+    uint firstIndex;
+    int baseVertex;
+    uint baseInstance;
+};
+
+// Object space box of a draw and where its batch's commands start
+struct CullInput
+{
+    vec4 centre;
+    vec4 extent;
+    uint transformIndex;
+    uint batch;
+    uint batchFirst;
+    uint padding;
+};
+
+// Buffers
+layout(std430, binding = 0) readonly buffer Candidates { DrawCommand candidates[]; };
+layout(std430, binding = 1) readonly buffer Inputs { CullInput inputs[]; };
+layout(std430, binding = 2) writeonly buffer Commands { DrawCommand commands[]; };
+layout(std430, binding = 3) buffer Counts { uint counts[]; };
+
+// Uniforms
+uniform uint drawCount;
+uniform vec4 planes[6];
+uniform samplerBuffer transformBuffer;
+
+// Previous frame's depth pyramid and the matrix it was drawn with
+uniform bool useHiZ;
+uniform sampler2D hiZ;
+uniform mat4 hiZViewProjection;
+uniform int hiZLevels;
+
+bool occluded(vec3 centre, vec3 extent)
+{
+    // Screen rectangle and nearest depth of the box's corners
+    ivec2 size = textureSize(hiZ, 0);
+    vec2 lo = vec2(1e30);
+    vec2 hi = vec2(-1e30);
+    float nearest = 1e30;
+    for (int i = 0; i < 8; i++)
+    {
+        vec3 corner = centre + extent * vec3((i & 1) != 0 ? 1.0 : -1.0,
+                                             (i & 2) != 0 ? 1.0 : -1.0,
+                                             (i & 4) != 0 ? 1.0 : -1.0);
+        vec4 clip = hiZViewProjection * vec4(corner, 1.0);
+
+        // Boxes crossing the near plane are treated as visible
+        if (clip.w < 1e-4 || clip.z < -clip.w)
+            return false;
+        vec3 ndc = clip.xyz / clip.w;
+        vec2 screen = (ndc.xy * 0.5 + 0.5) * vec2(size);
+        lo = min(lo, screen);
+        hi = max(hi, screen);
+        nearest = min(nearest, ndc.z * 0.5 + 0.5);
+    }
+
+    // Off screen boxes are left to the frustum test
+    ivec2 p0 = max(ivec2(0), ivec2(floor(lo)));
+    ivec2 p1 = min(size - 1, ivec2(hi));
+    if (any(greaterThan(p0, p1)))
+        return false;
+
+    // Pick the level where the rectangle covers at most 2x2 texels
+    int level = 0;
+    while (level + 1 < hiZLevels && any(greaterThan((p1 >> level) - (p0 >> level), ivec2(1))))
+        level++;
+
+    ivec2 levelSize = textureSize(hiZ, level);
+    ivec2 t0 = min(p0 >> level, levelSize - 1);
+    ivec2 t1 = min(p1 >> level, levelSize - 1);
+    float farthest = 0.0;
+    for (int y = t0.y; y <= t1.y; y++)
+    {
+        for (int x = t0.x; x <= t1.x; x++)
+            farthest = max(farthest, texelFetch(hiZ, ivec2(x, y), level).r);
+    }
+    return nearest > farthest;
+}
+
+void main()
+{
+    uint i = gl_GlobalInvocationID.x;
+    if (i >= drawCount)
+        return;
+
+    // Fetch the model matrix and move the box into world space
+    int m = int(inputs[i].transformIndex) * 4;
+    mat4 M = mat4(texelFetch(transformBuffer, m),
+                  texelFetch(transformBuffer, m + 1),
+                  texelFetch(transformBuffer, m + 2),
+                  texelFetch(transformBuffer, m + 3));
+    vec3 localExtent = inputs[i].extent.xyz;
+    vec3 centre = vec3(M * vec4(inputs[i].centre.xyz, 1.0));
+    vec3 extent;
+    for (int j = 0; j < 3; j++)
+        extent[j] = abs(M[0][j]) * localExtent.x + abs(M[1][j]) * localExtent.y + abs(M[2][j]) * localExtent.z;
+
+    // Frustum test, the same as the CPU path
+    for (int p = 0; p < 6; p++)
+    {
+        float distance = dot(planes[p].xyz, centre) + planes[p].w;
+        float radius = dot(abs(planes[p].xyz), extent);
+        if (distance + radius < 0.0)
+            return;
+    }
+
+    if (useHiZ && occluded(centre, extent))
+        return;
+
+    // Append to the batch's commands
+    uint batch = inputs[i].batch;
+    uint slot = atomicAdd(counts[batch], 1u);
+    commands[inputs[i].batchFirst + slot] = candidates[i];
+}
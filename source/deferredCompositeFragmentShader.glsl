@@ -0,0 +1,16 @@
+#version 330 core
+
+// Outputs
+out vec3 fragmentColour;
+
+// Uniforms
+uniform sampler2D accumulationBuffer;
+uniform sampler2D depthBuffer;
+
+void main()
+{
+    // Copy the summed lighting and the G-buffer depth into the window
+    ivec2 pixel    = ivec2(gl_FragCoord.xy);
+    fragmentColour = texelFetch(accumulationBuffer, pixel, 0).rgb;
+    gl_FragDepth   = texelFetch(depthBuffer, pixel, 0).r;
+}
@@ -0,0 +1,70 @@
+#version 330 core
+
+// Inputs
+flat in int lightIndex;
+
+// Outputs
+out vec3 fragmentColour;
+
+// Uniforms
+uniform mat4 inverseP;
+uniform sampler2D albedoBuffer;
+uniform sampler2D normalBuffer;
+uniform sampler2D specularBuffer;
+uniform sampler2D depthBuffer;
+#include "lightBuffer.glsl"
+#include "shadows.glsl"
+#include "lighting.glsl"
+
+void main()
+{
+    // Skip pixels nothing was drawn to
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(depthBuffer, pixel, 0).r;
+    if (depth == 1.0)
+        discard;
+
+    // Read the G-buffer and rebuild the view space position from the depth
+    vec4 albedo       = texelFetch(albedoBuffer, pixel, 0);
+    vec4 normalKd     = texelFetch(normalBuffer, pixel, 0);
+    vec4 specularNs   = texelFetch(specularBuffer, pixel, 0);
+    vec2 ndc          = gl_FragCoord.xy / vec2(textureSize(depthBuffer, 0)) * 2.0 - 1.0;
+    vec4 position     = inverseP * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+    vec3 fragmentPosition = position.xyz / position.w;
+
+    vec3 objectColour = albedo.rgb;
+    vec3 normal       = normalize(normalKd.xyz);
+    float ka          = albedo.a;
+    float kd          = normalKd.a;
+    float Ns          = specularNs.a;
+
+    // Light properties
+    LightData data      = fetchLight(lightIndex);
+    vec3 lightDirection = data.direction;
+    vec3 attenuation    = data.attenuation;
+    vec3 lightColour    = data.colour;
+    int type            = data.type;
+
+    // Direction to the light, and attenuation for point and spot lights
+    vec3 light;
+    float intensity = 1.0;
+    if (type == 3)
+    {
+        light = normalize(-lightDirection);
+    }
+    else
+    {
+        light = normalize(data.position - fragmentPosition);
+        intensity = attenuationFactor(attenuation, length(data.position - fragmentPosition));
+    }
+
+    // Spotlight cone
+    if (type == 2)
+        intensity *= spotFactor(light, lightDirection, data.cosPhi);
+
+    // Only the ambient reaches shadowed surfaces
+    float shadow   = type == 1 ? pointShadowFactor(data.shadow, fragmentPosition) :
+                                 shadowFactor(data.shadow, fragmentPosition);
+    fragmentColour = phong(light, normal, fragmentPosition, lightColour,
+                           objectColour, ka, kd, specularNs.rgb, Ns, shadow) * intensity;
+}
@@ -0,0 +1,47 @@
+#version 330 core
+
+// Inputs (unit volume, unused by the full-screen triangle)
+layout(location = 0) in vec3 position;
+
+// Outputs
+flat out int lightIndex;
+
+// Uniforms
+uniform int volume;        // 0 full-screen triangle, 1 sphere, 2 cone
+uniform int firstLight;
+uniform mat4 P;
+#include "lightBuffer.glsl"
+
+void main()
+{
+    // One instance per light
+    lightIndex = firstLight + gl_InstanceID;
+
+    // Full-screen triangle from the vertex ID
+    if (volume == 0)
+    {
+        gl_Position = vec4((gl_VertexID & 1) * 4 - 1, (gl_VertexID & 2) * 2 - 1, 0.0, 1.0);
+        return;
+    }
+
+    // Light position, direction and range
+    LightData light = fetchLight(lightIndex);
+    float cosPhi    = light.cosPhi;
+    float range     = light.range;
+
+    // Scale the unit sphere to the range, or point the cone along the spot direction
+    vec3 viewPosition;
+    if (volume == 1)
+    {
+        viewPosition = light.position + position * range;
+    }
+    else
+    {
+        vec3 axis    = normalize(light.direction);
+        vec3 side    = normalize(cross(abs(axis.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0), axis));
+        vec3 up      = cross(axis, side);
+        float radius = range * sqrt(1.0 - cosPhi * cosPhi) / cosPhi;
+        viewPosition = light.position + (side * position.x + up * position.y) * radius + axis * position.z * range;
+    }
+    gl_Position = P * vec4(viewPosition, 1.0);
+}
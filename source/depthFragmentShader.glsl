@@ -0,0 +1,6 @@
+#version 330 core
+
+// Depth only, colour writes are off during the pre-pass
+void main()
+{
+}
@@ -0,0 +1,20 @@
+#version 330 core
+
+// Inputs
+layout(location = 0) in vec3 position;
+
+// Per-draw data (only the transform index is used)
+layout(location = 5) in uvec4 drawData;
+
+// Uniforms
+uniform mat4 V;
+uniform mat4 P;
+#include "drawTransform.glsl"
+
+void main()
+{
+    // Same expression as vertexShader.glsl, so the depths match exactly
+    mat4 MV  = V * drawTransform(drawData.x);
+    mat4 MVP = P * MV;
+    gl_Position = MVP * vec4(position, 1.0);
+}
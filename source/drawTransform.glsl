@@ -0,0 +1,15 @@
+// Model matrix of each draw, four texels per matrix
+uniform samplerBuffer transformBuffer;
+
+// Passes that depth test GL_EQUAL against each other's depth (the depth
+// pre-pass and the shading passes) must produce exactly the same positions
+invariant gl_Position;
+
+mat4 drawTransform(uint transformIndex)
+{
+    int m = int(transformIndex) * 4;
+    return mat4(texelFetch(transformBuffer, m),
+                texelFetch(transformBuffer, m + 1),
+                texelFetch(transformBuffer, m + 2),
+                texelFetch(transformBuffer, m + 3));
+}
@@ -1,31 +1,32 @@
 #version 330 core
 
-# define maxLights 10
+// Features, all on unless this is a specialised variant (see ShaderVariants)
+#ifndef NUM_POINT_LIGHTS
+#define HAS_NORMAL_MAP
+#define HAS_SPECULAR_MAP
+#define NUM_POINT_LIGHTS 1
+#define NUM_SPOT_LIGHTS 1
+#endif
 
 // Inputs
 in vec2 UV;
 in vec3 fragmentPosition;
 
-// in vec3 Normal;
-in vec3 tangentSpaceLightPosition[maxLights];
-in vec3 tangentSpaceLightDirection[maxLights];
+// Material properties
+flat in float ka;
+flat in float kd;
+flat in float ks;
+flat in float Ns;
+
+// Tangent space to view space
+in mat3 TBN;
+
+// This object's light list
+flat in uvec2 lightList;
 
 // Outputs
 out vec3 fragmentColour;
 
-// Light struct
-struct Light
-{
-    vec3 position;
-    vec3 colour;
-    vec3 direction;
-    float constant;
-    float linear;
-    float quadratic;
-    float cosPhi;
-    int type;
-};
-
 // Uniforms
 
 uniform sampler2D diffuseMap;
@@ -34,159 +35,141 @@ uniform sampler2D normalMap;
 
 uniform sampler2D specularMap;
 
-uniform float ka;
-uniform float kd;
-uniform float ks;
-uniform float Ns;
-uniform Light lightSources[maxLights];
+// Lights (directional lights first) and the clusters' light lists
+#include "lightBuffer.glsl"
+#include "shadows.glsl"
+#include "lighting.glsl"
+uniform usamplerBuffer clusterBuffer;
+uniform usamplerBuffer lightIndexBuffer;
+uniform int numDirectionalLights;
+
+// Cluster grid, tiles per pixel and the depth to slice mapping
+uniform ivec3 clusterGrid;
+uniform vec2 clusterTileScale;
+uniform float sliceScale;
+uniform float sliceBias;
+
+// Per-object light lists, used instead of the clusters when set
+uniform bool objectLights;
+uniform usamplerBuffer objectLightBuffer;
+
+// Surface properties, read once per fragment
+vec3 objectColour;
+vec3 specularColour;
+vec3 Normal;
 
 // Function prototypes
 vec3 pointLight(vec3 lightPosition, vec3 lightColour,
-                float constant, float linear, float quadratic);
+                float constant, float linear, float quadratic, float shadow);
 
 vec3 spotLight(vec3 lightPosition, vec3 direction, vec3 lightColour,
-               float cosPhi, float constant, float linear, float quadratic);
+               float cosPhi, float constant, float linear, float quadratic, float shadow);
 
-vec3 directionalLight(vec3 lightDirection, vec3 lightColour);
+vec3 directionalLight(vec3 lightDirection, vec3 lightColour, float shadow);
 
-// Get the normal vector from the normal map
-vec3 Normal = normalize(2.0 * vec3(texture(normalMap, UV)) - 1.0);
+// Add a point or spot light's contribution to the fragment colour
+void addLight(int i)
+{
+    // Determine light properties for current light source
+    LightData light = fetchLight(i);
+
+    // Only branch on the type when the scene has both
+#if NUM_POINT_LIGHTS > 0 && NUM_SPOT_LIGHTS > 0
+    if (light.type == 1)
+#endif
+#if NUM_POINT_LIGHTS > 0
+        fragmentColour += pointLight(light.position, light.colour,
+                                     light.attenuation.x, light.attenuation.y, light.attenuation.z,
+                                     pointShadowFactor(light.shadow, fragmentPosition));
+#endif
+#if NUM_POINT_LIGHTS > 0 && NUM_SPOT_LIGHTS > 0
+    else
+#endif
+#if NUM_SPOT_LIGHTS > 0
+        fragmentColour += spotLight(light.position, light.direction, light.colour,
+                                    light.cosPhi, light.attenuation.x, light.attenuation.y, light.attenuation.z,
+                                    shadowFactor(light.shadow, fragmentPosition));
+#endif
+}
 
 void main ()
 {
     fragmentColour = vec3(0.0, 0.0, 0.0);
-    for (int i = 0; i < maxLights; i++)
+
+    // Read the textures once rather than once per light
+    objectColour = vec3(texture(diffuseMap, UV));
+#ifdef HAS_SPECULAR_MAP
+    specularColour = vec3(texture(specularMap, UV));
+#else
+    specularColour = vec3(1.0);
+#endif
+
+    // Get the normal vector from the normal map, in view space
+#ifdef HAS_NORMAL_MAP
+    Normal = normalize(TBN * (2.0 * vec3(texture(normalMap, UV)) - 1.0));
+#else
+    Normal = normalize(TBN[2]);
+#endif
+
+    // Directional lights reach every fragment
+#ifdef NUM_DIR_LIGHTS
+    for (int i = 0; i < NUM_DIR_LIGHTS; i++)
+#else
+    for (int i = 0; i < numDirectionalLights; i++)
+#endif
     {
-        // Determine light properties for current light source
-        //vec3 lightPosition  = lightSources[i].position;
-
-        vec3 lightPosition  = tangentSpaceLightPosition[i];
-
-        vec3 lightColour    = lightSources[i].colour;
-        //vec3 lightDirection = lightSources[i].direction;
-
-        vec3 lightDirection = tangentSpaceLightDirection[i];
-
-        float constant      = lightSources[i].constant;
-        float linear        = lightSources[i].linear;
-        float quadratic     = lightSources[i].quadratic;
-        float cosPhi        = lightSources[i].cosPhi;
-        
-        // Calculate point light
-        if (lightSources[i].type == 1)
-            fragmentColour += pointLight(lightPosition, lightColour,
-                                         constant, linear, quadratic);
-        
-        // Calculate spotlight
-        if (lightSources[i].type == 2)
-            fragmentColour += spotLight(lightPosition, lightDirection, lightColour,
-                                        cosPhi, constant, linear, quadratic);
-           
-        // Calculate directional light
-        if (lightSources[i].type == 3)
-            fragmentColour += directionalLight(lightDirection, lightColour);
+        LightData light = fetchLight(i);
+        fragmentColour += directionalLight(light.direction, light.colour,
+                                           shadowFactor(light.shadow, fragmentPosition));
     }
+
+    // Loop over the lights picked for this object
+    if (objectLights)
+    {
+        for (uint j = 0u; j < lightList.y; j++)
+            addLight(int(texelFetch(objectLightBuffer, int(lightList.x + j)).r));
+        return;
+    }
+
+    // Find the fragment's cluster from its tile and view space depth
+    ivec2 tile = min(ivec2(gl_FragCoord.xy * clusterTileScale), clusterGrid.xy - 1);
+    int slice  = clamp(int(log(-fragmentPosition.z) * sliceScale + sliceBias), 0, clusterGrid.z - 1);
+    int cluster = (slice * clusterGrid.y + tile.y) * clusterGrid.x + tile.x;
+
+    // Loop over the lights binned into it
+    uvec2 range = texelFetch(clusterBuffer, cluster).xy;
+    for (uint j = 0u; j < range.y; j++)
+        addLight(int(texelFetch(lightIndexBuffer, int(range.x + j)).r));
 }
 
 // Calculate point light
 vec3 pointLight(vec3 lightPosition, vec3 lightColour,
-                float constant, float linear, float quadratic)
+                float constant, float linear, float quadratic, float shadow)
 {
-    // Object colour
-    vec3 objectColour = vec3(texture(diffuseMap, UV));
-    
-    // Ambient reflection
-    vec3 ambient = ka * objectColour;
-    
-    // Diffuse reflection
-    vec3 light      = normalize(lightPosition - fragmentPosition);
-    vec3 normal     = normalize(Normal);
-    float cosTheta  = max(dot(normal, light), 0);
-    vec3 diffuse    = kd * lightColour * objectColour * cosTheta;
-    
-    // Specular reflection
-    vec3 reflection = - light + 2 * dot(light, normal) * normal;
-    vec3 camera     = normalize(-fragmentPosition);
-    float cosAlpha  = max(dot(camera, reflection), 0);
-    //vec3 specular   = ks * lightColour * pow(cosAlpha, Ns);
-
-    vec3 specular   = ks * lightColour * pow(cosAlpha, Ns) * vec3(texture(specularMap, UV));
-    
-    // Attenuation
-    float distance    = length(lightPosition - fragmentPosition);
-    float attenuation = 1.0 / (constant + linear * distance +
-                               quadratic * distance * distance);
-    
-    // Fragment colour
-    return (ambient + diffuse + specular) * attenuation;
+    vec3 light     = normalize(lightPosition - fragmentPosition);
+    float distance = length(lightPosition - fragmentPosition);
+
+    return phong(light, normalize(Normal), fragmentPosition, lightColour,
+                 objectColour, ka, kd, ks * specularColour, Ns, shadow) *
+           attenuationFactor(vec3(constant, linear, quadratic), distance);
 }
 
 // Calculate spotlight
 vec3 spotLight(vec3 lightPosition, vec3 lightDirection, vec3 lightColour,
-               float cosPhi, float constant, float linear, float quadratic)
+               float cosPhi, float constant, float linear, float quadratic, float shadow)
 {
-    // Object colour
-    vec3 objectColour = vec3(texture(diffuseMap, UV));
-    
-    // Ambient reflection
-    vec3 ambient = ka * objectColour;
-    
-    // Diffuse reflection
-    vec3 light      = normalize(lightPosition - fragmentPosition);
-    vec3 normal     = normalize(Normal);
-    float cosTheta  = max(dot(normal, light), 0);
-    vec3 diffuse    = kd * lightColour * objectColour * cosTheta;
-    
-    // Specular reflection
-    vec3 reflection = - light + 2 * dot(light, normal) * normal;
-    vec3 camera     = normalize(-fragmentPosition);
-    float cosAlpha  = max(dot(camera, reflection), 0);
-    //vec3 specular   = ks * lightColour * pow(cosAlpha, Ns);
-
-    vec3 specular   = ks * lightColour * pow(cosAlpha, Ns) * vec3(texture(specularMap, UV));
-    
-    // Attenuation
-    float distance    = length(lightPosition - fragmentPosition);
-    float attenuation = 1.0 / (constant + linear * distance +
-                               quadratic * distance * distance);
-    
-    // Directional light intensity
-    vec3 direction  = normalize(lightDirection);
-    cosTheta        = dot(-light, direction);
-    //float intensity = 0.0;
-    //if (cosTheta > cosPhi)
-    //    intensity = 1.0;
-    float delta     = radians(2.0);
-    float intensity = clamp((cosTheta - cosPhi) / delta, 0.0, 1.0);
-    
-    // Return fragment colour
-    return (ambient + diffuse + specular) * attenuation * intensity;
+    vec3 light     = normalize(lightPosition - fragmentPosition);
+    float distance = length(lightPosition - fragmentPosition);
+
+    return phong(light, normalize(Normal), fragmentPosition, lightColour,
+                 objectColour, ka, kd, ks * specularColour, Ns, shadow) *
+           attenuationFactor(vec3(constant, linear, quadratic), distance) *
+           spotFactor(light, lightDirection, cosPhi);
 }
 
 // Calculate directional light
-vec3 directionalLight(vec3 lightDirection, vec3 lightColour)
+vec3 directionalLight(vec3 lightDirection, vec3 lightColour, float shadow)
 {
-    // Object colour
-    vec3 objectColour = vec3(texture(diffuseMap, UV));
-    
-    // Ambient reflection
-    vec3 ambient = ka * objectColour;
-    
-    // Diffuse reflection
-    vec3 light     = normalize(-lightDirection);
-    vec3 normal    = normalize(Normal);
-    float cosTheta = max(dot(normal, light), 0);
-    vec3 diffuse   = kd * lightColour * objectColour * cosTheta;
-    
-    // Specular reflection
-    vec3 reflection = - light + 2 * dot(light, normal) * normal;
-    vec3 camera     = normalize(-fragmentPosition);
-    float cosAlpha  = max(dot(camera, reflection), 0);
-    //vec3 specular   = ks * lightColour * pow(cosAlpha, Ns);
-
-    vec3 specular   = ks * lightColour * pow(cosAlpha, Ns) * vec3(texture(specularMap, UV));
-    
-    // Return fragment colour
-    return ambient + diffuse + specular;
+    return phong(normalize(-lightDirection), normalize(Normal), fragmentPosition, lightColour,
+                 objectColour, ka, kd, ks * specularColour, Ns, shadow);
 }
-//
\ No newline at end of file
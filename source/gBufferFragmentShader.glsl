@@ -0,0 +1,31 @@
+#version 330 core
+
+// Inputs
+in vec2 UV;
+in vec3 fragmentPosition;
+
+// Material properties
+flat in float ka;
+flat in float kd;
+flat in float ks;
+flat in float Ns;
+
+// Tangent space to view space
+in mat3 TBN;
+
+// Outputs (albedo and ambient, view space normal and diffuse, specular and shininess)
+layout(location = 0) out vec4 albedo;
+layout(location = 1) out vec4 normal;
+layout(location = 2) out vec4 specular;
+
+// Uniforms
+uniform sampler2D diffuseMap;
+uniform sampler2D normalMap;
+uniform sampler2D specularMap;
+
+void main()
+{
+    albedo   = vec4(vec3(texture(diffuseMap, UV)), ka);
+    normal   = vec4(normalize(TBN * (2.0 * vec3(texture(normalMap, UV)) - 1.0)), kd);
+    specular = vec4(ks * vec3(texture(specularMap, UV)), Ns);
+}
@@ -0,0 +1,16 @@
+#version 330 core
+
+// Inputs
+flat in vec3 gizmoColour;
+in vec2 corner;
+
+// Outputs
+out vec3 colour;
+
+void main ()
+{
+    // Cut the impostor's square down to the sphere's outline
+    if (dot(corner, corner) > 1.0)
+        discard;
+    colour = gizmoColour;
+}
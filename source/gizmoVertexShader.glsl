@@ -0,0 +1,37 @@
+#version 330 core
+
+// Inputs (only read for the sphere)
+layout(location = 0) in vec3 position;
+
+// Outputs
+flat out vec3 gizmoColour;
+out vec2 corner;
+
+// Uniforms
+uniform mat4 V;
+uniform mat4 P;
+uniform samplerBuffer gizmoBuffer;
+uniform int firstGizmo;
+uniform bool impostor;
+uniform float modelRadius;
+
+void main()
+{
+    // Two texels per gizmo: world position and scale, then colour
+    int gizmo        = firstGizmo + gl_InstanceID;
+    vec4 centreScale = texelFetch(gizmoBuffer, 2 * gizmo);
+    gizmoColour      = texelFetch(gizmoBuffer, 2 * gizmo + 1).rgb;
+    vec3 centre      = vec3(V * vec4(centreScale.xyz, 1.0));
+
+    // Small gizmos are a camera facing square cut down to a circle, built from the vertex id
+    if (impostor)
+    {
+        corner      = vec2(gl_VertexID & 1, gl_VertexID >> 1) * 2.0 - 1.0;
+        gl_Position = P * vec4(centre + vec3(corner * modelRadius * centreScale.w, 0.0), 1.0);
+    }
+    else
+    {
+        corner      = vec2(0.0);
+        gl_Position = P * vec4(centre + mat3(V) * position * centreScale.w, 1.0);
+    }
+}
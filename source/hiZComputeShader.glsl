@@ -0,0 +1,44 @@
+#version 430 core
+
+layout(local_size_x = 8, local_size_y = 8) in;
+
+// Uniforms
+uniform int level;
+uniform sampler2D depthTexture;
+
+// Previous and current pyramid levels
+layout(r32f, binding = 0) uniform readonly image2D source;
+layout(r32f, binding = 1) uniform writeonly image2D destination;
+
+void main()
+{
+    ivec2 p = ivec2(gl_GlobalInvocationID.xy);
+    ivec2 size = imageSize(destination);
+    if (any(greaterThanEqual(p, size)))
+        return;
+
+    // Level 0 is a copy of the depth buffer
+    if (level == 0)
+    {
+        imageStore(destination, p, vec4(texelFetch(depthTexture, p, 0).r));
+        return;
+    }
+
+    // Farthest depth of the 2x2 block, plus the extra row or column left over from odd sizes
+    ivec2 sourceSize = imageSize(source);
+    ivec2 first = 2 * p;
+    ivec2 last = 2 * p + 1;
+    if (p.x == size.x - 1 && (sourceSize.x & 1) == 1)
+        last.x++;
+    if (p.y == size.y - 1 && (sourceSize.y & 1) == 1)
+        last.y++;
+    last = min(last, sourceSize - 1);
+
+    float farthest = 0.0;
+    for (int y = first.y; y <= last.y; y++)
+    {
+        for (int x = first.x; x <= last.x; x++)
+            farthest = max(farthest, imageLoad(source, ivec2(x, y)).r);
+    }
+    imageStore(destination, p, vec4(farthest));
+}
@@ -0,0 +1,36 @@
+// Light buffer layout shared by the forward and deferred shaders. Each light
+// is four texels: position and type, colour and cos(phi), direction and
+// shadow map layer (the atlas slot for point lights, -1 for none), and
+// attenuation with the range. Types are 1 point, 2 spot and 3 directional.
+uniform samplerBuffer lightBuffer;
+
+struct LightData
+{
+    vec3 position;
+    int type;
+    vec3 colour;
+    float cosPhi;
+    vec3 direction;
+    int shadow;
+    vec3 attenuation;
+    float range;
+};
+
+LightData fetchLight(int i)
+{
+    vec4 positionType = texelFetch(lightBuffer, 4 * i);
+    vec4 colourCosPhi = texelFetch(lightBuffer, 4 * i + 1);
+    vec4 directionShadow = texelFetch(lightBuffer, 4 * i + 2);
+    vec4 attenuation  = texelFetch(lightBuffer, 4 * i + 3);
+
+    LightData light;
+    light.position    = positionType.xyz;
+    light.type        = int(positionType.w);
+    light.colour      = colourCosPhi.rgb;
+    light.cosPhi      = colourCosPhi.a;
+    light.direction   = directionShadow.xyz;
+    light.shadow      = int(directionShadow.w);
+    light.attenuation = attenuation.xyz;
+    light.range       = attenuation.w;
+    return light;
+}
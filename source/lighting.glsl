@@ -0,0 +1,38 @@
+// Lighting model shared by the forward and deferred shaders. Vectors are in
+// view space, light points from the surface towards the light and specular
+// is the surface's specular colour already scaled by ks.
+
+// Distance falloff of point and spot lights
+float attenuationFactor(vec3 attenuation, float distance)
+{
+    return 1.0 / (attenuation.x + attenuation.y * distance +
+                  attenuation.z * distance * distance);
+}
+
+// Spotlight cone, softened over the 2 degrees inside its edge
+float spotFactor(vec3 light, vec3 lightDirection, float cosPhi)
+{
+    float cosTheta = dot(-light, normalize(lightDirection));
+    float delta    = radians(2.0);
+    return clamp((cosTheta - cosPhi) / delta, 0.0, 1.0);
+}
+
+// Phong reflection (only the ambient reaches shadowed surfaces)
+vec3 phong(vec3 light, vec3 normal, vec3 fragmentPosition, vec3 lightColour,
+           vec3 objectColour, float ka, float kd, vec3 specular, float Ns, float shadow)
+{
+    // Ambient reflection
+    vec3 ambient = ka * objectColour;
+
+    // Diffuse reflection
+    float cosTheta = max(dot(normal, light), 0);
+    vec3 diffuse   = kd * lightColour * objectColour * cosTheta;
+
+    // Specular reflection
+    vec3 reflection = - light + 2 * dot(light, normal) * normal;
+    vec3 camera     = normalize(-fragmentPosition);
+    float cosAlpha  = max(dot(camera, reflection), 0);
+    specular        = lightColour * pow(cosAlpha, Ns) * specular;
+
+    return ambient + (diffuse + specular) * shadow;
+}
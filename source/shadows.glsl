@@ -0,0 +1,100 @@
+// Shadow maps of the spot and directional lights, one layer each
+uniform sampler2DArrayShadow shadowMaps;
+
+// View space to map texture space for each layer
+uniform mat4 shadowMatrices[4];
+
+// PCF kernel radius in texels (0 for one bilinear comparison)
+uniform int shadowFilter;
+
+// Fraction of a light reaching a view space position, 1 for lights without a shadow map
+float shadowFactor(int layer, vec3 viewPosition)
+{
+    if (layer < 0)
+        return 1.0;
+
+    vec4 position = shadowMatrices[layer] * vec4(viewPosition, 1.0);
+    position.xyz /= position.w;
+    if (position.z >= 1.0)
+        return 1.0;
+
+    // Average a square of hardware comparisons, each one already filtered over 2x2 texels
+    vec2 texel = 1.0 / vec2(textureSize(shadowMaps, 0).xy);
+    float lit = 0.0;
+    for (int y = -shadowFilter; y <= shadowFilter; y++)
+    {
+        for (int x = -shadowFilter; x <= shadowFilter; x++)
+            lit += texture(shadowMaps, vec4(position.xy + vec2(x, y) * texel, float(layer), position.z));
+    }
+    float taps = float(2 * shadowFilter + 1);
+    return lit / (taps * taps);
+}
+
+// Atlas of cube faces for the point lights, six square tiles each
+uniform sampler2DShadow pointShadowAtlas;
+
+// Corner and size of each face's tile in atlas texture coordinates, in the order +X, -X, +Y, -Y, +Z, -Z
+uniform vec4 pointShadowTiles[48];
+
+// View space position each light's faces were drawn from, and their far plane
+uniform vec4 pointShadowLights[8];
+
+// View space to world axes, which the faces are aligned with
+uniform mat3 pointShadowRotation;
+
+// Fraction of a point light reaching a view space position, 1 for lights without faces in the atlas
+float pointShadowFactor(int slot, vec3 viewPosition)
+{
+    if (slot < 0)
+        return 1.0;
+
+    // Pick the face from the largest axis of the direction away from the light
+    vec4 light = pointShadowLights[slot];
+    vec3 away  = pointShadowRotation * (viewPosition - light.xyz);
+    vec3 size  = abs(away);
+    int face;
+    vec3 forward, up;
+    if (size.x >= size.y && size.x >= size.z)
+    {
+        face    = away.x > 0.0 ? 0 : 1;
+        forward = vec3(sign(away.x), 0.0, 0.0);
+        up      = vec3(0.0, -1.0, 0.0);
+    }
+    else if (size.y >= size.z)
+    {
+        face    = away.y > 0.0 ? 2 : 3;
+        forward = vec3(0.0, sign(away.y), 0.0);
+        up      = vec3(0.0, 0.0, sign(away.y));
+    }
+    else
+    {
+        face    = away.z > 0.0 ? 4 : 5;
+        forward = vec3(0.0, 0.0, sign(away.z));
+        up      = vec3(0.0, -1.0, 0.0);
+    }
+
+    // Project onto the face the same way as glm::lookAt and a 90 degree glm::perspective
+    float near     = 0.05;
+    float far      = light.w;
+    float distance = dot(forward, away);
+    if (distance >= far)
+        return 1.0;
+    vec3 right     = normalize(cross(forward, up));
+    vec2 uv        = vec2(dot(right, away), dot(cross(right, forward), away)) / distance * 0.5 + 0.5;
+    float depth    = 0.5 * ((far + near) - 2.0 * far * near / distance) / (far - near) + 0.5;
+
+    // Keep the taps inside the tile so they do not read the neighbouring faces
+    vec4 tile  = pointShadowTiles[6 * slot + face];
+    vec2 texel = 1.0 / vec2(textureSize(pointShadowAtlas, 0));
+    vec2 lower = tile.xy + texel;
+    vec2 upper = tile.xy + tile.z - texel;
+    vec2 centre = tile.xy + uv * tile.z;
+    float lit = 0.0;
+    for (int y = -shadowFilter; y <= shadowFilter; y++)
+    {
+        for (int x = -shadowFilter; x <= shadowFilter; x++)
+            lit += texture(pointShadowAtlas, vec3(clamp(centre + vec2(x, y) * texel, lower, upper), depth));
+    }
+    float taps = float(2 * shadowFilter + 1);
+    return lit / (taps * taps);
+}
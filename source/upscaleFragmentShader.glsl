@@ -0,0 +1,30 @@
+#version 330 core
+
+// Outputs
+out vec3 fragmentColour;
+
+// Uniforms
+uniform sampler2D scene;
+uniform vec2 drawnSize;     // pixels drawn in the lower left corner of the scene texture
+uniform float sharpness;    // unsharp mask strength, 0 for plain bilinear
+
+void main()
+{
+    // Map the window onto the part drawn, keeping the filter from reading past its edge
+    vec2 texel  = 1.0 / vec2(textureSize(scene, 0));
+    vec2 window = vec2(textureSize(scene, 0));
+    vec2 uv     = clamp(gl_FragCoord.xy / window * drawnSize, vec2(0.5), drawnSize - 0.5) * texel;
+    vec3 colour = texture(scene, uv).rgb;
+
+    // Push the colour away from the average of its neighbours
+    if (sharpness > 0.0)
+    {
+        vec2 lower = 0.5 * texel, upper = (drawnSize - 0.5) * texel;
+        vec3 blur  = texture(scene, clamp(uv + vec2(texel.x, 0.0), lower, upper)).rgb +
+                     texture(scene, clamp(uv - vec2(texel.x, 0.0), lower, upper)).rgb +
+                     texture(scene, clamp(uv + vec2(0.0, texel.y), lower, upper)).rgb +
+                     texture(scene, clamp(uv - vec2(0.0, texel.y), lower, upper)).rgb;
+        colour = max(colour + (colour - 0.25 * blur) * sharpness, 0.0);
+    }
+    fragmentColour = colour;
+}
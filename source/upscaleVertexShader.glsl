@@ -0,0 +1,7 @@
+#version 330 core
+
+void main()
+{
+    // Full-screen triangle from the vertex ID
+    gl_Position = vec4((gl_VertexID & 1) * 4 - 1, (gl_VertexID & 2) * 2 - 1, 0.0, 1.0);
+}
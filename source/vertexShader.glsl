@@ -1,7 +1,5 @@
 #version 330 core
 
-# define maxLights 10
-
 // Inputs
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec2 uv;
@@ -10,54 +8,62 @@ layout(location = 2) in vec3 normal;
 layout(location = 3) in vec3 tangent;
 layout(location = 4) in vec3 bitangent;
 
+// Per-draw data (transform index, material index, light list offset and length)
+layout(location = 5) in uvec4 drawData;
+
 // Outputs
 out vec3 fragmentPosition;
 out vec2 UV;
-out vec3 Normal;
+out mat3 TBN;
 
-out vec3 tangentSpaceLightPosition[maxLights];
-out vec3 tangentSpaceLightDirection[maxLights];
+// This object's light list
+flat out uvec2 lightList;
 
-// Light struct
-struct Light
-{
-    vec3 position;
-    vec3 colour;
-    vec3 direction;
-    float constant;
-    float linear;
-    float quadratic;
-    float cosPhi;
-    int type;
-};
+// Material properties
+flat out float ka;
+flat out float kd;
+flat out float ks;
+flat out float Ns;
 
 // Uniforms
-uniform mat4 MVP;
-uniform mat4 MV;
-
-uniform Light lightSources[maxLights];
+uniform mat4 V;
+uniform mat4 P;
+#include "drawTransform.glsl"
+uniform samplerBuffer materialBuffer;
+uniform samplerBuffer normalMatrixBuffer;
 
 void main()
 {
+    // Fetch the model matrix and material for this draw
+    mat4 M = drawTransform(drawData.x);
+    mat4 MV  = V * M;
+    mat4 MVP = P * MV;
+
+    vec4 material = texelFetch(materialBuffer, int(drawData.y));
+    ka = material.x;
+    kd = material.y;
+    ks = material.z;
+    Ns = material.w;
+    lightList = drawData.zw;
+
     // Output vertex position
     gl_Position = MVP * vec4(position, 1.0);
     
     // Output texture co-ordinates
     UV = uv;
     
-    // Calculate the TBN matrix that transforms view space to tangent space
-mat3 invMV = transpose(inverse(mat3(MV)));
-vec3 t     = normalize(invMV * tangent);
-vec3 n     = normalize(invMV * normal);
-t          = normalize(t - dot(t, n) * n);
-vec3 b     = cross(n, t);
-mat3 TBN   = transpose(mat3(t, b, n));
-
-    // Output tangent space fragment position, light positions and directions
-fragmentPosition = TBN * vec3(MV * vec4(position, 1.0));
-for (int i = 0; i < maxLights; i++)
-{
-    tangentSpaceLightPosition[i]  = TBN * lightSources[i].position;
-    tangentSpaceLightDirection[i] = TBN * lightSources[i].direction;
-}
+    // Calculate the TBN matrix that transforms tangent space to view space, using the
+    // object's normal matrix from the CPU (the view matrix is a rotation, so it applies as is)
+    int n3 = int(drawData.x) * 3;
+    mat3 normalMatrix = mat3(V) * mat3(texelFetch(normalMatrixBuffer, n3).xyz,
+                                       texelFetch(normalMatrixBuffer, n3 + 1).xyz,
+                                       texelFetch(normalMatrixBuffer, n3 + 2).xyz);
+    vec3 t     = normalize(normalMatrix * tangent);
+    vec3 n     = normalize(normalMatrix * normal);
+    t          = normalize(t - dot(t, n) * n);
+    vec3 b     = cross(n, t);
+    TBN        = mat3(t, b, n);
+
+    // Output view space fragment position (lighting is done in view space)
+    fragmentPosition = vec3(MV * vec4(position, 1.0));
 }
\ No newline at end of file